@@ -0,0 +1,135 @@
+/**
+ * @file azimuth_resampler.cc
+ *
+ * @brief resample a sweep's pulses onto a uniform azimuth grid
+ *
+ * @author John Brzustowski <jbrzusto is at fastmail dot fm>
+ * @version 0.1
+ * @date 2015
+ * @license GPL v2 or later
+ *
+ */
+
+#include "azimuth_resampler.h"
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <string.h>
+
+azimuth_resampler::azimuth_resampler (int n, double azi_begin, double azi_end, mode_type mode) :
+  n(n),
+  azi_begin(azi_begin),
+  azi_step(n > 1 ? (azi_end - azi_begin) / (n - 1.0) : 0),
+  mode(mode),
+  src(n)
+{
+  if (n < 1)
+    throw std::runtime_error("azimuth_resampler: need at least one output pulse");
+};
+
+azimuth_resampler::mode_type
+azimuth_resampler::mode_from_name (const std::string & name) {
+  if (name == "nearest")
+    return NEAREST;
+  if (name == "linear")
+    return LINEAR;
+  if (name == "max")
+    return MAX_HOLD;
+  throw std::runtime_error("azimuth_resampler: unknown mode " + name);
+};
+
+// out = a + (b - a) * w / 65536, rounded
+static void
+lerp_pulse (const t_sample * __restrict a, const t_sample * __restrict b, uint32_t w, t_sample * __restrict out, int ns) {
+  uint32_t v = 65536 - w;
+  for (int i = 0; i < ns; ++i)
+    out[i] = (t_sample) ((a[i] * v + b[i] * w + 32768) >> 16);
+};
+
+// out = max(out, a)
+static void
+max_pulse (const t_sample * __restrict a, t_sample * __restrict out, int ns) {
+  for (int i = 0; i < ns; ++i)
+    out[i] = a[i] > out[i] ? a[i] : out[i];
+};
+
+// sorts pulse numbers by azimuth
+struct azi_less {
+  const float * azi;
+  azi_less (const float * azi) : azi(azi) {};
+  bool operator() (int i, int j) const { return azi[i] < azi[j]; };
+};
+
+void
+azimuth_resampler::resample (const float * azi, const t_sample * samples, int np, int ns, t_sample * out) {
+  if (np < 1)
+    throw std::runtime_error("azimuth_resampler: no input pulses");
+
+  // azimuths normally increase through a sweep, but a flaky heading
+  // or azimuth pulse can put a few out of order
+  order.clear();
+  for (int k = 1; k < np; ++k) {
+    if (azi[k] < azi[k - 1]) {
+      order.resize(np);
+      for (int j = 0; j < np; ++j)
+        order[j] = j;
+      std::stable_sort(order.begin(), order.end(), azi_less(azi));
+      break;
+    }
+  }
+  const int * ord = order.empty() ? 0 : & order[0];
+#define PULSE(k) (ord ? ord[k] : (k))
+#define AZI(k) ((double) azi[PULSE(k)])
+#define SAMPLES(k) (samples + (size_t) PULSE(k) * ns)
+
+  // k is the last input pulse at or before the current output azimuth
+  // (or 0 if there is none); m is the first input pulse not yet
+  // assigned to an output pulse's MAX_HOLD bin
+  int k = 0, m = 0;
+  for (int i = 0; i < n; ++i, out += ns) {
+    double a = azi_begin + i * azi_step;
+    while (k + 1 < np && AZI(k + 1) <= a)
+      ++k;
+    int right = k + 1 < np && AZI(k) <= a ? k + 1 : k;
+    int nearest = a - AZI(k) <= AZI(right) - a ? k : right;
+    src[i] = PULSE(nearest);
+
+    switch (mode) {
+    case NEAREST:
+      memcpy(out, SAMPLES(nearest), ns * sizeof(t_sample));
+      break;
+
+    case LINEAR:
+      if (right == k || AZI(right) <= AZI(k)) {
+        memcpy(out, SAMPLES(k), ns * sizeof(t_sample));
+      } else {
+        double f = (a - AZI(k)) / (AZI(right) - AZI(k));
+        lerp_pulse(SAMPLES(k), SAMPLES(right), (uint32_t) (f * 65536 + 0.5), out, ns);
+      }
+      break;
+
+    case MAX_HOLD:
+      {
+        // the bin for this output pulse is [a - step / 2, a + step / 2);
+        // the first and last bins extend to cover all input pulses.
+        // Pulses below the bin were taken by earlier bins.
+        double hi = a + azi_step / 2;
+        bool any = false;
+        for (; m < np && (i == n - 1 || AZI(m) < hi); ++m) {
+          if (any) {
+            max_pulse(SAMPLES(m), out, ns);
+          } else {
+            memcpy(out, SAMPLES(m), ns * sizeof(t_sample));
+            any = true;
+          }
+        }
+        if (! any)
+          memcpy(out, SAMPLES(nearest), ns * sizeof(t_sample));
+      }
+      break;
+    }
+  }
+#undef PULSE
+#undef AZI
+#undef SAMPLES
+};
@@ -0,0 +1,70 @@
+/**
+ * @file azimuth_resampler.h
+ *
+ * @brief resample a sweep's pulses onto a uniform azimuth grid
+ *
+ * @author John Brzustowski <jbrzusto is at fastmail dot fm>
+ * @version 0.1
+ * @date 2015
+ * @license GPL v2 or later
+ *
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include "scan_converter.h"
+
+/**
+   @class azimuth_resampler
+   @brief Produce n pulses at evenly spaced azimuths from the
+   irregularly spaced pulses of a sweep, as needed by scan_converter.
+
+   Output pulse i is at azimuth azi_begin + i * (azi_end - azi_begin) / (n - 1).
+   Each is computed from the input pulses around it in one of these ways:
+
+   - NEAREST: a copy of the input pulse closest in azimuth
+
+   - LINEAR: interpolated sample by sample between the input pulses on
+     either side
+
+   - MAX_HOLD: the sample-by-sample maximum of all input pulses closer
+     to this output pulse than to any other; if there are none, the
+     nearest input pulse.  This keeps small targets that would be
+     dropped when there are more input than output pulses.
+
+   Output pulses before the first or after the last input pulse are
+   copies of that pulse.  The inner loops run over range, so the
+   compiler vectorizes them.
+*/
+
+class azimuth_resampler {
+ public:
+  //! how output pulses are computed from input pulses
+  enum mode_type {NEAREST, LINEAR, MAX_HOLD};
+
+  //! constructor; n output pulses from azi_begin to azi_end, inclusive
+  azimuth_resampler (int n, double azi_begin, double azi_end, mode_type mode = NEAREST);
+
+  //! resample the np x ns samples of a sweep into n x ns samples in
+  // out; azi gives the azimuth of each input pulse, as a fraction of
+  // the sweep 0..1
+  void resample (const float * azi, const t_sample * samples, int np, int ns, t_sample * out);
+
+  //! for each output pulse of the last call to resample(), the input
+  // pulse nearest to it in azimuth; use this to pick per-pulse
+  // metadata (clocks, trigs) to go with the resampled samples
+  const int * get_source_pulses () { return & src[0]; };
+
+  //! return the mode with a given name ("nearest", "linear" or "max");
+  // throws std::runtime_error if unknown
+  static mode_type mode_from_name (const std::string & name);
+
+ protected:
+  int n;              //!< number of output pulses
+  double azi_begin;   //!< azimuth of first output pulse
+  double azi_step;    //!< azimuth between output pulses
+  mode_type mode;     //!< how output pulses are computed
+  std::vector < int > order; //!< input pulses sorted by azimuth, if they weren't already
+  std::vector < int > src;   //!< input pulse nearest each output pulse
+};
@@ -0,0 +1,441 @@
+/**
+   @file bench_capture.cc
+   @brief microbenchmarks for the capture pipeline: shared_ring_buffer,
+   sweep_file_writer, azimuth_resampler, scan_converter and capture_db.
+
+   All data are synthetic, generated with fixed seeds, so runs are
+   comparable across machines and revisions.  For each benchmark we
+   report the time per item, throughput in MB/s, and percentiles of
+   per-item latency.
+
+   Geometry is that of our production images (see pushLiveImages.R):
+   3600 pulses of 3000 samples converted to 1875 x 1866 pixels at
+   4.8 m per pixel, with 3.6 m samples (decimation 3).
+
+   Usage: bench_capture [SCRATCH_FOLDER]
+
+   SCRATCH_FOLDER (default /tmp/bench_capture) receives sweep files and
+   the database; it is removed afterwards.
+
+   @author John Brzustowski <jbrzusto is at fastmail dot fm>
+   @license GPL v2 or later
+ */
+
+#include "shared_ring_buffer.h"
+#include "sweep_file_writer.h"
+#include "scan_converter.h"
+#include "azimuth_resampler.h"
+#include "capture_db.h"
+#include "pulse_metadata.h"
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <boost/filesystem.hpp>
+
+#define N_SAMPLES 3000
+#define PULSES_PER_SWEEP 3600
+#define IMAGE_WIDTH 1875
+#define IMAGE_HEIGHT 1866
+
+static double
+now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, & ts);
+  return ts.tv_sec + ts.tv_nsec / 1.0e9;
+};
+
+// fill samples with noise plus a few bright targets
+static void
+make_samples (uint16_t * samp, int n, unsigned int & seed) {
+  for (int i = 0; i < n; ++i)
+    samp[i] = (rand_r(& seed) & 0x3ff) + (i % 997 < 4 ? 0x3000 : 0);
+};
+
+// print one line of results: items processed in elapsed seconds,
+// with per-item latencies in lat (in seconds, sorted here)
+static void
+report (const std::string & name, const std::string & item, uint64_t items, double bytes, double elapsed, std::vector < double > & lat) {
+  std::sort(lat.begin(), lat.end());
+  std::cout << std::left << std::setw(34) << name << std::right << std::fixed
+            << std::setprecision(1) << std::setw(12) << 1e9 * elapsed / items << " ns/" << item
+            << std::setw(10) << bytes / elapsed / 1e6 << " MB/s";
+  if (! lat.empty()) {
+    static const double pct[] = {50, 90, 99, 99.9};
+    static const char * pct_name[] = {"p50", "p90", "p99", "p99.9"};
+    std::cout << "  latency (us):" << std::setprecision(2);
+    for (unsigned i = 0; i < sizeof(pct) / sizeof(pct[0]); ++i) {
+      size_t k = (size_t) (pct[i] / 100 * (lat.size() - 1));
+      std::cout << " " << pct_name[i] << " " << 1e6 * lat[k];
+    }
+    std::cout << " max " << 1e6 * lat.back();
+  }
+  std::cout << std::endl;
+};
+
+// -------------------- shared_ring_buffer --------------------
+
+// stores here keep the compiler from discarding loads we're timing
+static volatile uint64_t sink;
+
+#define RING_PULSES 200000
+#define RING_CHUNKS 4096
+
+struct ring_state {
+  shared_ring_buffer * srb;
+  int batch;
+  std::vector < double > lat;
+};
+
+static void *
+ring_writer (void * arg) {
+  ring_state * rs = (ring_state *) arg;
+  int psize = rs->srb->get_chunk_size();
+  std::vector < uint16_t > samp(N_SAMPLES);
+  unsigned int seed = 1;
+  make_samples(& samp[0], N_SAMPLES, seed);
+  for (int sent = 0; sent < RING_PULSES; ) {
+    chunk_span span[2];
+    int n = rs->srb->chunks_for_writing(std::min(rs->batch, RING_PULSES - sent), span);
+    double t = now();
+    for (int s = 0; s < 2; ++s) {
+      for (int i = 0; i < span[s].n; ++i) {
+        pulse_metadata * pm = (pulse_metadata *) (span[s].p + i * psize);
+        pm->magic_number = PULSE_METADATA_MAGIC;
+        memcpy(& pm->arp_clock_sec, & t, sizeof(t)); // timestamp for latency
+        memcpy(& pm->data[0], & samp[0], sizeof(uint16_t) * N_SAMPLES);
+      }
+    }
+    rs->srb->done_writing_chunks(n);
+    sent += n;
+  }
+  rs->srb->done();
+  return 0;
+};
+
+static void
+bench_ring (int batch) {
+  int psize = sizeof(pulse_metadata) + sizeof(uint16_t) * (N_SAMPLES - 1);
+  shared_ring_buffer srb(psize, RING_CHUNKS, shared_ring_buffer::BLOCK_WRITER);
+  ring_state rs;
+  rs.srb = & srb;
+  rs.batch = batch;
+  rs.lat.reserve(RING_PULSES);
+
+  double start = now();
+  pthread_t wt;
+  pthread_create(& wt, NULL, & ring_writer, & rs);
+  uint64_t sum = 0;
+  for (;;) {
+    chunk_span span[2];
+    if (! srb.wait_for_chunks(batch, span)) {
+      if (srb.is_done())
+        break;
+      continue;
+    }
+    double t = now();
+    for (int s = 0; s < 2; ++s) {
+      for (int i = 0; i < span[s].n; ++i) {
+        pulse_metadata * pm = (pulse_metadata *) (span[s].p + i * psize);
+        double t0;
+        memcpy(& t0, & pm->arp_clock_sec, sizeof(t0));
+        rs.lat.push_back(t - t0);
+        sum += pm->data[N_SAMPLES / 2];
+      }
+    }
+    srb.done_reading_chunk();
+  }
+  pthread_join(wt, NULL);
+  double elapsed = now() - start;
+  std::ostringstream name;
+  name << "ring buffer, batches of " << batch;
+  report(name.str(), "pulse", rs.lat.size(), (double) rs.lat.size() * psize, elapsed, rs.lat);
+  sink = sum;
+};
+
+// -------------------- sweep_file_writer --------------------
+
+#define WRITER_SWEEPS 10
+
+static void
+bench_sweep_writer (const std::string & folder, sweep_file_writer::write_method method, sample_codec::codec_type codec = sample_codec::NONE, sample_codec::filter_type filter = sample_codec::RANGE_DELTA) {
+  std::string name = "sweep_file_writer";
+  if (method == sweep_file_writer::DIRECT_WRITE)
+    name += " (direct)";
+  if (codec != sample_codec::NONE)
+    name += std::string(" (") + sample_codec(codec, filter).codec_name() + ", " + sample_codec(codec, filter).filter_name() + ")";
+  std::vector < uint16_t > samp(N_SAMPLES * 16);
+  unsigned int seed = 2;
+  make_samples(& samp[0], samp.size(), seed);
+
+  std::vector < double > pulse_lat, sweep_lat;
+  double start, elapsed;
+  sweep_file_writer_stats st;
+  {
+    sweep_file_writer sfw(folder, "BENCH", folder + "/log.txt", 4096, N_SAMPLES, 16, 0, 125, 3, "sum");
+    sfw.set_write_method(method);
+    sfw.set_compression(codec, filter);
+    start = now();
+    for (int k = 0; k <= WRITER_SWEEPS * PULSES_PER_SWEEP; ++k) {
+      int arp = k / PULSES_PER_SWEEP;
+      int i = k % PULSES_PER_SWEEP;
+      double ts = 1.6e9 + arp * 2.5 + i * (2.5 / PULSES_PER_SWEEP);
+      double t0 = now();
+      // the first pulse of each sweep hands the previous sweep to the I/O thread
+      sfw.record_pulse(ts, i, i * 69444, i / (double) PULSES_PER_SWEEP, arp, 0, 0, & samp[(k % 16) * N_SAMPLES]);
+      double t1 = now();
+      if (i == 0 && k > 0)
+        sweep_lat.push_back(t1 - t0);
+      else
+        pulse_lat.push_back(t1 - t0);
+    }
+    elapsed = now() - start;
+    st = sfw.get_stats();
+  }
+  // the destructor waits for the last sweeps to be written
+  double total = now() - start;
+  double pulse_bytes = 12 + 2.0 * N_SAMPLES;
+  double record_time = 0, sweep_time = 0;
+  for (unsigned i = 0; i < pulse_lat.size(); ++i)
+    record_time += pulse_lat[i];
+  for (unsigned i = 0; i < sweep_lat.size(); ++i)
+    sweep_time += sweep_lat[i];
+  report(name + "::record_pulse", "pulse", pulse_lat.size(), pulse_lat.size() * pulse_bytes, record_time, pulse_lat);
+  report(name + " new sweep", "sweep", sweep_lat.size(), sweep_lat.size() * PULSES_PER_SWEEP * pulse_bytes, sweep_time, sweep_lat);
+  std::vector < double > none;
+  report(name + " recording", "pulse", pulse_lat.size() + sweep_lat.size(), (pulse_lat.size() + sweep_lat.size()) * pulse_bytes, elapsed, none);
+  report(name + " incl. I/O", "pulse", pulse_lat.size() + sweep_lat.size(), (pulse_lat.size() + sweep_lat.size()) * pulse_bytes, total, none);
+  std::cout << "  sweeps written: " << st.sweeps_written << "; I/O thread busy at end of sweep: " << st.io_busy
+            << "; mean write: " << std::setprecision(1) << 1e3 * st.total_write_time / st.sweeps_written << " ms"
+            << "; longest write: " << 1e3 * st.max_write_time << " ms";
+  if (st.direct_fallbacks)
+    std::cout << "; written without O_DIRECT: " << st.direct_fallbacks;
+  if (st.sample_bytes_out)
+    std::cout << "; compression ratio: " << std::setprecision(2) << (double) st.sample_bytes_in / st.sample_bytes_out
+              << "; compression MB/s: " << std::setprecision(1) << st.sample_bytes_in / st.compress_time / 1e6;
+  std::cout << std::endl;
+};
+
+// -------------------- azimuth_resampler --------------------
+
+#define RESAMPLE_SWEEPS 10
+#define RAW_PULSES_PER_SWEEP 3857  // Bridgemaster E, short pulse, 28 RPM
+
+static void
+bench_azimuth_resampler (azimuth_resampler::mode_type mode, const char * name) {
+  std::vector < t_sample > samp((size_t) RAW_PULSES_PER_SWEEP * N_SAMPLES);
+  unsigned int seed = 5;
+  make_samples(& samp[0], samp.size(), seed);
+  // evenly spaced pulses, with jitter
+  std::vector < float > azi(RAW_PULSES_PER_SWEEP);
+  for (int i = 0; i < RAW_PULSES_PER_SWEEP; ++i)
+    azi[i] = (i + 0.3 * (rand_r(& seed) / (double) RAND_MAX)) / RAW_PULSES_PER_SWEEP;
+  std::vector < t_sample > out((size_t) PULSES_PER_SWEEP * N_SAMPLES);
+  azimuth_resampler ar(PULSES_PER_SWEEP, 0, (PULSES_PER_SWEEP - 1.0) / PULSES_PER_SWEEP, mode);
+
+  std::vector < double > lat;
+  double start = now();
+  for (int i = 0; i < RESAMPLE_SWEEPS; ++i) {
+    double t0 = now();
+    ar.resample(& azi[0], & samp[0], RAW_PULSES_PER_SWEEP, N_SAMPLES, & out[0]);
+    lat.push_back(now() - t0);
+  }
+  double elapsed = now() - start;
+  report(std::string("azimuth_resampler, ") + name, "sweep", RESAMPLE_SWEEPS, RESAMPLE_SWEEPS * (samp.size() + out.size()) * sizeof(t_sample), elapsed, lat);
+};
+
+// -------------------- scan_converter --------------------
+
+#define SCVT_CONSTRUCTIONS 5
+#define SCVT_APPLIES 20
+#define SCVT_THREADS 4
+#define SCVT_WEDGE 32    // pulses rendered at a time by apply_pulses()
+
+static scan_converter *
+make_production_scan_converter () {
+  double ppm = 1.0 / 4.8;          // pixels per metre
+  double mps = 2.99792458e8 / (125e6 / 3) / 2;  // metres per sample
+  double azi_begin = 46.8 / 360;   // from aziRangeOffsets.txt
+  return new scan_converter(PULSES_PER_SWEEP, N_SAMPLES, IMAGE_WIDTH, IMAGE_HEIGHT, 0, 0,
+                            IMAGE_WIDTH, (int) (3182 * ppm), true, ppm * mps, 0,
+                            azi_begin, azi_begin + (PULSES_PER_SWEEP - 1.0) / PULSES_PER_SWEEP);
+};
+
+static void
+bench_scan_converter (const std::string & folder) {
+  std::vector < double > lat;
+  double start = now();
+  scan_converter * sc = 0;
+  for (int i = 0; i < SCVT_CONSTRUCTIONS; ++i) {
+    delete sc;
+    double t0 = now();
+    sc = make_production_scan_converter();
+    lat.push_back(now() - t0);
+  }
+  double elapsed = now() - start;
+  double npix = (double) IMAGE_WIDTH * IMAGE_HEIGHT;
+  report("scan_converter construction", "image", SCVT_CONSTRUCTIONS, SCVT_CONSTRUCTIONS * npix * sizeof(t_pixel), elapsed, lat);
+  std::cout << "  index tables: " << sc->table_bytes() / 1048576.0 << " MB" << std::endl;
+
+  // warm starts from the table cache; the first construction writes it
+  scan_converter::cache_dir = folder + "/scvt_cache";
+  delete make_production_scan_converter();
+  lat.clear();
+  start = now();
+  for (int i = 0; i < SCVT_CONSTRUCTIONS; ++i) {
+    double t0 = now();
+    scan_converter * cached = make_production_scan_converter();
+    lat.push_back(now() - t0);
+    if (! cached->tables_mapped())
+      std::cout << "  ^^^ index tables not cached" << std::endl;
+    delete cached;
+  }
+  elapsed = now() - start;
+  report("scan_converter construction (cached)", "image", SCVT_CONSTRUCTIONS, SCVT_CONSTRUCTIONS * npix * sizeof(t_pixel), elapsed, lat);
+  scan_converter::cache_dir.clear();
+
+  // converters derived from the first, as when adjusting the display
+  const char * derived[] = {"scan_converter::rotated", "scan_converter::panned", "scan_converter::zoomed"};
+  for (int d = 0; d < 3; ++d) {
+    lat.clear();
+    start = now();
+    for (int i = 0; i < SCVT_CONSTRUCTIONS; ++i) {
+      double t0 = now();
+      scan_converter * dc = d == 0 ? sc->rotated(0.01 * (i + 1)) : d == 1 ? sc->panned(10 * (i + 1), -5 * (i + 1)) : sc->zoomed(1.25 + 0.1 * i);
+      lat.push_back(now() - t0);
+      delete dc;
+    }
+    elapsed = now() - start;
+    report(derived[d], "image", SCVT_CONSTRUCTIONS, SCVT_CONSTRUCTIONS * npix * sizeof(t_pixel), elapsed, lat);
+  }
+
+  std::vector < t_sample > samp((size_t) PULSES_PER_SWEEP * N_SAMPLES);
+  unsigned int seed = 3;
+  make_samples(& samp[0], samp.size(), seed);
+  std::vector < t_pixel > pix((size_t) IMAGE_WIDTH * IMAGE_HEIGHT);
+  std::vector < t_palette > pal(256);
+  for (int i = 0; i < 256; ++i)
+    pal[i] = 0xff000000 | (i * 0x010101);
+
+  // one pixel at a time, then with the vectorised kernel if the CPU
+  // has one, then with several threads
+  struct {const char * name; bool simd; int threads;} runs[] = {
+    {"scan_converter::apply (scalar)", false, 1},
+    {"scan_converter::apply (SIMD)", true, 1},
+    {"scan_converter::apply (threads)", true, SCVT_THREADS}
+  };
+  bool have_simd = sc->use_simd;
+  for (int r = 0; r < 3; ++r) {
+    if (runs[r].simd && ! have_simd)
+      continue;
+    sc->use_simd = runs[r].simd;
+    sc->set_threads(runs[r].threads);
+    lat.clear();
+    start = now();
+    for (int i = 0; i < SCVT_APPLIES; ++i) {
+      double t0 = now();
+      // the sample origin and scale used by pushLiveImages.R for decimation 3
+      sc->apply(& samp[0], & pix[0], IMAGE_WIDTH, & pal[0], 8192 * 3, (int) (0.5 + 3 * (16383 - 8192) / 255.0));
+      lat.push_back(now() - t0);
+    }
+    elapsed = now() - start;
+    report(runs[r].name, "image", SCVT_APPLIES, SCVT_APPLIES * (samp.size() * sizeof(t_sample) + npix * sizeof(t_pixel)), elapsed, lat);
+  }
+
+  // a sweep rendered a wedge at a time, as pulses arrive; the first
+  // call also lists the pixels of each pulse, so isn't timed
+  sc->use_simd = have_simd;
+  sc->apply_pulses(& samp[0], & pix[0], IMAGE_WIDTH, & pal[0], 8192 * 3, (int) (0.5 + 3 * (16383 - 8192) / 255.0), 0, 1);
+  lat.clear();
+  start = now();
+  int wedges = 0;
+  for (int i = 0; i < SCVT_APPLIES; ++i) {
+    for (int t = 0; t < PULSES_PER_SWEEP; t += SCVT_WEDGE, ++wedges) {
+      double t0 = now();
+      sc->apply_pulses(& samp[0], & pix[0], IMAGE_WIDTH, & pal[0], 8192 * 3, (int) (0.5 + 3 * (16383 - 8192) / 255.0), t, SCVT_WEDGE);
+      lat.push_back(now() - t0);
+    }
+  }
+  elapsed = now() - start;
+  report("scan_converter::apply_pulses (wedge)", "wedge", wedges, SCVT_APPLIES * (samp.size() * sizeof(t_sample) + npix * sizeof(t_pixel)), elapsed, lat);
+
+  // actual azimuths, as from a sweep file; the first call also
+  // computes each pixel's polar coordinates, so isn't timed
+  std::vector < float > azi(RAW_PULSES_PER_SWEEP);
+  for (int i = 0; i < RAW_PULSES_PER_SWEEP; ++i)
+    azi[i] = (i + 0.3 * (rand_r(& seed) / (double) RAND_MAX)) / RAW_PULSES_PER_SWEEP;
+  sc->set_azimuths(& azi[0], RAW_PULSES_PER_SWEEP);
+  lat.clear();
+  start = now();
+  for (int i = 0; i < SCVT_CONSTRUCTIONS; ++i) {
+    double t0 = now();
+    sc->set_azimuths(& azi[0], RAW_PULSES_PER_SWEEP - (i & 1));
+    lat.push_back(now() - t0);
+  }
+  elapsed = now() - start;
+  report("scan_converter::set_azimuths", "sweep", SCVT_CONSTRUCTIONS, SCVT_CONSTRUCTIONS * npix * sizeof(t_pixel), elapsed, lat);
+  delete sc;
+};
+
+// -------------------- capture_db --------------------
+
+#define DB_PULSES 20000
+#define DB_SAMPLES 1024
+
+static void
+bench_capture_db (const std::string & folder) {
+  std::vector < uint16_t > samp(DB_SAMPLES * 16);
+  unsigned int seed = 4;
+  make_samples(& samp[0], samp.size(), seed);
+
+  std::vector < double > lat;
+  double start;
+  {
+    capture_db cap(folder + "/bench.sqlite");
+    cap.set_radar_mode(25e3, 100, 1800, 28);
+    cap.set_digitize_mode(64e6, 16, 1, DB_SAMPLES);
+    cap.set_retain_mode("full");
+    start = now();
+    for (int k = 0; k < DB_PULSES; ++k) {
+      int arp = k / PULSES_PER_SWEEP;
+      int i = k % PULSES_PER_SWEEP;
+      double t0 = now();
+      cap.record_pulse(1.6e9 + k / 1800.0, i, i * 69444, i / (double) PULSES_PER_SWEEP, arp, 0, 0, & samp[(k % 16) * DB_SAMPLES]);
+      lat.push_back(now() - t0);
+    }
+  }
+  // include the final commit
+  double elapsed = now() - start;
+  report("capture_db::record_pulse", "pulse", DB_PULSES, DB_PULSES * (40.0 + 2 * DB_SAMPLES), elapsed, lat);
+};
+
+int
+main (int argc, char *argv[]) {
+  std::string folder = argc > 1 ? argv[1] : "/tmp/bench_capture";
+  boost::filesystem::remove_all(folder);
+  boost::filesystem::create_directories(folder);
+
+  bench_ring(1);
+  bench_ring(64);
+  bench_sweep_writer(folder, sweep_file_writer::BUFFERED_WRITE);
+  bench_sweep_writer(folder, sweep_file_writer::DIRECT_WRITE);
+  bench_sweep_writer(folder, sweep_file_writer::BUFFERED_WRITE, sample_codec::DEFLATE, sample_codec::RANGE_DELTA);
+  bench_sweep_writer(folder, sweep_file_writer::BUFFERED_WRITE, sample_codec::DEFLATE, sample_codec::PULSE_DELTA);
+  bench_azimuth_resampler(azimuth_resampler::NEAREST, "nearest");
+  bench_azimuth_resampler(azimuth_resampler::LINEAR, "linear");
+  bench_azimuth_resampler(azimuth_resampler::MAX_HOLD, "max");
+  bench_scan_converter(folder);
+  bench_capture_db(folder);
+
+  boost::filesystem::remove_all(folder);
+  return 0;
+}
@@ -15,6 +15,10 @@
 #include "Rinternals.h"
 
 #include "scan_converter.h"
+#include "sweep_file_reader.h"
+#include "azimuth_resampler.h"
+#include <stdexcept>
+#include <string.h>
 
 scan_converter * _make_scan_converter (int nr,
                                        int nc,
@@ -28,10 +32,11 @@ scan_converter * _make_scan_converter (int nr,
                                        double scale,
                                        double first_range,
                                        double azi_begin,
-                                       double azi_end
+                                       double azi_end,
+                                       int threads
                                        )
 {
-  return new scan_converter(nr, nc, w, h, x0, y0, xc, yc, always_smooth_angular, scale, first_range, azi_begin, azi_end);
+  return new scan_converter(nr, nc, w, h, x0, y0, xc, yc, always_smooth_angular, scale, first_range, azi_begin, azi_end, threads);
 };
 
 void _delete_scan_converter (scan_converter *sc) {
@@ -44,16 +49,105 @@ void _apply_scan_converter (scan_converter *sc,
                             int span,
                             t_palette *pal,
                             int sample_origin,
-                            int sample_scale)
+                            int sample_scale,
+                            int threads)
 {
+  if (threads > 0 && threads != sc->get_threads())
+    sc->set_threads(threads);
   sc->apply(samp, pix, span, pal, sample_origin, sample_scale);
 };
 
+void _apply_scan_converter_pulses (scan_converter *sc,
+                                   t_sample *samp,
+                                   t_pixel *pix,
+                                   int span,
+                                   t_palette *pal,
+                                   int sample_origin,
+                                   int sample_scale,
+                                   int first,
+                                   int n)
+{
+  sc->apply_pulses(samp, pix, span, pal, sample_origin, sample_scale, first, n);
+};
+
+// copy the reason for a failure to err, so the caller can raise an R
+// error once C++ frames have unwound; this includes std::bad_alloc
+// and std::length_error, from sizes read from files
+static void _copy_reason (const std::exception & e, char * err, int n) {
+  strncpy(err, e.what(), n - 1);
+  err[n - 1] = 0;
+};
+
+// open a sweep file; on failure, copy the reason to err and return NULL,
+// so the caller can raise an R error without unwinding C++ frames
+sweep_file_reader * _open_sweep_file (const char * path, bool verify, char * err, int n) {
+  try {
+    return new sweep_file_reader(path, verify);
+  } catch (std::exception & e) {
+    _copy_reason(e, err, n);
+    return 0;
+  }
+};
+
+void _delete_sweep_file (sweep_file_reader *sfr) {
+  delete sfr;
+};
+
+// resample a sweep onto n evenly spaced pulses, recording the
+// 1-based input pulse nearest each in pulses; on failure, copy the
+// reason to err and return false
+bool _resample_sweep (const float * azi, const t_sample * samples, int np, int ns,
+                      int n, double azi_begin, double azi_end, const char * mode,
+                      t_sample * out, int * pulses, char * err, int errlen) {
+  try {
+    azimuth_resampler ar(n, azi_begin, azi_end, azimuth_resampler::mode_from_name(mode));
+    ar.resample(azi, samples, np, ns, out);
+    for (int i = 0; i < n; ++i)
+      pulses[i] = ar.get_source_pulses()[i] + 1;
+    return true;
+  } catch (std::exception & e) {
+    _copy_reason(e, err, errlen);
+    return false;
+  }
+};
+
+// set a converter's pulse azimuths; on failure, copy the reason to
+// err and return false
+bool _set_scan_converter_azimuths (scan_converter * sc, const float * azi, int np, double azi_offset, char * err, int n) {
+  try {
+    sc->set_azimuths(azi, np, azi_offset);
+    return true;
+  } catch (std::exception & e) {
+    _copy_reason(e, err, n);
+    return false;
+  }
+};
+
+// derive a converter from sc: rotated by turns, panned by dx, dy or
+// zoomed by factor, as how is 'r', 'p' or 'z'; on failure, copy the
+// reason to err and return NULL
+scan_converter * _derive_scan_converter (scan_converter * sc, char how, double turns, int dx, int dy, double factor, char * err, int n) {
+  try {
+    switch (how) {
+    case 'r':
+      return sc->rotated(turns);
+    case 'p':
+      return sc->panned(dx, dy);
+    default:
+      return sc->zoomed(factor);
+    }
+  } catch (std::exception & e) {
+    _copy_reason(e, err, n);
+    return 0;
+  }
+};
+
 extern "C" {
 #include <R_ext/Visibility.h>
 #include <R_ext/Rdynload.h>
 #include "R.h"
 #include "Rinternals.h"
+#include "Rversion.h"
 #include "latest_pulse_timestamp.h"
 
 SEXP
@@ -61,6 +155,7 @@ get_latest_pulse_timestamp() {
   return ScalarReal(latest_pulse_timestamp());
 }
 
+// int_args: nr, nc, w, h, x0, y0, xc, yc, always_smooth_angular, and optionally threads
 SEXP
 make_scan_converter (SEXP int_args, SEXP double_args) {
   scan_converter * sc = _make_scan_converter (
@@ -76,7 +171,8 @@ make_scan_converter (SEXP int_args, SEXP double_args) {
                         REAL(double_args)[0],
                         REAL(double_args)[1],
                         REAL(double_args)[2],
-                        REAL(double_args)[3]
+                        REAL(double_args)[3],
+                        LENGTH(int_args) > 9 ? INTEGER(int_args)[9] : 1
                                               );
   return R_MakeExternalPtr(sc, 0, 0);
 };
@@ -86,10 +182,283 @@ delete_scan_converter (SEXP sc_handle) {
   _delete_scan_converter ((scan_converter *) EXTPTR_PTR(sc_handle));
 };
 
+// int_args: span, sample_origin, sample_scale, and optionally threads
 SEXP
 apply_scan_converter (SEXP sc_handle, SEXP samples, SEXP pixels, SEXP palette, SEXP int_args) {
   scan_converter * scp = (scan_converter *) EXTPTR_PTR(sc_handle);
-  _apply_scan_converter(scp, (unsigned short *) RAW(samples), (unsigned int *) INTEGER(pixels), INTEGER(int_args)[0], (unsigned int *) INTEGER(palette), INTEGER(int_args)[1], INTEGER(int_args)[2]);
+  _apply_scan_converter(scp, (unsigned short *) RAW(samples), (unsigned int *) INTEGER(pixels), INTEGER(int_args)[0], (unsigned int *) INTEGER(palette), INTEGER(int_args)[1], INTEGER(int_args)[2], LENGTH(int_args) > 3 ? INTEGER(int_args)[3] : 0);
+  return R_NilValue;
+};
+
+// sweep files are held by R as external pointers, closed by the
+// garbage collector or by close_sweep_file().  The samples are
+// returned as an ALTREP raw vector over the file's mapping, so a
+// sweep is not copied into R memory unless R has to modify it.
+
+static void
+sweep_file_finalizer (SEXP sf_handle) {
+  sweep_file_reader * sfr = (sweep_file_reader *) R_ExternalPtrAddr(sf_handle);
+  if (sfr) {
+    _delete_sweep_file (sfr);
+    R_ClearExternalPtr(sf_handle);
+  }
+};
+
+static sweep_file_reader *
+sweep_file_ptr (SEXP sf_handle) {
+  sweep_file_reader * sfr = (sweep_file_reader *) R_ExternalPtrAddr(sf_handle);
+  if (! sfr)
+    error("sweep file has been closed");
+  return sfr;
+};
+
+SEXP
+open_sweep_file (SEXP path, SEXP verify) {
+  char err[256];
+  sweep_file_reader * sfr = _open_sweep_file (CHAR(STRING_ELT(path, 0)), LOGICAL(verify)[0], err, sizeof(err));
+  if (! sfr)
+    error("%s", err);
+  SEXP rv = PROTECT(R_MakeExternalPtr(sfr, install("sweep_file"), R_NilValue));
+  R_RegisterCFinalizerEx(rv, sweep_file_finalizer, TRUE);
+  UNPROTECT(1);
+  return rv;
+};
+
+SEXP
+close_sweep_file (SEXP sf_handle) {
+  sweep_file_finalizer (sf_handle);
+  return R_NilValue;
+};
+
+SEXP
+get_sweep_file_header (SEXP sf_handle) {
+  return mkString(sweep_file_ptr(sf_handle)->get_header().c_str());
+};
+
+SEXP
+get_sweep_file_columns (SEXP sf_handle) {
+  sweep_file_reader * sfr = sweep_file_ptr(sf_handle);
+  int np = sfr->get_np();
+  SEXP rv = PROTECT(allocVector(VECSXP, 3));
+  SEXP names = PROTECT(allocVector(STRSXP, 3));
+  SEXP clocks = allocVector(INTSXP, np);
+  SET_VECTOR_ELT(rv, 0, clocks);
+  memcpy(INTEGER(clocks), sfr->get_clocks(), np * sizeof(int));
+  SEXP azi = allocVector(REALSXP, np);
+  SET_VECTOR_ELT(rv, 1, azi);
+  const float * a = sfr->get_azi();
+  for (int i = 0; i < np; ++i)
+    REAL(azi)[i] = a[i];
+  SEXP trigs = allocVector(INTSXP, np);
+  SET_VECTOR_ELT(rv, 2, trigs);
+  memcpy(INTEGER(trigs), sfr->get_trigs(), np * sizeof(int));
+  SET_STRING_ELT(names, 0, mkChar("clocks"));
+  SET_STRING_ELT(names, 1, mkChar("azi"));
+  SET_STRING_ELT(names, 2, mkChar("trigs"));
+  setAttrib(rv, R_NamesSymbol, names);
+  UNPROTECT(2);
+  return rv;
+};
+
+#if R_VERSION >= R_Version(3, 5, 0)
+
+#include <R_ext/Altrep.h>
+
+// an ALTREP raw vector of a sweep's samples; data1 is the sweep file's
+// external pointer, which keeps the mapping alive.  The mapping is
+// shared by every vector over the same file, so the first time R asks
+// for a writeable pointer, the samples are copied into an ordinary
+// raw vector held in data2, which is used from then on.
+
+static R_altrep_class_t sweep_samples_class;
+
+static R_xlen_t
+sweep_samples_Length (SEXP x) {
+  SEXP copy = R_altrep_data2(x);
+  if (copy != R_NilValue)
+    return XLENGTH(copy);
+  sweep_file_reader * sfr = sweep_file_ptr(R_altrep_data1(x));
+  return (R_xlen_t) sfr->get_np() * sfr->get_ns() * sizeof(uint16_t);
+};
+
+static void *
+sweep_samples_Dataptr (SEXP x, Rboolean writeable) {
+  SEXP copy = R_altrep_data2(x);
+  if (copy != R_NilValue)
+    return RAW(copy);
+  if (! writeable)
+    return (void *) sweep_file_ptr(R_altrep_data1(x))->get_samples();
+  // writes must not show through other vectors over the same mapping
+  R_xlen_t n = sweep_samples_Length(x);
+  copy = PROTECT(allocVector(RAWSXP, n));
+  memcpy(RAW(copy), sweep_file_ptr(R_altrep_data1(x))->get_samples(), n);
+  R_set_altrep_data2(x, copy);
+  UNPROTECT(1);
+  return RAW(copy);
+};
+
+static const void *
+sweep_samples_Dataptr_or_null (SEXP x) {
+  SEXP copy = R_altrep_data2(x);
+  if (copy != R_NilValue)
+    return RAW(copy);
+  return sweep_file_ptr(R_altrep_data1(x))->get_samples();
+};
+
+static Rboolean
+sweep_samples_Inspect (SEXP x, int pre, int deep, int pvec, void (*inspect_subtree)(SEXP, int, int, int)) {
+  Rprintf(" sweep_samples\n");
+  return TRUE;
+};
+
+static void
+init_sweep_samples_class (DllInfo *info) {
+  sweep_samples_class = R_make_altraw_class("sweep_samples", "capture_lib", info);
+  R_set_altrep_Length_method(sweep_samples_class, sweep_samples_Length);
+  R_set_altrep_Inspect_method(sweep_samples_class, sweep_samples_Inspect);
+  R_set_altvec_Dataptr_method(sweep_samples_class, sweep_samples_Dataptr);
+  R_set_altvec_Dataptr_or_null_method(sweep_samples_class, sweep_samples_Dataptr_or_null);
+};
+
+SEXP
+get_sweep_file_samples (SEXP sf_handle) {
+  sweep_file_ptr(sf_handle);
+  return R_new_altrep(sweep_samples_class, sf_handle, R_NilValue);
+};
+
+#else
+
+// without ALTREP, samples must be copied into an ordinary raw vector
+
+SEXP
+get_sweep_file_samples (SEXP sf_handle) {
+  sweep_file_reader * sfr = sweep_file_ptr(sf_handle);
+  size_t n = (size_t) sfr->get_np() * sfr->get_ns() * sizeof(uint16_t);
+  SEXP rv = allocVector(RAWSXP, n);
+  memcpy(RAW(rv), sfr->get_samples(), n);
+  return rv;
+};
+
+#endif
+
+// resampled samples are returned as a raw vector with attribute
+// "pulses", the input pulse nearest each output pulse, for subsetting
+// the other columns
+
+static SEXP
+resample (const float * azi, const t_sample * samples, int np, int ns, SEXP int_args, SEXP double_args, SEXP mode) {
+  int n = INTEGER(int_args)[0];
+  if (n < 1)
+    error("need at least one output pulse");
+  SEXP rv = PROTECT(allocVector(RAWSXP, (R_xlen_t) n * ns * sizeof(t_sample)));
+  SEXP pulses = PROTECT(allocVector(INTSXP, n));
+  char err[256];
+  bool ok = _resample_sweep (azi, samples, np, ns, n, REAL(double_args)[0], REAL(double_args)[1],
+                             CHAR(STRING_ELT(mode, 0)), (t_sample *) RAW(rv), INTEGER(pulses), err, sizeof(err));
+  if (! ok) {
+    UNPROTECT(2);
+    error("%s", err);
+  }
+  setAttrib(rv, install("pulses"), pulses);
+  UNPROTECT(2);
+  return rv;
+};
+
+SEXP
+resample_sweep (SEXP azi, SEXP samples, SEXP int_args, SEXP double_args, SEXP mode) {
+  // int_args: n, ns; double_args: azi_begin, azi_end
+  int np = LENGTH(azi);
+  int ns = INTEGER(int_args)[1];
+  if ((R_xlen_t) np * ns * (R_xlen_t) sizeof(t_sample) > XLENGTH(samples))
+    error("too few samples for %d pulses of %d samples", np, ns);
+  // R_alloc'd, so it is freed even if resample() raises an error
+  float * a = (float *) R_alloc(np, sizeof(float));
+  for (int i = 0; i < np; ++i)
+    a[i] = REAL(azi)[i];
+  return resample(a, (t_sample *) RAW(samples), np, ns, int_args, double_args, mode);
+};
+
+SEXP
+resample_sweep_file (SEXP sf_handle, SEXP int_args, SEXP double_args, SEXP mode) {
+  // int_args: n; double_args: azi_begin, azi_end
+  sweep_file_reader * sfr = sweep_file_ptr(sf_handle);
+  return resample(sfr->get_azi(), sfr->get_samples(), sfr->get_np(), sfr->get_ns(), int_args, double_args, mode);
+};
+
+SEXP
+apply_scan_converter_to_sweep_file (SEXP sc_handle, SEXP sf_handle, SEXP pixels, SEXP palette, SEXP int_args) {
+  scan_converter * scp = (scan_converter *) EXTPTR_PTR(sc_handle);
+  sweep_file_reader * sfr = sweep_file_ptr(sf_handle);
+  if (sfr->get_ns() != scp->get_nc() || sfr->get_np() < scp->get_nr())
+    error("sweep file has %d pulses of %d samples, but scan converter needs at least %d pulses of %d samples",
+          sfr->get_np(), sfr->get_ns(), scp->get_nr(), scp->get_nc());
+  _apply_scan_converter(scp, (t_sample *) sfr->get_samples(), (unsigned int *) INTEGER(pixels), INTEGER(int_args)[0], (unsigned int *) INTEGER(palette), INTEGER(int_args)[1], INTEGER(int_args)[2], LENGTH(int_args) > 3 ? INTEGER(int_args)[3] : 0);
+  return R_NilValue;
+};
+
+// int_args: span, sample_origin, sample_scale, first pulse (1-based), number of pulses
+SEXP
+apply_scan_converter_pulses (SEXP sc_handle, SEXP samples, SEXP pixels, SEXP palette, SEXP int_args) {
+  scan_converter * scp = (scan_converter *) EXTPTR_PTR(sc_handle);
+  int nr = scp->get_nr(), nc = scp->get_nc(), first = INTEGER(int_args)[3], n = INTEGER(int_args)[4];
+  if ((R_xlen_t) nr * nc * (R_xlen_t) sizeof(t_sample) > XLENGTH(samples))
+    error("too few samples for %d pulses of %d samples", nr, nc);
+  if (first < 1 || first > nr || n < 0 || n > nr)
+    error("first pulse %d must be from 1 to %d, and number of pulses %d from 0 to %d", first, nr, n, nr);
+  _apply_scan_converter_pulses(scp, (unsigned short *) RAW(samples), (unsigned int *) INTEGER(pixels), INTEGER(int_args)[0], (unsigned int *) INTEGER(palette), INTEGER(int_args)[1], INTEGER(int_args)[2], first - 1, n);
+  return R_NilValue;
+};
+
+SEXP
+set_scan_converter_azimuths (SEXP sc_handle, SEXP azi, SEXP azi_offset) {
+  // azi: azimuth of each pulse [0..1]; NA for pulses not to be drawn
+  scan_converter * scp = (scan_converter *) EXTPTR_PTR(sc_handle);
+  int np = LENGTH(azi);
+  if (np < 1)
+    error("need at least one pulse azimuth");
+  float * a = (float *) R_alloc(np, sizeof(float));
+  for (int i = 0; i < np; ++i)
+    a[i] = REAL(azi)[i];  // NA_real_ is a NaN
+  char err[256];
+  if (! _set_scan_converter_azimuths(scp, a, np, REAL(azi_offset)[0], err, sizeof(err)))
+    error("%s", err);
+  return R_NilValue;
+};
+
+// converters derived from sc_handle's, for adjusting a live display;
+// each returns a new converter, which is deleted as usual
+
+static SEXP
+derive (SEXP sc_handle, char how, double turns, int dx, int dy, double factor) {
+  char err[256];
+  scan_converter * sc = _derive_scan_converter((scan_converter *) EXTPTR_PTR(sc_handle), how, turns, dx, dy, factor, err, sizeof(err));
+  if (! sc)
+    error("%s", err);
+  return R_MakeExternalPtr(sc, 0, 0);
+};
+
+SEXP
+rotate_scan_converter (SEXP sc_handle, SEXP turns) {
+  // turns: rotation [0..1] in the direction of increasing azimuth
+  return derive(sc_handle, 'r', REAL(turns)[0], 0, 0, 1);
+};
+
+SEXP
+pan_scan_converter (SEXP sc_handle, SEXP int_args) {
+  // int_args: dx, dy; pixels by which to move the view right and down
+  return derive(sc_handle, 'p', 0, INTEGER(int_args)[0], INTEGER(int_args)[1], 1);
+};
+
+SEXP
+zoom_scan_converter (SEXP sc_handle, SEXP factor) {
+  // factor: magnification about the centre of the data
+  return derive(sc_handle, 'z', 0, 0, 0, REAL(factor)[0]);
+};
+
+SEXP
+set_scan_converter_cache (SEXP dir) {
+  // dir: directory in which to cache scan converter index tables; "" for none
+  scan_converter::cache_dir = CHAR(STRING_ELT(dir, 0));
   return R_NilValue;
 };
 
@@ -100,6 +469,20 @@ R_CallMethodDef capture_lib_call_methods[]  = {
   MKREF(make_scan_converter, 2),
   MKREF(delete_scan_converter, 1),
   MKREF(apply_scan_converter, 5),
+  MKREF(apply_scan_converter_pulses, 5),
+  MKREF(open_sweep_file, 2),
+  MKREF(close_sweep_file, 1),
+  MKREF(get_sweep_file_header, 1),
+  MKREF(get_sweep_file_columns, 1),
+  MKREF(get_sweep_file_samples, 1),
+  MKREF(apply_scan_converter_to_sweep_file, 5),
+  MKREF(resample_sweep, 5),
+  MKREF(resample_sweep_file, 4),
+  MKREF(set_scan_converter_azimuths, 3),
+  MKREF(set_scan_converter_cache, 1),
+  MKREF(rotate_scan_converter, 2),
+  MKREF(pan_scan_converter, 2),
+  MKREF(zoom_scan_converter, 2),
   {NULL, NULL, 0}
 };
 
@@ -111,6 +494,9 @@ R_init_capture_lib(DllInfo *info)
   // set RPC timeout so that loading the seascan library
   // doesn't take forever
   R_registerRoutines(info, NULL, capture_lib_call_methods, NULL, NULL);
+#if R_VERSION >= R_Version(3, 5, 0)
+  init_sweep_samples_class(info);
+#endif
 }
 
 void
@@ -0,0 +1,73 @@
+/**
+   @file crc32c.cc
+   @author John Brzustowski <jbrzusto is at fastmail dot fm>
+   @version 0.1
+   @date 2015
+   @license GPL v2 or later
+ */
+
+#include "crc32c.h"
+#include <string.h>
+
+//! reversed Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78
+
+// slicing-by-8 tables; table[k][b] is the CRC of byte b followed by k zero bytes
+static uint32_t table[8][256];
+
+static bool
+make_table () {
+  for (int b = 0; b < 256; ++b) {
+    uint32_t c = b;
+    for (int i = 0; i < 8; ++i)
+      c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+    table[0][b] = c;
+  }
+  for (int b = 0; b < 256; ++b)
+    for (int k = 1; k < 8; ++k)
+      table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+  return true;
+};
+
+static uint32_t
+crc32c_sw (uint32_t crc, const unsigned char * p, size_t n) {
+  static bool have_table = make_table();
+  (void) have_table;
+  for (; n >= 8; n -= 8, p += 8) {
+    uint64_t v;
+    memcpy(& v, p, 8);
+    v ^= crc;
+    crc = table[7][v & 0xff] ^ table[6][(v >> 8) & 0xff] ^ table[5][(v >> 16) & 0xff] ^ table[4][(v >> 24) & 0xff]
+      ^ table[3][(v >> 32) & 0xff] ^ table[2][(v >> 40) & 0xff] ^ table[1][(v >> 48) & 0xff] ^ table[0][v >> 56];
+  }
+  while (n--)
+    crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+  return crc;
+};
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hw (uint32_t crc, const unsigned char * p, size_t n) {
+  uint64_t c = crc;
+  for (; n >= 8; n -= 8, p += 8) {
+    uint64_t v;
+    memcpy(& v, p, 8);
+    c = __builtin_ia32_crc32di(c, v);
+  }
+  while (n--)
+    c = __builtin_ia32_crc32qi(c, *p++);
+  return c;
+};
+#endif
+
+uint32_t
+crc32c (uint32_t crc, const void * p, size_t n) {
+  crc = ~crc;
+#if defined(__x86_64__)
+  static bool have_hw = __builtin_cpu_supports("sse4.2");
+  if (have_hw)
+    return ~crc32c_hw(crc, (const unsigned char *) p, n);
+#endif
+  return ~crc32c_sw(crc, (const unsigned char *) p, n);
+};
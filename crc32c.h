@@ -0,0 +1,18 @@
+/**
+   @file crc32c.h
+   @brief CRC32C (Castagnoli) checksum, as used by version 2 sweep files
+   @author John Brzustowski <jbrzusto is at fastmail dot fm>
+   @version 0.1
+   @date 2015
+   @license GPL v2 or later
+ */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+//! return the CRC32C of n bytes at p, continuing from crc, which is the
+// CRC32C of the preceding bytes (0 if there are none).  So
+// crc32c(crc32c(0, a, na), b, nb) is the CRC32C of a followed by b.
+// Uses the SSE4.2 crc32 instruction when the CPU has it.
+uint32_t crc32c (uint32_t crc, const void * p, size_t n);
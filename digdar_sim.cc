@@ -0,0 +1,385 @@
+/* -*- c++ -*- */
+/*
+ * @file digdar_sim.cc
+ *
+ * @brief Simulate a digdar digitizer: send pulse_metadata frames over
+ * TCP, paced like a real radar, so that rpcapture can be exercised
+ * and measured without a Red Pitaya attached.
+ *
+ * Pulses are sent in chunks of CHUNK pulses per write, as digdar does
+ * with its -c option.  Each pulse's trigger time is spaced by 1/PRF,
+ * with optional random jitter, and an ARP (start of sweep) occurs
+ * every ARP_PERIOD seconds.  Samples are a fixed synthetic pattern.
+ *
+ * In benchmark mode, digdar_sim runs rpcapture (with --once) at
+ * increasing PRFs, sending SECONDS worth of pulses at each, and
+ * reports the highest rate at which rpcapture dropped no pulses and
+ * the sender was able to keep pace.
+ *
+ * @author John Brzustowski <jbrzusto is at fastmail dot fm>
+ * @version 0.1
+ * @date 2015
+ * @license GPL v3 or later
+ *
+ */
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+#include "pulse_metadata.h"
+
+namespace po = boost::program_options;
+
+//! number of distinct sample patterns cycled through
+#define NUM_PATTERNS 64
+
+//! ADC clock rate, in Hz; trig_clock counts these
+#define ADC_CLOCK 125.0e6
+
+//! parameters of a simulated digitizer
+struct sim_params {
+  std::string host;     //!< host to connect to
+  std::string port;     //!< port to connect to
+  int n_samples;        //!< samples per pulse
+  double prf;           //!< pulses per second; 0 means as fast as possible
+  double arp_period;    //!< seconds per sweep
+  double jitter;        //!< random jitter in pulse spacing, as a fraction of 1/PRF
+  int chunk;            //!< pulses sent per write
+  long long num_pulses; //!< pulses to send; 0 means forever
+};
+
+//! outcome of one simulated run
+struct sim_result {
+  long long pulses;     //!< pulses sent
+  double elapsed;       //!< seconds taken to send them
+};
+
+static double
+now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, & ts);
+  return ts.tv_sec + ts.tv_nsec / 1.0e9;
+};
+
+// connect to host:port, retrying for up to timeout seconds while
+// nothing is listening; returns the socket
+static int
+connect_to (const std::string & host, const std::string & port, double timeout) {
+  struct addrinfo hints, *result;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  int s = getaddrinfo(host.c_str(), port.c_str(), &hints, &result);
+  if (s != 0)
+    throw std::runtime_error(std::string("getaddrinfo: ") + gai_strerror(s));
+
+  double give_up = now() + timeout;
+  for (;;) {
+    int fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (fd >= 0 && connect(fd, result->ai_addr, result->ai_addrlen) == 0) {
+      freeaddrinfo(result);
+      return fd;
+    }
+    if (fd >= 0)
+      close(fd);
+    if (now() > give_up) {
+      freeaddrinfo(result);
+      throw std::runtime_error("unable to connect to " + host + ":" + port);
+    }
+    usleep(20000);
+  }
+};
+
+// write all n bytes of p to fd; returns false on error
+static bool
+write_all (int fd, const unsigned char * p, size_t n) {
+  while (n > 0) {
+    ssize_t m = write(fd, p, n);
+    if (m < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p += m;
+    n -= m;
+  }
+  return true;
+};
+
+// send pulses as described by sp; returns what was sent
+static sim_result
+simulate (const sim_params & sp) {
+  int psize = sizeof(pulse_metadata) + sizeof(uint16_t) * (sp.n_samples - 1);
+  int fd = connect_to(sp.host, sp.port, 10);
+
+  // sample patterns: a ramp with a few bright "targets", shifted for each pattern
+  std::vector < uint16_t > patterns(NUM_PATTERNS * sp.n_samples);
+  for (int k = 0; k < NUM_PATTERNS; ++k)
+    for (int j = 0; j < sp.n_samples; ++j)
+      patterns[k * sp.n_samples + j] = ((j * 7 + k * 13) & 0x3ff) + ((j + 8 * k) % 500 < 5 ? 0x3000 : 0);
+
+  std::vector < unsigned char > buf(sp.chunk * psize);
+  unsigned int seed = 1;
+  double pri = sp.prf > 0 ? 1.0 / sp.prf : 0;
+
+  // realtime clock at the most recent ARP, as digdar reports it
+  struct timespec arp_ts;
+  clock_gettime(CLOCK_REALTIME, & arp_ts);
+  uint32_t num_arp = 0;
+  uint32_t num_trig = 0;
+  double since_arp = 0; // seconds since ARP of the next pulse
+
+  double start = now();
+  long long sent = 0;
+  while (sp.num_pulses == 0 || sent < sp.num_pulses) {
+    int n = sp.chunk;
+    if (sp.num_pulses > 0 && sp.num_pulses - sent < n)
+      n = sp.num_pulses - sent;
+
+    for (int i = 0; i < n; ++i) {
+      pulse_metadata * pm = (pulse_metadata *) & buf[i * psize];
+      if (since_arp >= sp.arp_period) {
+        since_arp -= sp.arp_period;
+        long ns = arp_ts.tv_nsec + (long) (sp.arp_period * 1e9);
+        arp_ts.tv_sec += ns / 1000000000;
+        arp_ts.tv_nsec = ns % 1000000000;
+        ++num_arp;
+        num_trig = 0;
+      }
+      pm->magic_number = PULSE_METADATA_MAGIC;
+      pm->arp_clock_sec = arp_ts.tv_sec;
+      pm->arp_clock_nsec = arp_ts.tv_nsec;
+      pm->trig_clock = (uint32_t) (since_arp * ADC_CLOCK);
+      pm->acp_clock = since_arp / sp.arp_period;
+      pm->num_trig = num_trig++;
+      pm->num_arp = num_arp;
+      memcpy(& pm->data[0], & patterns[((sent + i) % NUM_PATTERNS) * sp.n_samples], sizeof(uint16_t) * sp.n_samples);
+
+      double step = sp.prf > 0 ? pri : 1.0 / 1800;
+      if (sp.jitter > 0)
+        step *= 1 + sp.jitter * (2.0 * rand_r(& seed) / RAND_MAX - 1);
+      since_arp += step;
+    }
+
+    // a real digitizer sends a chunk once its last pulse is digitized
+    if (pri > 0) {
+      double due = start + (sent + n) * pri;
+      double wait = due - now();
+      if (wait > 0) {
+        struct timespec ts;
+        ts.tv_sec = (time_t) wait;
+        ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+        nanosleep(& ts, 0);
+      }
+    }
+    if (! write_all(fd, & buf[0], n * psize))
+      break;
+    sent += n;
+  }
+  double elapsed = now() - start;
+
+  // tell the receiver we're finished, as digdar does
+  memset(& buf[0], 0, psize);
+  ((pulse_metadata *) & buf[0])->magic_number = PULSE_METADATA_DONE_MAGIC;
+  write_all(fd, & buf[0], psize);
+  close(fd);
+
+  sim_result res = {sent, elapsed};
+  return res;
+};
+
+// find "label: N" in text, returning N, or -1 if not found
+static long long
+find_count (const std::string & text, const std::string & label) {
+  size_t i = text.find(label + ": ");
+  if (i == std::string::npos)
+    return -1;
+  return atoll(text.c_str() + i + label.length() + 2);
+};
+
+// run rpcapture, feed it SECONDS worth of pulses at the PRF in sp,
+// and return the number of pulses it dropped, or -1 if that can't be
+// determined
+static long long
+bench_step (const std::string & rpcapture, const std::string & folder, sim_params sp, double seconds, sim_result & res) {
+  boost::filesystem::remove_all(folder);
+  boost::filesystem::create_directories(folder);
+
+  // rpcapture's default buffer of three sweeps gets huge at high
+  // PRFs; half a second of pulses is plenty to ride out disk stalls
+  int max_pulses = (int) ceil(sp.prf * sp.arp_period * 1.5) + 16;
+  int ring_pulses = std::max(4096, (int) (sp.prf / 2));
+  std::ostringstream n_samples, pulses, ring;
+  n_samples << sp.n_samples;
+  pulses << max_pulses;
+  ring << ring_pulses;
+
+  int pipefd[2];
+  if (pipe(pipefd))
+    throw std::runtime_error("unable to create pipe");
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(pipefd[1], 2);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    execl(rpcapture.c_str(), rpcapture.c_str(), "--once", "-O", "drop_newest",
+          "-n", n_samples.str().c_str(), "-p", pulses.str().c_str(), "-R", ring.str().c_str(),
+          "-P", sp.port.c_str(), folder.c_str(), (char *) 0);
+    perror("digdar_sim: unable to run rpcapture");
+    _exit(127);
+  }
+  close(pipefd[1]);
+
+  sp.num_pulses = (long long) (sp.prf * seconds);
+  bool ok = true;
+  try {
+    res = simulate(sp);
+  } catch (std::runtime_error & e) {
+    std::cerr << "digdar_sim: " << e.what() << std::endl;
+    kill(pid, SIGTERM);
+    ok = false;
+  }
+
+  // collect rpcapture's report; it exits once our connection closes
+  std::string report;
+  char rbuf[4096];
+  ssize_t m;
+  while ((m = read(pipefd[0], rbuf, sizeof(rbuf))) > 0)
+    report.append(rbuf, m);
+  close(pipefd[0]);
+  int status;
+  waitpid(pid, & status, 0);
+  boost::filesystem::remove_all(folder);
+  if (! ok) {
+    std::cerr << "digdar_sim: rpcapture said:\n" << report;
+    return -1;
+  }
+
+  long long dropped = find_count(report, "dropped");
+  long long overwritten = find_count(report, "overwritten");
+  if (dropped < 0 || overwritten < 0) {
+    std::cerr << "digdar_sim: unexpected output from rpcapture:\n" << report;
+    return -1;
+  }
+  return dropped + overwritten;
+};
+
+// raise the PRF by factor each step until rpcapture drops pulses or
+// we can't keep pace, then report the last good rate
+static int
+bench (const std::string & rpcapture, const std::string & folder, sim_params sp, double seconds, double factor) {
+  double best = 0;
+  int psize = sizeof(pulse_metadata) + sizeof(uint16_t) * (sp.n_samples - 1);
+  std::cout << std::fixed << std::setprecision(1);
+  for (;;) {
+    sim_result res;
+    long long lost = bench_step(rpcapture, folder, sp, seconds, res);
+    if (lost < 0) {
+      std::cout << "PRF " << sp.prf << ": rpcapture failed" << std::endl;
+      if (best == 0)
+        return 1;
+      break;
+    }
+    double rate = res.pulses / res.elapsed;
+    bool kept_pace = rate >= 0.98 * sp.prf;
+    std::cout << "PRF " << sp.prf << ": sent " << res.pulses << " pulses at " << rate << " pulses/s ("
+              << rate * psize / 1.0e6 << " MB/s); lost " << lost
+              << (kept_pace ? "" : "; sender fell behind") << std::endl;
+    if (lost > 0 || ! kept_pace)
+      break;
+    best = sp.prf;
+    sp.prf *= factor;
+  }
+  std::cout << "Maximum sustained rate: " << best << " pulses/s ("
+            << best * psize / 1.0e6 << " MB/s) with " << sp.n_samples << " samples per pulse" << std::endl;
+  return 0;
+};
+
+int
+main (int argc, char *argv[]) {
+  sim_params sp;
+  sp.host = "127.0.0.1";
+  sp.port = "12345";
+  sp.n_samples = 3000;
+  sp.prf = 1800;
+  sp.arp_period = 2.5;
+  sp.jitter = 0;
+  sp.chunk = 64;
+  sp.num_pulses = 0;
+
+  double seconds = 5;
+  double factor = 1.5;
+  std::string rpcapture = "./rpcapture";
+  std::string folder = "/tmp/digdar_sim_bench";
+
+  po::options_description cmdconfig("Usage: digdar_sim [options]");
+  cmdconfig.add_options()
+    ("help,h", "produce help message")
+    ("host,H", po::value<std::string>(&sp.host), "connect to rpcapture on this host; default is 127.0.0.1")
+    ("port,P", po::value<std::string>(&sp.port), "connect to rpcapture on this tcp port; default is 12345")
+    ("n_samples,n", po::value<int>(&sp.n_samples), "samples per pulse; default is 3000")
+    ("prf,r", po::value<double>(&sp.prf), "pulses per second; 0 means as fast as possible; default is 1800")
+    ("arp_period,a", po::value<double>(&sp.arp_period), "seconds per sweep; default is 2.5")
+    ("jitter,j", po::value<double>(&sp.jitter), "random jitter in pulse spacing, as a fraction of 1/PRF; default is 0")
+    ("chunk,c", po::value<int>(&sp.chunk), "pulses sent per write, like digdar's -c option; default is 64")
+    ("num_pulses,N", po::value<long long>(&sp.num_pulses), "number of pulses to send; default is 0 (forever)")
+    ("bench,b", "benchmark mode: run rpcapture at increasing PRFs, starting at --prf, until it drops pulses")
+    ("rpcapture,R", po::value<std::string>(&rpcapture), "path to rpcapture, in benchmark mode; default is ./rpcapture")
+    ("folder,f", po::value<std::string>(&folder), "scratch folder for rpcapture's output, in benchmark mode; default is /tmp/digdar_sim_bench")
+    ("seconds,s", po::value<double>(&seconds), "seconds of pulses to send at each PRF, in benchmark mode; default is 5")
+    ("factor,F", po::value<double>(&factor), "factor by which to raise PRF at each step, in benchmark mode; default is 1.5")
+    ;
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, cmdconfig), vm);
+  po::notify(vm);
+
+  if (vm.count("help")) {
+    std::cout << cmdconfig << "\n";
+    return 1;
+  }
+
+  if (sp.n_samples < 1 || sp.chunk < 1 || sp.arp_period <= 0 || sp.prf < 0) {
+    std::cerr << "digdar_sim: n_samples, chunk and arp_period must be positive, and prf non-negative\n";
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  try {
+    if (vm.count("bench")) {
+      if (sp.prf <= 0 || factor <= 1) {
+        std::cerr << "digdar_sim: benchmark mode needs a positive prf and a factor greater than 1\n";
+        return 1;
+      }
+      return bench(rpcapture, folder, sp, seconds, factor);
+    }
+    sim_result res = simulate(sp);
+    std::cerr << "Sent " << res.pulses << " pulses in " << res.elapsed << " s ("
+              << res.pulses / res.elapsed << " pulses/s)" << std::endl;
+  } catch (std::runtime_error & e) {
+    std::cerr << "digdar_sim: " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+};
@@ -25,5 +25,10 @@ typedef struct {
   uint16_t data[1];        // stub; will hold all samples when allocated
 }   __attribute__((packed))  pulse_metadata;
 
+// realtime timestamp at start of pulse: ARP timestamp + 8 ns per ADC tick
+static inline double pulse_metadata_ts (const pulse_metadata * pm) {
+  return pm->arp_clock_sec + 1.0e-9 * (pm->arp_clock_nsec + 8.0 * pm->trig_clock);
+}
+
 
 #endif /* _PULSE_METADATA_H_ */
@@ -42,6 +42,7 @@
 #include <fstream>
 #include <sstream>
 #include <iomanip>
+#include <vector>
 #include <cmath>
 #include <cstdio>
 
@@ -59,6 +60,8 @@
 #include "pulse_metadata.h"
 #include "shared_ring_buffer.h"
 #include "tcp_reader.h"
+#include "tcp_multi_reader.h"
+#include "tcp_sweep_reader.h"
 
 namespace po = boost::program_options;
 
@@ -66,7 +69,27 @@ namespace po = boost::program_options;
 
 #define MAX_N_SAMPLES 16384
 
-static void do_capture (sweep_file_writer * cap, unsigned short n_samples, unsigned max_pulses, const std::string & interface, const std::string & port);
+//! one digitizer feeding this process: its socket reader, pulse
+//! buffer, and sweep file writer
+struct capture_source {
+  std::string port;         //!< tcp port the digitizer connects to
+  std::string site;         //!< site code used in filenames and diagnostics
+  int ring_chunks;          //!< pulses in ring buffer
+  sweep_file_writer * cap;  //!< writer of sweep files
+  shared_ring_buffer * srb; //!< pulses between tcpr and cap; NULL if tcpr records directly to cap
+  tcp_reader * tcpr;        //!< reader of pulses from the network
+  pthread_t thread;         //!< thread running consume(), except for the first source; unused if srb is NULL
+};
+
+static void do_capture (std::vector < capture_source * > & sources, bool quiet);
+
+static void consume (capture_source * src);
+
+static void print_ring_stats (capture_source * src);
+
+static void print_socket_stats (capture_source * src, double elapsed);
+
+static void print_writer_stats (capture_source * src);
 
 double now() {
   static struct timespec ts;
@@ -74,11 +97,11 @@ double now() {
   return ts.tv_sec + ts.tv_nsec / 1.0e9;
 };
 
-static sweep_file_writer * cap = 0;
+static std::vector < capture_source * > sources;
 
 void die(int sig) {
-  if (cap)
-    delete cap;
+  for (unsigned i = 0; i < sources.size(); ++i)
+    delete sources[i]->cap;
 };
 
 int main(int argc, char *argv[])
@@ -107,6 +130,17 @@ int main(int argc, char *argv[])
   std::string           interface          = "0.0.0.0";
   std::string           logfile            = "/dev/null";
   int                   quiet              = false;     // don't output diagnostics to stdout
+  int                   spin               = 0;         // max polls of ring buffer before sleeping
+  int                   ring_chunks        = 0;         // pulses in ring buffer; 0 means 3 * max_pulses
+  std::string           overrun            = "drop_oldest"; // what to do when ring buffer is full
+  int                   rcvbuf             = 8 << 20;   // socket receive buffer size, in bytes
+  int                   busy_poll          = 0;         // socket busy-poll time, in microseconds
+  std::vector < std::string > source_specs;             // PORT:SITE for each digitizer
+  std::string           write_method       = "buffered"; // how sweep files are written
+  int                   format             = 1;         // sweep file format version
+  int                   block_pulses       = 0;         // pulses per block when streaming sweep files; 0 means don't stream
+  std::string           compress           = "none";    // how sample blocks are compressed, as CODEC[:LEVEL]
+  std::string           filter             = "range_delta"; // how samples are filtered before compression
   po::options_description	cmdconfig("Usage: rpcapture [options] [folder]");
 
   cmdconfig.add_options()
@@ -120,6 +154,19 @@ int main(int argc, char *argv[])
     ("site,s", po::value<std::string>(&site), "set short site code used in filenames; default is FORCEVC")
     ("interface,i", po::value<std::string>(&interface), "bind listen port on this interface; default is all interfaces (0.0.0.0)")
     ("logfile,L", po::value<std::string>(&logfile), "record full path to each file written in this file; default is none")
+    ("spin,S", po::value<int>(&spin), "poll for incoming pulses up to SPIN times before sleeping; adapts to load; default is 0 (always sleep)")
+    ("ring_pulses,R", po::value<int>(&ring_chunks), "number of pulses buffered between network and file writer; default is 3 * max_pulses")
+    ("overrun,O", po::value<std::string>(&overrun), "when the pulse buffer is full: 'block' (stop reading from network; only with a single source), 'drop_newest', or 'drop_oldest'; default is drop_oldest")
+    ("rcvbuf,B", po::value<int>(&rcvbuf), "socket receive buffer size in bytes; default is 8388608; the kernel caps this at net.core.rmem_max")
+    ("busy_poll,U", po::value<int>(&busy_poll), "busy-poll the network device for up to BUSY_POLL microseconds before sleeping on the socket; default is 0 (don't)")
+    ("once,1", "exit when the digitizer disconnects (or, with several sources, when all have disconnected), rather than waiting for it to reconnect")
+    ("direct,Z", "receive pulse samples directly into sweep buffers, without a pulse buffer; this saves copying each pulse, but network reads stall whenever the sweep file writer does (with several sources, all of them stall), so --ring_pulses, --overrun and --spin don't apply")
+    ("write_method,W", po::value<std::string>(&write_method), "how sweep files are written: 'buffered' (through the page cache) or 'direct' (preallocated, with O_DIRECT, bypassing the page cache); default is buffered")
+    ("format,V", po::value<int>(&format), "sweep file format: 1 (text header followed by packed columns) or 2 (binary header with a directory of page-aligned, checksummed columns); default is 1")
+    ("block_pulses,b", po::value<int>(&block_pulses), "stream each sweep to its file in blocks of BLOCK_PULSES pulses as they arrive, rather than writing it once complete; this spreads disk writes over the rotation and bounds memory use, and files are always written through the page cache; default is 0 (don't stream)")
+    ("compress,C", po::value<std::string>(&compress), "compress the samples in each sweep file, as CODEC[:LEVEL]; CODEC is 'none' or 'deflate', and LEVEL is from 1 (fastest; the default) to 9 (smallest); compressed files record the codec in their header, and can't be streamed; default is none")
+    ("filter,F", po::value<std::string>(&filter), "filter samples before compressing them: 'none', 'range_delta' (difference from previous sample in pulse), or 'pulse_delta' (difference from same sample in previous pulse); default is range_delta")
+    ("source,X", po::value< std::vector < std::string > >(&source_specs), "capture from a digitizer connecting on tcp port PORT, using site code SITE in its filenames, given as PORT:SITE (SITE defaults to --site); repeat to capture from several digitizers at once, each into its own pulse buffer and sweep files; default is one digitizer, on --port")
     ;
 
   po::options_description fileconfig("Output folder options");
@@ -189,7 +236,115 @@ int main(int argc, char *argv[])
   if (vm.count("decim"))
     decim = vm["decim"].as<unsigned int>();
 
-  cap = new sweep_file_writer(folder, site, logfile, max_pulses, n_samples, 16, 0, 125, decim, decim <= 4 ? "sum" : "first");
+  shared_ring_buffer::overrun_policy policy;
+  if (overrun == "block") {
+    policy = shared_ring_buffer::BLOCK_WRITER;
+  } else if (overrun == "drop_newest") {
+    policy = shared_ring_buffer::DROP_NEWEST;
+  } else if (overrun == "drop_oldest") {
+    policy = shared_ring_buffer::DROP_OLDEST;
+  } else {
+    std::cerr << "Unknown overrun policy '" << overrun << "'; must be 'block', 'drop_newest', or 'drop_oldest'\n";
+    return 1;
+  }
+
+  sweep_file_writer::write_method method;
+  if (write_method == "buffered") {
+    method = sweep_file_writer::BUFFERED_WRITE;
+  } else if (write_method == "direct") {
+    method = sweep_file_writer::DIRECT_WRITE;
+  } else {
+    std::cerr << "Unknown write method '" << write_method << "'; must be 'buffered' or 'direct'\n";
+    return 1;
+  }
+
+  sample_codec::codec_type codec;
+  sample_codec::filter_type filter_type;
+  int level = 1;
+  size_t colon = compress.find(':');
+  if (colon != std::string::npos) {
+    std::string lev = compress.substr(colon + 1);
+    char * end;
+    long l = strtol(lev.c_str(), & end, 10);
+    if (lev.empty() || *end || l < 1 || l > 9) {
+      std::cerr << "Compression level must be from 1 to 9; got '" << lev << "'\n";
+      return 1;
+    }
+    level = (int) l;
+  }
+  try {
+    codec = sample_codec::codec_from_name(compress.substr(0, colon));
+    filter_type = sample_codec::filter_from_name(filter);
+  } catch (std::runtime_error & e) {
+    std::cerr << e.what() << "\n";
+    return 1;
+  }
+  if (format != 1 && format != 2) {
+    std::cerr << "Sweep file format must be 1 or 2\n";
+    return 1;
+  }
+
+  if (codec != sample_codec::NONE && block_pulses > 0) {
+    std::cerr << "Streamed sweep files can't be compressed\n";
+    return 1;
+  }
+
+  if (ring_chunks <= 0)
+    ring_chunks = max_pulses * 3;
+
+  if (source_specs.size() == 0)
+    source_specs.push_back(port + ":" + site);
+
+  // one thread reads from the network for all sources, so a full
+  // pulse buffer would stall every digitizer, not just its own
+  if (policy == shared_ring_buffer::BLOCK_WRITER && source_specs.size() > 1 && ! vm.count("direct")) {
+    std::cerr << "--overrun block can't be used with several sources; a full pulse buffer would stop reading from all of them\n";
+    return 1;
+  }
+
+  uint16_t psize = sizeof(pulse_metadata) + sizeof(uint16_t) * (n_samples - 1);
+
+  // every pulse begins with one of these; the first is what we look
+  // for when bytes are lost
+  std::vector < uint64_t > markers;
+  markers.push_back(PULSE_METADATA_MAGIC);
+  markers.push_back(PULSE_METADATA_DONE_MAGIC);
+
+  for (unsigned i = 0; i < source_specs.size(); ++i) {
+    capture_source * src = new capture_source;
+    size_t colon = source_specs[i].find(':');
+    src->port = source_specs[i].substr(0, colon);
+    src->site = colon == std::string::npos ? site : source_specs[i].substr(colon + 1);
+    for (unsigned j = 0; j < sources.size(); ++j) {
+      if (sources[j]->site == src->site || sources[j]->port == src->port) {
+        std::cerr << "Each source needs its own port and site code; '" << source_specs[i] << "' repeats one\n";
+        return 1;
+      }
+    }
+    // with several sources, each gets its own log of files written
+    std::string src_logfile = logfile;
+    if (source_specs.size() > 1 && logfile != "/dev/null")
+      src_logfile += "." + src->site;
+
+    src->cap = new sweep_file_writer(folder, src->site, src_logfile, max_pulses, n_samples, 16, 0, 125, decim, decim <= 4 ? "sum" : "first");
+    src->cap->set_write_method(method);
+    src->cap->set_format(format);
+    if (block_pulses > 0)
+      src->cap->set_block_pulses(block_pulses);
+    src->cap->set_compression(codec, filter_type, level);
+    if (vm.count("direct")) {
+      src->srb = 0;
+      src->tcpr = new tcp_sweep_reader(interface, src->port, src->cap, n_samples, rcvbuf, busy_poll);
+    } else {
+      src->srb = new shared_ring_buffer(psize, ring_chunks, policy);
+      src->srb->set_max_spin(spin);
+      src->tcpr = new tcp_reader(interface, src->port, src->srb, rcvbuf, busy_poll);
+    }
+    src->tcpr->set_sync_markers(markers);
+    src->tcpr->set_persistent(! vm.count("once"));
+    src->ring_chunks = ring_chunks;
+    sources.push_back(src);
+  }
 
   // FIXME: add this capability
   // cap->addParam( "power", 25.0e3 );
@@ -205,12 +360,13 @@ int main(int argc, char *argv[])
   std::cout << std::setprecision(15);
 
   try {
-    do_capture (cap, n_samples, max_pulses, interface, port);
+    do_capture (sources, quiet);
   } catch (std::runtime_error e)
     {
     };
 
-  delete cap;
+  for (unsigned i = 0; i < sources.size(); ++i)
+    delete sources[i]->cap;
   return 0;
 };
 
@@ -221,75 +377,172 @@ run_reader(void * tcpr) {
   return 0;
 };
 
+static void * 
+run_multi_reader(void * tcpmr) {
+  tcp_multi_reader *ptcpmr = (tcp_multi_reader *) tcpmr;
+  ptcpmr->go();
+  return 0;
+};
+
+static void *
+run_consumer(void * src) {
+  consume((capture_source *) src);
+  return 0;
+};
+
 static void
-do_capture  (sweep_file_writer * cap, unsigned short n_samples, unsigned max_pulses, const std::string &interface, const std::string &port)
+print_ring_stats (capture_source * src)
 {
-#ifdef DEBUG
-  int pulse_count = 0;
-#endif
-
-  uint16_t psize = sizeof(pulse_metadata) + sizeof(uint16_t) * (n_samples - 1);
+  shared_ring_buffer_stats st = src->srb->get_stats();
+  std::cerr << src->site << ": pulse buffer: written: " << st.chunks_written
+            << "; read: " << st.chunks_read
+            << "; dropped: " << st.chunks_dropped
+            << "; overwritten: " << st.chunks_overwritten
+            << "; writer waits: " << st.writer_waits
+            << "; high water: " << st.high_water << " of " << st.num_chunks << std::endl;
+};
 
-  bool okay = true;
-  
-  bool got_arp = false;
-  uint32_t num_arp = 0;
-  uint32_t num_acp_at_arp = 0;
+static void
+print_socket_stats (capture_source * src, double elapsed)
+{
+  tcp_reader_stats st = src->tcpr->get_stats();
+  std::cerr << src->site << ": socket on port " << src->port << ": bytes: " << st.bytes
+            << "; reads: " << st.reads
+            << "; pulses: " << st.chunks
+            << "; bytes per read: " << (st.reads ? st.bytes / st.reads : 0)
+            << "; MB/s: " << (elapsed > 0 ? st.bytes / elapsed / 1.0e6 : 0)
+            << "; pulses/s: " << (elapsed > 0 ? st.chunks / elapsed : 0)
+            << "; connections: " << st.connections
+            << "; resyncs: " << st.resyncs
+            << "; bytes skipped: " << st.bytes_skipped << std::endl;
+};
 
-  shared_ring_buffer srb(psize, max_pulses * 3);
-  tcp_reader tcpr(interface, port, &srb);
+static void
+print_writer_stats (capture_source * src)
+{
+  sweep_file_writer_stats st = src->cap->get_stats();
+  std::cerr << src->site << ": sweep files: written: " << st.sweeps_written
+            << "; writer busy: " << st.io_busy
+            << "; seconds waited for writer: " << st.io_wait
+            << "; mean write: " << (st.sweeps_written ? st.total_write_time / st.sweeps_written : 0) << " s"
+            << "; longest write: " << st.max_write_time << " s";
+  if (st.direct_fallbacks)
+    std::cerr << "; written without O_DIRECT: " << st.direct_fallbacks;
+  if (st.sample_bytes_out)
+    std::cerr << "; compression ratio: " << (double) st.sample_bytes_in / st.sample_bytes_out
+              << "; compression MB/s: " << st.sample_bytes_in / st.compress_time / 1.0e6;
+  std::cerr << std::endl;
+};
 
+static void
+do_capture (std::vector < capture_source * > & sources, bool quiet)
+{
+  // one thread reads from the network for all sources; with a single
+  // source, it can simply block in read
+  tcp_multi_reader tcpmr;
   pthread_t read_thread;
+  int rv;
+  if (sources.size() == 1) {
+    rv = pthread_create(& read_thread, NULL, & run_reader, sources[0]->tcpr);
+  } else {
+    for (unsigned i = 0; i < sources.size(); ++i)
+      tcpmr.add(sources[i]->tcpr);
+    rv = pthread_create(& read_thread, NULL, & run_multi_reader, & tcpmr);
+  }
+  if (rv)
+    throw std::runtime_error("Unable to create reader thread\n");
+
+  // each source has its own thread writing sweep files; this thread
+  // handles the first source.  Readers which record pulses directly
+  // need no such threads.
+  double start = now();
+  bool direct = ! sources[0]->srb;
+  if (direct) {
+    pthread_join(read_thread, NULL);
+  } else {
+    for (unsigned i = 1; i < sources.size(); ++i)
+      if (pthread_create(& sources[i]->thread, NULL, & run_consumer, sources[i]))
+        throw std::runtime_error("Unable to create consumer thread\n");
+    consume(sources[0]);
+    for (unsigned i = 1; i < sources.size(); ++i)
+      pthread_join(sources[i]->thread, NULL);
+  }
+  double elapsed = now() - start;
+
+  if (! quiet) {
+    for (unsigned i = 0; i < sources.size(); ++i) {
+      if (! direct)
+        print_ring_stats(sources[i]);
+      print_socket_stats(sources[i], elapsed);
+      print_writer_stats(sources[i]);
+    }
+  }
+  // the multi-source reader has finished, since all its rings are done
+  if (sources.size() > 1 && ! direct)
+    pthread_join(read_thread, NULL);
+};
 
-  int pc = 0;
-  if (pthread_create(& read_thread, NULL, & run_reader, & tcpr))
-      throw std::runtime_error("Unable to create reader thread\n");
+static void
+consume (capture_source * src)
+{
+#ifdef DEBUG
+  int pulse_count = 0;
+#endif
 
-  for ( ;; ) {
-    unsigned char * pulsebuf = srb.read_chunk();
-    if (! pulsebuf) {
+  shared_ring_buffer & srb = * src->srb;
+  uint16_t psize = srb.get_chunk_size();
+  for (;;) {
+    // sleep until the tcp reader publishes some pulses or quits, then
+    // take all available pulses (up to one batch) at once
+    chunk_span span[2];
+    if (! srb.wait_for_chunks(tcp_reader::MAX_BATCH, span)) {
       // quit if tcp reader is done
       if (srb.is_done())
         break;
-      pthread_yield();
-      usleep(1000); // sleep 10 ms before retrying
       continue;
     }
-    pulse_metadata * meta = (pulse_metadata *) & pulsebuf[0];
-    if (meta->magic_number == PULSE_METADATA_DONE_MAGIC)
-      break;
-    if (meta->magic_number != PULSE_METADATA_MAGIC) {
-      std::cerr << "Bad Magic Number on radar pulse - quitting\n";
-      break;
-    }
-
-    // realtime ts at start of pulse is ARP ts + 8 ns per ADC tick,
-    // which is what meta->trig_clock provides
-
-    double ts = meta->arp_clock_sec + 1.0e-9*(meta->arp_clock_nsec + 8 * meta->trig_clock);
-
-    // calculate azimuth based on count of ACPs since most recent ARP.
-
-    ++pc;
-    cap->record_pulse (ts,
-                       meta->num_trig,
-                       meta->trig_clock,
-                       meta->acp_clock,
-                       meta->num_arp,
-                       0, // constant 0 elevation angle for FORCE radar
-                       0, // constant polarization for FORCE radar
-                       (uint16_t *) & pulsebuf[sizeof(pulse_metadata) - sizeof(uint16_t)]);
+    for (int s = 0; s < 2; ++s) {
+      for (int i = 0; i < span[s].n; ++i) {
+        unsigned char * pulsebuf = span[s].p + i * psize;
+        pulse_metadata * meta = (pulse_metadata *) & pulsebuf[0];
+        // the tcp reader keeps us in sync with pulse boundaries, so
+        // the only other chunks we see are the ones digdar sends when
+        // it stops; the connection will close and we keep waiting for
+        // another.
+        if (meta->magic_number != PULSE_METADATA_MAGIC)
+          continue;
+
+        // realtime ts at start of pulse is ARP ts + 8 ns per ADC tick,
+        // which is what meta->trig_clock provides
+
+        double ts = pulse_metadata_ts(meta);
+
+        // calculate azimuth based on count of ACPs since most recent ARP.
+
+        src->cap->record_pulse (ts,
+                                meta->num_trig,
+                                meta->trig_clock,
+                                meta->acp_clock,
+                                meta->num_arp,
+                                0, // constant 0 elevation angle for FORCE radar
+                                0, // constant polarization for FORCE radar
+                                (uint16_t *) & pulsebuf[sizeof(pulse_metadata) - sizeof(uint16_t)]);
 #ifdef DEBUG
-    if (++pulse_count == 500) {
-      pulse_count = 0;
-      int reader_index, writer_index, diff;
-      srb.get_indices(reader_index, writer_index);
-      diff = (writer_index - reader_index);
-      if (diff < 0) 
-        diff += max_pulses;
-      std::cerr << "Read index: " << reader_index << ";  Writer index: " << writer_index << "; diff: " << diff << std::endl;
-    }
+        if (++pulse_count == 500) {
+          pulse_count = 0;
+          int reader_index, writer_index, diff;
+          srb.get_indices(reader_index, writer_index);
+          diff = (writer_index - reader_index);
+          if (diff < 0)
+            diff += src->ring_chunks;
+          std::cerr << src->site << ": Read index: " << reader_index << ";  Writer index: " << writer_index << "; diff: " << diff << std::endl;
+          print_ring_stats(src);
+        }
 #endif
+      }
+    }
     srb.done_reading_chunk();
   }
+  // release the tcp reader, in case it is waiting for room
+  srb.done();
 }
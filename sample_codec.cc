@@ -0,0 +1,129 @@
+/**
+   @file sample_codec.cc
+   @author John Brzustowski <jbrzusto is at fastmail dot fm>
+   @version 0.1
+   @date 2015
+   @license GPL v2 or later
+ */
+
+#include "sample_codec.h"
+#include <stdexcept>
+#include <string.h>
+#include <zlib.h>
+
+sample_codec::sample_codec (codec_type codec, filter_type filter, int level) :
+  codec(codec),
+  filter(filter),
+  level(level)
+{
+  if (level < 1 || level > 9)
+    throw std::runtime_error("sample_codec: invalid compression level; must be from 1 to 9");
+};
+
+sample_codec::codec_type
+sample_codec::codec_from_name (const std::string & name) {
+  if (name == "none")
+    return NONE;
+  if (name == "deflate")
+    return DEFLATE;
+  throw std::runtime_error("sample_codec: unknown codec '" + name + "'; must be 'none' or 'deflate'");
+};
+
+sample_codec::filter_type
+sample_codec::filter_from_name (const std::string & name) {
+  if (name == "none")
+    return NO_FILTER;
+  if (name == "range_delta")
+    return RANGE_DELTA;
+  if (name == "pulse_delta")
+    return PULSE_DELTA;
+  throw std::runtime_error("sample_codec: unknown filter '" + name + "'; must be 'none', 'range_delta' or 'pulse_delta'");
+};
+
+const char *
+sample_codec::codec_name () {
+  return codec == DEFLATE ? "deflate" : "none";
+};
+
+const char *
+sample_codec::filter_name () {
+  return filter == RANGE_DELTA ? "range_delta" : filter == PULSE_DELTA ? "pulse_delta" : "none";
+};
+
+void
+sample_codec::to_planes (const uint16_t * samples, int np, int ns) {
+  size_t n = (size_t) np * ns;
+  planes.resize(2 * n);
+  unsigned char * lo = & planes[0];
+  unsigned char * hi = lo + n;
+  for (int p = 0; p < np; ++p) {
+    const uint16_t * x = samples + (size_t) p * ns;
+    const uint16_t * prev = filter == PULSE_DELTA && p > 0 ? x - ns : 0;
+    for (int i = 0; i < ns; ++i) {
+      uint16_t d = x[i];
+      if (filter == RANGE_DELTA && i > 0)
+        d -= x[i - 1];
+      else if (prev)
+        d -= prev[i];
+      *lo++ = d & 0xff;
+      *hi++ = d >> 8;
+    }
+  }
+};
+
+void
+sample_codec::from_planes (uint16_t * samples, int np, int ns) {
+  size_t n = (size_t) np * ns;
+  const unsigned char * lo = & planes[0];
+  const unsigned char * hi = lo + n;
+  for (int p = 0; p < np; ++p) {
+    uint16_t * x = samples + (size_t) p * ns;
+    const uint16_t * prev = filter == PULSE_DELTA && p > 0 ? x - ns : 0;
+    for (int i = 0; i < ns; ++i) {
+      uint16_t d = *lo++ | (*hi++ << 8);
+      if (filter == RANGE_DELTA && i > 0)
+        d += x[i - 1];
+      else if (prev)
+        d += prev[i];
+      x[i] = d;
+    }
+  }
+};
+
+size_t
+sample_codec::compress (const uint16_t * samples, int np, int ns) {
+  size_t n = (size_t) np * ns * sizeof(uint16_t);
+  if (codec == NONE) {
+    packed.resize(n);
+    if (n)
+      memcpy(& packed[0], samples, n);
+    return n;
+  }
+  to_planes(samples, np, ns);
+  uLongf len = compressBound(n);
+  packed.resize(len);
+  if (::compress2(& packed[0], & len, & planes[0], n, level) != Z_OK)
+    throw std::runtime_error("sample_codec: deflate failed");
+  return len;
+};
+
+const unsigned char *
+sample_codec::data () {
+  return & packed[0];
+};
+
+void
+sample_codec::decompress (const unsigned char * src, size_t n, uint16_t * samples, int np, int ns) {
+  size_t want = (size_t) np * ns * sizeof(uint16_t);
+  if (codec == NONE) {
+    if (n != want)
+      throw std::runtime_error("sample_codec: wrong number of sample bytes");
+    memcpy(samples, src, n);
+    return;
+  }
+  planes.resize(want);
+  uLongf len = want;
+  if (::uncompress(& planes[0], & len, src, n) != Z_OK || len != want)
+    throw std::runtime_error("sample_codec: corrupt compressed samples");
+  from_planes(samples, np, ns);
+};
@@ -0,0 +1,88 @@
+/**
+   @file sample_codec.h
+   @author John Brzustowski <jbrzusto is at fastmail dot fm>
+   @version 0.1
+   @date 2015
+   @license GPL v2 or later
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/**
+   @class sample_codec
+   @brief Losslessly compress and decompress the sample block of a sweep.
+
+   Samples are first passed through a delta filter, which turns the
+   slowly-varying echo into small numbers:
+
+   - RANGE_DELTA: each sample minus the previous sample in the same pulse
+
+   - PULSE_DELTA: each sample minus the sample at the same range in
+     the previous pulse
+
+   The filtered samples are then split into a plane of low bytes
+   followed by a plane of high bytes, which are mostly zero, and
+   deflated with zlib.
+
+   The names returned by codec_name() and filter_name() are what
+   sweep files record in their "codec" and "filter" header fields.
+*/
+
+class sample_codec {
+ public:
+  //! how filtered samples are compressed
+  enum codec_type {NONE, DEFLATE};
+
+  //! how samples are filtered before compression
+  enum filter_type {NO_FILTER, RANGE_DELTA, PULSE_DELTA};
+
+  //! constructor; level is the codec's compression level, from 1
+  // (fastest) to 9 (smallest); throws std::runtime_error if it's not
+  sample_codec (codec_type codec = NONE, filter_type filter = RANGE_DELTA, int level = 1);
+
+  //! return the codec with a given name; throws std::runtime_error if unknown
+  static codec_type codec_from_name (const std::string & name);
+
+  //! return the filter with a given name; throws std::runtime_error if unknown
+  static filter_type filter_from_name (const std::string & name);
+
+  //! return the name of this codec
+  const char * codec_name ();
+
+  //! return this codec
+  codec_type get_codec () { return codec; };
+
+  //! return this filter
+  filter_type get_filter () { return filter; };
+
+  //! return the name of this filter
+  const char * filter_name ();
+
+  //! compress the np x ns samples, returning the size of the result,
+  // which is available from data() until the next call
+  size_t compress (const uint16_t * samples, int np, int ns);
+
+  //! return the result of the last call to compress()
+  const unsigned char * data ();
+
+  //! decompress n bytes from src into np x ns samples; throws
+  // std::runtime_error if src doesn't hold exactly that many
+  void decompress (const unsigned char * src, size_t n, uint16_t * samples, int np, int ns);
+
+ protected:
+  codec_type codec;  //!< how filtered samples are compressed
+  filter_type filter; //!< how samples are filtered
+  int level;          //!< compression level
+
+  std::vector < unsigned char > planes; //!< filtered samples, as low and high byte planes
+  std::vector < unsigned char > packed; //!< compressed data
+
+  //! filter samples into byte planes
+  void to_planes (const uint16_t * samples, int np, int ns);
+
+  //! undo to_planes
+  void from_planes (uint16_t * samples, int np, int ns);
+};
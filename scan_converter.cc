@@ -1,5 +1,33 @@
 #include "scan_converter.h"
+#include "crc32c.h"
 #include <cmath>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) && defined(__GNUC__) && ! defined(DO_ALPHA_BLENDING)
+#define SCVT_HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+bool scan_converter::exact_geometry = false;
+
+std::string scan_converter::cache_dir;
+
+// can apply() use the AVX2 kernel on this CPU?
+static bool
+cpu_has_avx2 () {
+#ifdef SCVT_HAVE_AVX2
+  return __builtin_cpu_supports("avx2");
+#else
+  return false;
+#endif
+};
 
 scan_converter::scan_converter ( int nr,
                                  int nc,
@@ -13,7 +41,8 @@ scan_converter::scan_converter ( int nr,
                                  double scale,
                                  double first_range,
                                  double azi_begin,
-                                 double azi_end
+                                 double azi_end,
+                                 int threads
                                  ) :
   nr(nr),
   nc(nc),
@@ -29,7 +58,12 @@ scan_converter::scan_converter ( int nr,
   azi_begin(azi_begin),
   azi_end(azi_end),
   azi_step((azi_end - azi_begin) / (nr - 1.0)),
-  inds(0)
+  use_simd(cpu_has_avx2()),
+  map(0),
+  map_size(0),
+  pool_job(0),
+  pool_busy(0),
+  pool_quit(false)
 {
   // create a scan converter for mapping polar to cartesian data
   // 
@@ -45,33 +79,45 @@ scan_converter::scan_converter ( int nr,
   //               samples at the start of each pulse; positive means there are missing samples.
   // azi_begin: azimuth of first pulse [0..1]
   // azi_end: azimuth of last pulse [0..1]
+  // threads: number of threads to use for building and applying the index tables
 
-  char use_radial_neighbours;	/* true if radially neighbouring input slots are used for each output slot */
-  int angular_neighbour_thresh; /* the minimum (in pixels) at which angular neighbours are used for each pixel */
-  int i, j, l;
-  int ihi, jhi;
-  int range, theta;
-  double x, y;
-  double theta0, theta_factor;
-  int sample_sum;
-  char sample_count;
+  pthread_mutex_init(& pool_mutex, 0);
+  pthread_cond_init(& pool_cond, 0);
+  set_threads(threads);
 
-  int snc = nc * SCVT_EXTRA_PRECISION_FACTOR; // scaled version of nc with extra pr
+  derive.src = 0;
+  derive.shift = 0;
+  derive.zoom = 1 << SCVT_ZOOM_FACTOR_PRECISION_BITS;
 
-  char normal_limits = azi_begin <= azi_end;
+  snc = nc * SCVT_EXTRA_PRECISION_FACTOR; // scaled version of nc with extra pr
 
   // -------------------- INDEX FROM SCRATCH --------------------
 
-  /* we'll need a list big enough to hold up to 4 input slot indexes per output slot */
-      
-  int inds_needed = w * h * 4;
-  if (!inds || num_inds < inds_needed) {
-    inds = new int[inds_needed];
-    inds_alloc = inds_needed;
+  for (int j0 = 0; j0 < h; j0 += SCVT_BAND_ROWS) {
+    band bd;
+    bd.j0 = j0;
+    bd.rows = std::min(SCVT_BAND_ROWS, h - j0);
+    publish_band(bd);
+    bands.push_back(bd);
   }
 
-  num_inds = 0;
+  circle_pulses = nr;
+  set_smoothing();
+
+  // the angular neighbour of each pulse is the one before it, wrapping around
+  std::vector < int > prev(nr);
+  for (int t = 0; t < nr; ++t)
+    prev[t] = t > 0 ? t - 1 : nr - 1;
+  code_neighbours(prev);
 
+  if (! load_tables()) {
+    run_bands(& scan_converter::build_band);
+    save_tables();
+  }
+};
+
+void
+scan_converter::set_smoothing () {
   /* if a change of one pixel in the x direction causes a change of
      more than one along the scan row (i.e. samples are represented
      by less than one pixel) then we will average 3
@@ -79,9 +125,7 @@ scan_converter::scan_converter ( int nr,
 
   use_radial_neighbours = scale < 1.0;  
 
-  first_range *= scale; /* convert first_range into pixel units */
-
-  scale /= SCVT_EXTRA_PRECISION_FACTOR; /* from now on, scale is scaled by extra precision bits */
+  double scale = this->scale / SCVT_EXTRA_PRECISION_FACTOR; /* scale is scaled by extra precision bits */
 
   /* if a change of one pixel in the y direction causes a change of
      more than one scan row, then we will average 3
@@ -89,77 +133,916 @@ scan_converter::scan_converter ( int nr,
      the minimum sample range at and beyond which no such averaging is
      done */
 
-  angular_neighbour_thresh = (int) (always_smooth_angular ?  nc * scale : (1 + nr / (2 * M_PI * scale)));
+  angular_neighbour_thresh = (int) (always_smooth_angular ?  nc * scale : (1 + circle_pulses / (2 * M_PI * scale)));
+};
+
+void
+scan_converter::code_neighbours (const std::vector < int > & prev) {
+  // codes are assigned in order of first use, so the same pulses
+  // always get the same codes
+  ang_off.clear();
+  pulse_code.assign(prev.size(), SCVT_NO_NEIGHBOUR);
+  std::vector < int > delta;
+  for (size_t t = 0; t < prev.size(); ++t) {
+    int d = prev[t] - (int) t;
+    size_t c = std::find(delta.begin(), delta.end(), d) - delta.begin();
+    if (c == delta.size()) {
+      if (c == SCVT_MAX_NEIGHBOURS)
+        continue; // no code left; this pulse isn't smoothed with its neighbour
+      delta.push_back(d);
+      ang_off.push_back(d * snc);
+    }
+    pulse_code[t] = c;
+  }
+  // unused codes must still give valid offsets
+  ang_off.resize(SCVT_MAX_NEIGHBOURS, 0);
+};
+
+void
+scan_converter::clear_band (band & bd) {
+  bd.run_buf.clear();
+  bd.base_buf.clear();
+  bd.code_buf.clear();
+};
+
+void
+scan_converter::publish_band (band & bd) {
+  bd.runs = bd.run_buf.data();
+  bd.nruns = bd.run_buf.size();
+  bd.base = bd.base_buf.data();
+  bd.codes = bd.code_buf.data();
+  bd.npix = bd.base_buf.size();
+};
+
+// The azimuth of a pixel, in turns [0..1) anticlockwise from the
+// x-axis, as computed from atan2() by the original construction.
+static inline double
+exact_turns (double y, double x) {
+  return fmod( 2 * M_PI + atan2(y, x), 2 * M_PI) / (2 * M_PI);
+};
+
+// For each pixel (x0 + i, y) in a row of n pixels, approximate
+// exact_turns(y, x0 + i) * mul + add.  y must not be zero.
+//
+// atan2 is reduced to atan(u) with |u| <= tan(pi / 8) and summed as
+// a Taylor series to u^23, which is within 2e-11 radians; everything
+// is branch-free (and compiled without trapping math, so that the
+// selects needn't be branches), so the loop is vectorised.
+__attribute__((target_clones("avx2", "default"), optimize("no-trapping-math"))) static void
+approx_turns_row (double y, double x0, int n, double mul, double add, double *out) {
+  double ay = fabs(y);
+  for (int i = 0; i < n; ++i) {
+    double x = x0 + i;
+    double ax = fabs(x);
+    double mx = ax > ay ? ax : ay;
+    double mn = ax > ay ? ay : ax;
+    double t = mn / mx;
+    bool big = t > 0.41421356237309503;
+    double v = (t - 1) / (t + 1);             // atan(t) = pi / 4 + atan(v)
+    double u = big ? v : t;
+    double z = u * u;
+    double p = -1.0 / 23;
+    p = p * z + 1.0 / 21;
+    p = p * z - 1.0 / 19;
+    p = p * z + 1.0 / 17;
+    p = p * z - 1.0 / 15;
+    p = p * z + 1.0 / 13;
+    p = p * z - 1.0 / 11;
+    p = p * z + 1.0 / 9;
+    p = p * z - 1.0 / 7;
+    p = p * z + 1.0 / 5;
+    p = p * z - 1.0 / 3;
+    p = p * z + 1;
+    double r = p * u + (big ? M_PI / 4 : 0);  // atan(mn / mx)
+    r = ay > ax ? M_PI / 2 - r : r;           // atan(ay / ax)
+    r = x < 0 ? M_PI - r : r;                 // atan2(ay, x)
+    r = y < 0 ? 2 * M_PI - r : r;             // as exact_turns, in radians
+    out[i] = r * (1 / (2 * M_PI)) * mul + add;
+  }
+};
+
+// (int) of a value approximated by a with error less than margin, or
+// -1 if a is too close to an integer to tell
+static inline int
+truncate_approx (double a, double margin) {
+  double f = a - floor(a);
+  if (f < margin || f > 1 - margin)
+    return -1;
+  return (int) a;
+};
+
+// Narrow the pixels [ilo, ihi) of the row at y to those no further
+// than dmax from the centre column xc; pixel i is at x = i - xc + 0.5.
+// The result errs on the side of including pixels.
+static inline void
+row_chord (double y, double dmax, int xc, int & ilo, int & ihi) {
+  double yy = dmax * dmax - y * y;
+  if (yy < 0) {
+    ihi = ilo;
+    return;
+  }
+  double half = sqrt(yy);
+  ilo = std::max(ilo, (int) floor(xc - 0.5 - half));
+  ihi = std::max(ilo, std::min(ihi, (int) ceil(xc - 0.5 + half) + 1));
+};
+
+void
+scan_converter::build_band (int b) {
+  band & bd = bands[b];
+  std::vector < double > approx(w);
+  clear_band(bd);
+  for (int j = bd.j0; j < bd.j0 + bd.rows; ++j)
+    build_row(bd, j, 0, w, & approx[0]);
+  publish_band(bd);
+};
+
+void
+scan_converter::build_row (band & bd, int j, int ilo, int ihi, double * approx) {
+  int i;
+  int range, theta;
+  double x, y;
 
-  l = 0; /* avoid a compiler warning */
-  jhi = x0 + h;
-  ihi = y0 + w; 
-  theta0 = 2 * M_PI * (1.0 - azi_begin); // mathematical angle at first pulse
-  theta_factor = (2 * M_PI * azi_step); // convert angle to pulse index
+  char normal_limits = azi_begin <= azi_end;
 
-  for (j = x0; j < jhi; ++j ) {
-    y = (j - yc + 0.5);
-    for (i = y0; i < ihi; ++i) {
-      x = i - xc + 0.5;
-      double aa = atan2(y, x);
-      double bb = fmod( 2 * M_PI + aa, 2 * M_PI) / (2 * M_PI) - azi_begin;
+  double first_range = this->first_range * this->scale; /* convert first_range into pixel units */
+
+  double scale = this->scale / SCVT_EXTRA_PRECISION_FACTOR; /* scale is scaled by extra precision bits */
+
+  // Only the chord of the row within range of the data is examined.
+  // The pulse for each pixel is found from a fast approximation to
+  // its azimuth, except where that is too close to the boundary
+  // between pulses, so the table is the same as when using atan2().
+  double dmax = first_range + (snc + 1) * scale + 1;
+  double margin = exact_geometry ? 1 : 1e-9 / fabs(azi_step) + 1e-7;
+
+  j += x0;
+  y = (j - yc + 0.5);
+  ilo += y0;
+  ihi += y0;
+  row_chord(y, dmax, xc, ilo, ihi);
+  if (! exact_geometry)
+    approx_turns_row(y, ilo - xc + 0.5, ihi - ilo, 1 / azi_step, 0.5 - azi_begin / azi_step, approx);
+  for (i = ilo; i < ihi; ++i) {
+    x = i - xc + 0.5;
+    range = (int) (0.5 + (sqrt(x * x + y * y) - first_range) / scale);
+    if (range < 0 || range >= snc)
+      continue;
+    theta = truncate_approx(approx[i - ilo], margin);
+    if (theta < 0) {
+      double bb = exact_turns(y, x) - azi_begin;
       theta = (int) (0.5 +  bb / azi_step);
-      range = (int) (0.5 + (sqrt(x * x + y * y) - first_range) / scale);
-      if (range >= 0 && range < snc 
-          && (
-              (normal_limits && theta >= 0 && theta < nr))) {
-        // the pixel has at least one corresponding data sample
-        l = theta * snc + range;
-        sample_sum = sample_count = 0;
-        // use up to three neighbours
+    }
+    if (normal_limits && theta >= 0 && theta < nr) {
+      // the pixel has at least one corresponding data sample
+      add_pixel(bd, i - y0, j - x0 - bd.j0, theta, range);
+    } // else no corresponding radar data, so the pixel is left out of the runs (it retains background colour)
+  }
+};
+
+inline void
+scan_converter::add_pixel (band & bd, int i, int j, int theta, int range) {
+  // extend the current run, or start a new one
+  if (bd.run_buf.empty() || bd.run_buf.back().row != j || bd.run_buf.back().col + bd.run_buf.back().len != i) {
+    run r = {j, i, 0};
+    bd.run_buf.push_back(r);
+  }
+  ++ bd.run_buf.back().len;
+
+  // the central sample
+  bd.base_buf.push_back(theta * snc + range);
+  int code = 0;
 #ifdef DO_SCAN_CONVERSION_SMOOTHING
-        if (range < angular_neighbour_thresh) {
-          if (use_radial_neighbours && range <= snc - 2 * SCVT_EXTRA_PRECISION_FACTOR) {
-            // radial, angular, and "diagonal" neighbour
-            SCVT_IND(l + SCVT_EXTRA_PRECISION_FACTOR);
-            if (theta > 0) {
-              SCVT_IND(l - snc);
-              SCVT_IND(l + SCVT_EXTRA_PRECISION_FACTOR - snc);
-            } else {
-              SCVT_IND(l + (nr - 1) * snc);
-              SCVT_IND(l + SCVT_EXTRA_PRECISION_FACTOR + (nr - 1) * snc);
-            }
-          } else {
-            // just angular neighbour
-            if (theta > 0) {
-              SCVT_IND(l - snc);
-            } else {
-              SCVT_IND(l + (nr - 1) * snc);
-            }
-          }
-        } else {
-          if (use_radial_neighbours) {
-            if (range <= snc - 2 * SCVT_EXTRA_PRECISION_FACTOR)
-              // just radial neighbour
-              SCVT_IND(l + SCVT_EXTRA_PRECISION_FACTOR);
-          }
-        }
-        // use the central sample, and mark it as the last for this pixel
-        SCVT_IND_LAST(l);
-#else  // DO_SCAN_CONVERSION_SMOOTHING
-        SCVT_IND(l);
+  // use up to three neighbours: if radial, the next sample in range;
+  // if angular, the same range in the angular neighbour; if both, also
+  // the "diagonal" neighbour
+  int nb = pulse_code[theta];
+  bool radial = use_radial_neighbours && range <= snc - 2 * SCVT_EXTRA_PRECISION_FACTOR;
+  bool angular = range < angular_neighbour_thresh && nb != SCVT_NO_NEIGHBOUR;
+  if (radial)
+    code |= SCVT_CODE_RADIAL;
+  if (angular)
+    code |= SCVT_CODE_ANGULAR | (nb << SCVT_CODE_NEIGHBOUR_SHIFT);
 #endif // DO_SCAN_CONVERSION_SMOOTHING
+  bd.code_buf.push_back(code);
+};
+
+void
+scan_converter::polar_band (int b) {
+  const band & bd = bands[b];
+  std::vector < double > approx(w);
+  for (int j = bd.j0; j < bd.j0 + bd.rows; ++j)
+    polar_row(j, 0, w, & approx[0]);
+};
+
+void
+scan_converter::polar_row (int j, int ilo, int ihi, double * approx) {
+  // the same geometry as build_row(), but with azimuth measured
+  // from 0 rather than azi_begin, since pulses have their own azimuths
+  double sscale = scale / SCVT_EXTRA_PRECISION_FACTOR;
+  double first_range_pix = first_range * scale;
 
-      } else { // no corresponding radar data, so mark it as using no samples (it retains background colour)
-        SCVT_NO_IND;
+  double dmax = first_range_pix + (snc + 1) * sscale + 1;
+  double margin = exact_geometry ? 1 : 1e-9 * SCVT_AZI_LUT_SIZE + 1e-7;
+
+  size_t k = (size_t) j * w;  // pixel_range[k + i - y0] is for pixel i of this row
+  std::fill(pixel_range.begin() + k + ilo, pixel_range.begin() + k + ihi, SCVT_NO_RANGE);
+  j += x0;
+  double y = (j - yc + 0.5);
+  ilo += y0;
+  ihi += y0;
+  row_chord(y, dmax, xc, ilo, ihi);
+  if (! exact_geometry)
+    approx_turns_row(y, ilo - xc + 0.5, ihi - ilo, SCVT_AZI_LUT_SIZE, 0, approx);
+  for (int i = ilo; i < ihi; ++i) {
+    double x = i - xc + 0.5;
+    int range = (int) (0.5 + (sqrt(x * x + y * y) - first_range_pix) / sscale);
+    if (range < 0 || range >= snc)
+      continue;
+    pixel_range[k + i - y0] = range;
+    int az = truncate_approx(approx[i - ilo], margin);
+    if (az < 0)
+      az = (int) (exact_turns(y, x) * SCVT_AZI_LUT_SIZE);
+    pixel_azi[k + i - y0] = (uint16_t) (az & (SCVT_AZI_LUT_SIZE - 1));
+  }
+};
+
+void
+scan_converter::set_azimuths (const float *azi,
+                              int np,
+                              double azi_offset
+                              ) {
+  if (pixel_azi.empty()) {
+    pixel_azi.resize((size_t) w * h);
+    pixel_range.resize((size_t) w * h);
+    run_bands(& scan_converter::polar_band);
+  }
+
+  // drawn pulses sorted by azimuth, in units of 1 / SCVT_AZI_LUT_SIZE
+  std::vector < std::pair < double, int > > p;
+  for (int k = 0; k < np; ++k) {
+    if (std::isnan(azi[k]))
+      continue;
+    double a = fmod(azi[k] + azi_offset, 1.0);
+    if (a < 0)
+      a += 1.0;
+    p.push_back(std::make_pair(a * SCVT_AZI_LUT_SIZE, k));
+  }
+  std::sort(p.begin(), p.end());
+
+  // pulses at the same azimuth share its bins, which show the latest of
+  // them; so quantized azimuths give distinct azimuths and nonzero gaps
+  std::vector < std::pair < double, int > > d;
+  for (size_t i = 0; i < p.size(); ++i) {
+    if (d.size() > 0 && d.back().first == p[i].first)
+      d.back().second = p[i].second;
+    else
+      d.push_back(p[i]);
+  }
+  int n = d.size();
+
+  // gap after each distinct azimuth to the next, around the circle
+  std::vector < double > gap(n);
+  for (int i = 0; i < n; ++i)
+    gap[i] = i + 1 < n ? d[i + 1].first - d[i].first : d[0].first + SCVT_AZI_LUT_SIZE - d[i].first;
+
+  // a pulse is drawn no further than the median gap from its azimuth,
+  // so a missing sector of pulses is left blank; azimuths closer than
+  // one bin still reach one bin
+  double reach = SCVT_AZI_LUT_SIZE;
+  if (n > 1) {
+    std::vector < double > g(gap);
+    std::nth_element(g.begin(), g.begin() + n / 2, g.end());
+    reach = std::max(g[n / 2], 1.0);
+  }
+
+  // each pulse covers the bins whose centres are closer to it than to
+  // its neighbours, within reach
+  azi_lut.assign(SCVT_AZI_LUT_SIZE, SCVT_NO_PULSE);
+  std::vector < int > prev_pulse(np);
+  for (int k = 0; k < np; ++k)
+    prev_pulse[k] = k;
+  for (int i = 0; i < n; ++i) {
+    double left = i > 0 ? gap[i - 1] : gap[n - 1];
+    double lo = d[i].first - std::min(reach, left / 2);
+    double hi = d[i].first + std::min(reach, gap[i] / 2);
+    for (int b = (int) ceil(lo - 0.5); b < hi - 0.5; ++b)
+      azi_lut[b & (SCVT_AZI_LUT_SIZE - 1)] = d[i].second;
+    // the angular neighbour is the previous drawn pulse, unless it is
+    // across a gap
+    int prev = i > 0 ? i - 1 : n - 1;
+    if (left <= 2 * reach)
+      prev_pulse[d[i].second] = d[prev].second;
+  }
+
+  // smoothing depends on how many pulses would fill the circle
+  nr = np;
+  circle_pulses = SCVT_AZI_LUT_SIZE / reach;
+  set_smoothing();
+
+  code_neighbours(prev_pulse);
+  run_bands(& scan_converter::lookup_band);
+  unmap_tables();
+
+  // the pixels of each pulse are listed again when needed
+  std::vector < size_t > ().swap(pulse_pixel_first);
+  std::vector < uint32_t > ().swap(pulse_pixel_pos);
+  std::vector < uint16_t > ().swap(pulse_pixel_range);
+  std::vector < uint8_t > ().swap(pulse_pixel_code);
+};
+
+void
+scan_converter::lookup_band (int b) {
+  band & bd = bands[b];
+  const uint16_t *pr = & pixel_range[(size_t) bd.j0 * w];
+  const uint16_t *pa = & pixel_azi[(size_t) bd.j0 * w];
+  clear_band(bd);
+  for (int j = 0; j < bd.rows; ++j) {
+    for (int i = 0; i < w; ++i, ++pr, ++pa) {
+      int range = *pr;
+      int theta = azi_lut[*pa];
+      if (range != SCVT_NO_RANGE && theta != SCVT_NO_PULSE)
+        add_pixel(bd, i, j, theta, range);
+    }
+  }
+  publish_band(bd);
+};
+
+scan_converter::scan_converter (const scan_converter & sc) :
+  nr(sc.nr),
+  nc(sc.nc),
+  w(sc.w),
+  h(sc.h),
+  x0(sc.x0),
+  y0(sc.y0),
+  xc(sc.xc),
+  yc(sc.yc),
+  always_smooth_angular(sc.always_smooth_angular),
+  scale(sc.scale),
+  first_range(sc.first_range),
+  azi_begin(sc.azi_begin),
+  azi_end(sc.azi_end),
+  azi_step(sc.azi_step),
+  use_simd(sc.use_simd),
+  snc(sc.snc),
+  use_radial_neighbours(sc.use_radial_neighbours),
+  angular_neighbour_thresh(sc.angular_neighbour_thresh),
+  pixel_azi(sc.pixel_azi),
+  pixel_range(sc.pixel_range),
+  azi_lut(sc.azi_lut),
+  circle_pulses(sc.circle_pulses),
+  pulse_code(sc.pulse_code),
+  ang_off(sc.ang_off),
+  map(0),
+  map_size(0),
+  pool_job(0),
+  pool_busy(0),
+  pool_quit(false)
+{
+  pthread_mutex_init(& pool_mutex, 0);
+  pthread_cond_init(& pool_cond, 0);
+  set_threads(sc.workers.size() + 1);
+
+  for (size_t b = 0; b < sc.bands.size(); ++b) {
+    band bd;
+    bd.j0 = sc.bands[b].j0;
+    bd.rows = sc.bands[b].rows;
+    publish_band(bd);
+    bands.push_back(bd);
+  }
+  derive.src = & sc;
+  derive.shift = 0;
+  derive.zoom = 1 << SCVT_ZOOM_FACTOR_PRECISION_BITS;
+};
+
+scan_converter *
+scan_converter::rotated (double turns) const {
+  // a sector of evenly spaced pulses covers different pixels once
+  // rotated, so is rebuilt
+  if (pixel_azi.empty() && fabs(azi_step * nr - 1) > 1e-6)
+    return new scan_converter(nr, nc, w, h, x0, y0, xc, yc, always_smooth_angular, scale, first_range,
+                              azi_begin + turns, azi_end + turns, workers.size() + 1);
+
+  scan_converter * sc = new scan_converter(* this);
+  if (pixel_azi.empty()) {
+    int k = (int) lround(turns / azi_step);
+    sc->azi_begin += k * azi_step;
+    sc->azi_end += k * azi_step;
+    k %= nr;
+    sc->derive.shift = k < 0 ? k + nr : k;
+  } else {
+    int d = (int) lround(turns * SCVT_AZI_LUT_SIZE);
+    for (int a = 0; a < SCVT_AZI_LUT_SIZE; ++a)
+      sc->azi_lut[(a + d) & (SCVT_AZI_LUT_SIZE - 1)] = azi_lut[a];
+  }
+  sc->derive_tables();
+  return sc;
+};
+
+scan_converter *
+scan_converter::panned (int dx, int dy) const {
+  scan_converter * sc = new scan_converter(* this);
+  sc->xc -= dx;
+  sc->yc -= dy;
+  sc->derive_tables();
+  return sc;
+};
+
+scan_converter *
+scan_converter::zoomed (double factor) const {
+  scan_converter * sc = new scan_converter(* this);
+  double z = (1 << SCVT_ZOOM_FACTOR_PRECISION_BITS) / factor;
+  sc->derive.zoom = z > 1 << 30 ? 1 << 30 : z < 1 ? 1 : (int) lround(z);
+  // the scale matching the zoom factor as represented
+  sc->scale = scale * (1 << SCVT_ZOOM_FACTOR_PRECISION_BITS) / sc->derive.zoom;
+  sc->set_smoothing();
+  sc->derive_tables();
+  return sc;
+};
+
+void
+scan_converter::derive_tables () {
+  const scan_converter & sc = * derive.src;
+  if (pixel_azi.empty()) {
+    run_bands(& scan_converter::derive_band);
+  } else {
+    if (derive.zoom != 1 << SCVT_ZOOM_FACTOR_PRECISION_BITS)
+      run_bands(& scan_converter::polar_band);
+    else if (xc != sc.xc || yc != sc.yc)
+      run_bands(& scan_converter::derive_polar_band);
+    run_bands(& scan_converter::lookup_band);
+  }
+  derive.src = 0;
+};
+
+// Pixel (i, j) is at x = i + y0 - xc + 0.5, y = j + x0 - yc + 0.5 (as
+// in build_row()); its source pixel is the one containing (x, y) *
+// zoom in the source's geometry.
+
+inline int
+scan_converter::derive_col (int i) {
+  int64_t x = (int64_t) (2 * (i + y0 - xc) + 1) * derive.zoom;
+  return (int) (x >> (SCVT_ZOOM_FACTOR_PRECISION_BITS + 1)) - y0 + derive.src->xc;
+};
+
+inline int
+scan_converter::derive_row (int j) {
+  int64_t y = (int64_t) (2 * (j + x0 - yc) + 1) * derive.zoom;
+  return (int) (y >> (SCVT_ZOOM_FACTOR_PRECISION_BITS + 1)) - x0 + derive.src->yc;
+};
+
+inline void
+scan_converter::derive_cols (int & ilo, int & ihi) {
+  // source columns don't decrease with i
+  for (ilo = 0; ilo < w && derive_col(ilo) < 0; ++ilo)
+    ;
+  for (ihi = ilo; ihi < w && derive_col(ihi) < derive.src->w; ++ihi)
+    ;
+};
+
+void
+scan_converter::derive_band (int b) {
+  band & bd = bands[b];
+  const scan_converter & sc = * derive.src;
+  std::vector < double > approx(w);
+  clear_band(bd);
+  // usually about as many pixels as the source's band
+  bd.base_buf.reserve(sc.bands[b].npix);
+  bd.code_buf.reserve(sc.bands[b].npix);
+  // the source column of each column, and those which have one, are
+  // the same for every row
+  std::vector < int > cols(w);
+  for (int i = 0; i < w; ++i)
+    cols[i] = derive_col(i);
+  int ilo, ihi;
+  derive_cols(ilo, ihi);
+  for (int j = bd.j0; j < bd.j0 + bd.rows; ++j) {
+    int sj = derive_row(j);
+    if (sj < 0 || sj >= sc.h) {
+      build_row(bd, j, 0, w, & approx[0]);
+      continue;
+    }
+    build_row(bd, j, 0, ilo, & approx[0]);
+
+    // the source row's first run, and the index of its first pixel
+    const band & sb = sc.bands[sj / SCVT_BAND_ROWS];
+    int row = sj - sb.j0;
+    size_t r = 0, p = 0;
+    for (; r < sb.nruns && sb.runs[r].row < row; ++r)
+      p += sb.runs[r].len;
+
+    if (derive.zoom == 1 << SCVT_ZOOM_FACTOR_PRECISION_BITS) {
+      // at the same scale, source column i + dx is column i, so the
+      // source runs are copied a piece at a time
+      int dx = cols[0];
+      for (; r < sb.nruns && sb.runs[r].row == row; p += sb.runs[r].len, ++r) {
+        int lo = std::max(sb.runs[r].col, ilo + dx);
+        int hi = std::min(sb.runs[r].col + sb.runs[r].len, ihi + dx);
+        if (lo < hi)
+          copy_pixels(bd, lo - dx, j - bd.j0, sb.base + p + lo - sb.runs[r].col, sb.codes + p + lo - sb.runs[r].col, hi - lo);
+      }
+    } else {
+      for (int i = ilo; i < ihi; ++i) {
+        int si = cols[i];
+        for (; r < sb.nruns && sb.runs[r].row == row && sb.runs[r].col + sb.runs[r].len <= si; ++r)
+          p += sb.runs[r].len;
+        if (r == sb.nruns || sb.runs[r].row != row || sb.runs[r].col > si)
+          continue; // the source pixel has no data
+        int l = sb.base[p + si - sb.runs[r].col];
+        int theta = l / snc;
+        add_pixel(bd, i, j - bd.j0, theta, l - theta * snc);
       }
     }
+    build_row(bd, j, ihi, w, & approx[0]);
   }
+  publish_band(bd);
 };
 
+void
+scan_converter::copy_pixels (band & bd, int i, int j, const int * base, const uint8_t * codes, int n) {
+  // extend the current run, or start a new one
+  if (bd.run_buf.empty() || bd.run_buf.back().row != j || bd.run_buf.back().col + bd.run_buf.back().len != i) {
+    run r = {j, i, 0};
+    bd.run_buf.push_back(r);
+  }
+  bd.run_buf.back().len += n;
+
+  size_t k = bd.base_buf.size();
+  bd.base_buf.insert(bd.base_buf.end(), base, base + n);
+  bd.code_buf.insert(bd.code_buf.end(), codes, codes + n);
+  if (! derive.shift)
+    return;
+
+  // rotate: each pixel's pulse decreases by derive.shift, modulo nr,
+  // and the angular neighbour code is that of its new pulse.  With
+  // evenly spaced pulses, every pulse has a code, so which pixels are
+  // smoothed doesn't change.
+  int *l = & bd.base_buf[k];
+  uint8_t *c = & bd.code_buf[k];
+  int off = derive.shift * snc, size = nr * snc;
+  for (int m = 0; m < n; ++m)
+    l[m] = l[m] >= off ? l[m] - off : l[m] - off + size;
+  for (int m = 0; m < n; ++m)
+    if (c[m] & SCVT_CODE_ANGULAR)
+      c[m] = (c[m] & (SCVT_CODE_RADIAL | SCVT_CODE_ANGULAR)) | (pulse_code[l[m] / snc] << SCVT_CODE_NEIGHBOUR_SHIFT);
+};
+
+void
+scan_converter::derive_polar_band (int b) {
+  const band & bd = bands[b];
+  const scan_converter & sc = * derive.src;
+  std::vector < double > approx(w);
+  // only used at the same scale, where source column i + dx is column i
+  int ilo, ihi;
+  derive_cols(ilo, ihi);
+  int dx = derive_col(0);
+  for (int j = bd.j0; j < bd.j0 + bd.rows; ++j) {
+    int sj = derive_row(j);
+    if (sj < 0 || sj >= sc.h) {
+      polar_row(j, 0, w, & approx[0]);
+      continue;
+    }
+    polar_row(j, 0, ilo, & approx[0]);
+    size_t k = (size_t) j * w, sk = (size_t) sj * sc.w + dx;
+    std::copy(sc.pixel_range.begin() + sk + ilo, sc.pixel_range.begin() + sk + ihi, pixel_range.begin() + k + ilo);
+    std::copy(sc.pixel_azi.begin() + sk + ilo, sc.pixel_azi.begin() + sk + ihi, pixel_azi.begin() + k + ilo);
+    polar_row(j, ihi, w, & approx[0]);
+  }
+};
+
+bool
+scan_converter::same_tables (const scan_converter & sc) const {
+  if (bands.size() != sc.bands.size() || ang_off != sc.ang_off)
+    return false;
+  for (size_t b = 0; b < bands.size(); ++b) {
+    const band & p = bands[b], & q = sc.bands[b];
+    if (p.nruns != q.nruns || p.npix != q.npix)
+      return false;
+    if (p.npix > 0 && (memcmp(p.base, q.base, p.npix * sizeof(int)) || memcmp(p.codes, q.codes, p.npix)))
+      return false;
+    for (size_t r = 0; r < p.nruns; ++r)
+      if (p.runs[r].row != q.runs[r].row || p.runs[r].col != q.runs[r].col || p.runs[r].len != q.runs[r].len)
+        return false;
+  }
+  return true;
+};
+
+size_t
+scan_converter::table_bytes () {
+  size_t n = 0;
+  for (size_t b = 0; b < bands.size(); ++b)
+    n += bands[b].nruns * sizeof(run) + bands[b].npix * (sizeof(int) + 1);
+  return n;
+};
+
+// A cache file holds a header, the key, a directory of bands, then
+// each band's runs, base indexes and codes, with each of these
+// sections aligned to SCVT_CACHE_ALIGN bytes.  The file is named for
+// the CRC32C of the key, and the key itself is checked on loading.
+
+#define SCVT_CACHE_MAGIC "scvt tables v1\n"
+#define SCVT_CACHE_ALIGN 64
+
+struct scvt_cache_header {
+  char magic[16];
+  uint64_t size;                         // size of the file
+  uint32_t crc;                          // CRC32C of everything after the header
+  uint32_t key_len;                      // bytes in the key, which follows the header
+  uint32_t nbands;                       // number of bands in the directory
+  uint32_t pad;
+  int32_t ang_off[SCVT_MAX_NEIGHBOURS];  // offset to each angular neighbour code
+};
+
+struct scvt_cache_band {
+  int32_t j0, rows;
+  uint64_t nruns, npix;
+  uint64_t runs_off, base_off, codes_off;  // offsets of the band's sections in the file
+};
+
+static inline size_t
+cache_align (size_t n) {
+  return (n + SCVT_CACHE_ALIGN - 1) & ~ (size_t) (SCVT_CACHE_ALIGN - 1);
+};
+
+// offset of the band directory, after the header and a key of n bytes
+static inline size_t
+cache_dir_offset (size_t n) {
+  return cache_align(sizeof(scvt_cache_header) + n);
+};
+
+// is a section of count elements of elt bytes at off within a file of n bytes?
+static inline bool
+cache_section_ok (uint64_t off, uint64_t count, size_t elt, size_t n) {
+  return off % SCVT_CACHE_ALIGN == 0 && off <= n && count <= (n - off) / elt;
+};
+
+std::string
+scan_converter::cache_key () {
+  // everything the constructor's tables depend on, including how
+  // they are built; doubles are written exactly, in hex
+  char buf[512];
+  snprintf(buf, sizeof(buf), "nr=%d nc=%d w=%d h=%d x0=%d y0=%d xc=%d yc=%d smooth_angular=%d"
+           " scale=%a first_range=%a azi_begin=%a azi_end=%a smoothing=%d extra_bits=%d band_rows=%d",
+           nr, nc, w, h, x0, y0, xc, yc, (int) always_smooth_angular,
+           scale, first_range, azi_begin, azi_end,
+#ifdef DO_SCAN_CONVERSION_SMOOTHING
+           1,
+#else
+           0,
+#endif
+           SCVT_EXTRA_PRECISION_BITS, SCVT_BAND_ROWS);
+  return buf;
+};
+
+std::string
+scan_converter::cache_path (const std::string & key) {
+  char name[32];
+  snprintf(name, sizeof(name), "/scvt-%08x.tab", crc32c(0, key.data(), key.size()));
+  return cache_dir + name;
+};
+
+bool
+scan_converter::load_tables () {
+  if (cache_dir.empty())
+    return false;
+  std::string key = cache_key();
+  int fd = open(cache_path(key).c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  void * m = MAP_FAILED;
+  if (! fstat(fd, & st) && st.st_size >= (off_t) sizeof(scvt_cache_header))
+    m = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED)
+    return false;
+
+  const char * p = (const char *) m;
+  size_t n = st.st_size;
+  const scvt_cache_header * hd = (const scvt_cache_header *) p;
+  size_t dir_off = cache_dir_offset(key.size());
+  bool ok = ! memcmp(hd->magic, SCVT_CACHE_MAGIC, sizeof(hd->magic))
+    && hd->size == n
+    && hd->key_len == key.size()
+    && hd->nbands == bands.size()
+    && dir_off + bands.size() * sizeof(scvt_cache_band) <= n
+    && ! memcmp(p + sizeof(scvt_cache_header), key.data(), key.size())
+    && std::equal(ang_off.begin(), ang_off.end(), hd->ang_off);
+  const scvt_cache_band * cb = (const scvt_cache_band *) (p + dir_off);
+  for (size_t b = 0; ok && b < bands.size(); ++b)
+    ok = cb[b].j0 == bands[b].j0
+      && cb[b].rows == bands[b].rows
+      && cache_section_ok(cb[b].runs_off, cb[b].nruns, sizeof(run), n)
+      && cache_section_ok(cb[b].base_off, cb[b].npix, sizeof(int), n)
+      && cache_section_ok(cb[b].codes_off, cb[b].npix, 1, n);
+  // a file cut short or otherwise damaged is rebuilt
+  if (ok)
+    ok = hd->crc == crc32c(0, p + sizeof(scvt_cache_header), n - sizeof(scvt_cache_header));
+  if (! ok) {
+    munmap(m, n);
+    return false;
+  }
+
+  unmap_tables();
+  map = m;
+  map_size = n;
+  for (size_t b = 0; b < bands.size(); ++b) {
+    band & bd = bands[b];
+    bd.runs = (const run *) (p + cb[b].runs_off);
+    bd.nruns = cb[b].nruns;
+    bd.base = (const int *) (p + cb[b].base_off);
+    bd.codes = (const uint8_t *) (p + cb[b].codes_off);
+    bd.npix = cb[b].npix;
+    // free the built tables
+    std::vector < run > ().swap(bd.run_buf);
+    std::vector < int > ().swap(bd.base_buf);
+    std::vector < uint8_t > ().swap(bd.code_buf);
+  }
+  return true;
+};
+
+void
+scan_converter::save_tables () {
+  // Failure to write the cache is not an error; the tables were built
+  // anyway.  The file is written under a temporary name and renamed,
+  // so other processes never see it partly written.
+  if (cache_dir.empty())
+    return;
+  mkdir(cache_dir.c_str(), 0755);
+  std::string key = cache_key();
+  std::string path = cache_path(key);
+
+  size_t dir_off = cache_dir_offset(key.size());
+  std::vector < scvt_cache_band > dir(bands.size());
+  size_t n = cache_align(dir_off + bands.size() * sizeof(scvt_cache_band));
+  for (size_t b = 0; b < bands.size(); ++b) {
+    const band & bd = bands[b];
+    dir[b].j0 = bd.j0;
+    dir[b].rows = bd.rows;
+    dir[b].nruns = bd.nruns;
+    dir[b].npix = bd.npix;
+    dir[b].runs_off = n;
+    n = cache_align(n + bd.nruns * sizeof(run));
+    dir[b].base_off = n;
+    n = cache_align(n + bd.npix * sizeof(int));
+    dir[b].codes_off = n;
+    n = cache_align(n + bd.npix);
+  }
+
+  std::string tmp = path + ".XXXXXX";
+  int fd = mkstemp(& tmp[0]);
+  if (fd < 0)
+    return;
+  void * m = MAP_FAILED;
+  if (! fchmod(fd, 0644) && ! ftruncate(fd, n))
+    m = mmap(0, n, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED) {
+    unlink(tmp.c_str());
+    return;
+  }
+
+  // the file is zero-filled, so only the sections need copying
+  char * p = (char *) m;
+  memcpy(p + sizeof(scvt_cache_header), key.data(), key.size());
+  memcpy(p + dir_off, & dir[0], dir.size() * sizeof(scvt_cache_band));
+  for (size_t b = 0; b < bands.size(); ++b) {
+    const band & bd = bands[b];
+    if (bd.nruns > 0)
+      memcpy(p + dir[b].runs_off, bd.runs, bd.nruns * sizeof(run));
+    if (bd.npix > 0) {
+      memcpy(p + dir[b].base_off, bd.base, bd.npix * sizeof(int));
+      memcpy(p + dir[b].codes_off, bd.codes, bd.npix);
+    }
+  }
+  scvt_cache_header hd;
+  memset(& hd, 0, sizeof(hd));
+  memcpy(hd.magic, SCVT_CACHE_MAGIC, sizeof(SCVT_CACHE_MAGIC));
+  hd.size = n;
+  hd.crc = crc32c(0, p + sizeof(scvt_cache_header), n - sizeof(scvt_cache_header));
+  hd.key_len = key.size();
+  hd.nbands = bands.size();
+  std::copy(ang_off.begin(), ang_off.end(), hd.ang_off);
+  memcpy(p, & hd, sizeof(hd));
+  munmap(m, n);
+
+  if (rename(tmp.c_str(), path.c_str())) {
+    unlink(tmp.c_str());
+    return;
+  }
+  // share the tables with other processes using the file
+  load_tables();
+};
+
+void
+scan_converter::unmap_tables () {
+  if (map)
+    munmap(map, map_size);
+  map = 0;
+  map_size = 0;
+};
 
 scan_converter::~scan_converter() {
-  if (inds) {
-    delete [] inds;
-    inds = 0;
-  };
+  unmap_tables();
+  stop_workers();
+  pthread_cond_destroy(& pool_cond);
+  pthread_mutex_destroy(& pool_mutex);
+};
+
+void
+scan_converter::set_threads (int n) {
+  stop_workers();
+  pool_quit = false;
+  pool_first_job = pool_job;
+  for (int i = 1; i < n; ++i) {
+    pthread_t t;
+    if (pthread_create(& t, NULL, & run_worker, this))
+      break; // make do with fewer threads
+    workers.push_back(t);
+  }
+};
+
+void
+scan_converter::stop_workers () {
+  pthread_mutex_lock(& pool_mutex);
+  pool_quit = true;
+  pthread_cond_broadcast(& pool_cond);
+  pthread_mutex_unlock(& pool_mutex);
+  for (size_t i = 0; i < workers.size(); ++i)
+    pthread_join(workers[i], NULL);
+  workers.clear();
+};
+
+void *
+scan_converter::run_worker (void * p) {
+  scan_converter * sc = (scan_converter *) p;
+  pthread_mutex_lock(& sc->pool_mutex);
+  int job = sc->pool_first_job;
+  for (;;) {
+    while (sc->pool_job == job && ! sc->pool_quit)
+      pthread_cond_wait(& sc->pool_cond, & sc->pool_mutex);
+    if (sc->pool_quit)
+      break;
+    job = sc->pool_job;
+    pthread_mutex_unlock(& sc->pool_mutex);
+    sc->do_bands();
+    pthread_mutex_lock(& sc->pool_mutex);
+    if (--sc->pool_busy == 0)
+      pthread_cond_broadcast(& sc->pool_cond);
+  }
+  pthread_mutex_unlock(& sc->pool_mutex);
+  return 0;
+};
+
+void
+scan_converter::do_bands () {
+  int b;
+  while ((b = __sync_fetch_and_add(& next_band, 1)) < (int) bands.size())
+    (this->*pool_fn)(b);
 };
 
+void
+scan_converter::run_bands (band_fn fn) {
+  // Each band writes only its own index table and image rows, so the
+  // result doesn't depend on which thread processes which band.
+  pthread_mutex_lock(& pool_mutex);
+  pool_fn = fn;
+  next_band = 0;
+  pool_busy = workers.size();
+  ++pool_job;
+  pthread_cond_broadcast(& pool_cond);
+  pthread_mutex_unlock(& pool_mutex);
+
+  do_bands();
+
+  pthread_mutex_lock(& pool_mutex);
+  while (pool_busy > 0)
+    pthread_cond_wait(& pool_cond, & pool_mutex);
+  pthread_mutex_unlock(& pool_mutex);
+};
+
+
+
+// the colour of one pixel from its central sample index l and its
+// neighbour code; ang_off gives the offset of each angular neighbour
+static inline t_pixel
+pixel_colour (const t_sample *samp, int l, int code, const int *ang_off, const t_palette *pal, int sample_origin, int sample_scale) {
+  int sample_sum = samp[l >> SCVT_EXTRA_PRECISION_BITS] - sample_origin;
+  int n = 1;
+  if (code & SCVT_CODE_RADIAL) {
+    sample_sum += samp[(l + SCVT_EXTRA_PRECISION_FACTOR) >> SCVT_EXTRA_PRECISION_BITS] - sample_origin;
+    ++n;
+  }
+  if (code & SCVT_CODE_ANGULAR) {
+    int lp = l + ang_off[code >> SCVT_CODE_NEIGHBOUR_SHIFT];
+    sample_sum += samp[lp >> SCVT_EXTRA_PRECISION_BITS] - sample_origin;
+    ++n;
+    if (code & SCVT_CODE_RADIAL) {
+      sample_sum += samp[(lp + SCVT_EXTRA_PRECISION_FACTOR) >> SCVT_EXTRA_PRECISION_BITS] - sample_origin;
+      ++n;
+    }
+  }
+  return pal[sample_sum / (n * sample_scale)];
+};
 
 void
 scan_converter::apply (t_sample *samp, 
@@ -181,67 +1064,246 @@ scan_converter::apply (t_sample *samp,
    sample_scale : value to divide sample by before looking up in palette; takes into account different bit depths and possible summing of multiple samples
 */
 
-  int i, j, k;
-  int palind;
-#ifdef DO_SCAN_CONVERSION_SMOOTHING
-  int sample_sum;
-  char sample_count;
-#endif
+  args.samp = samp;
+  args.pix = pix;
+  args.span = span;
+  args.pal = pal;
+  args.sample_origin = sample_origin;
+  args.sample_scale = sample_scale;
+  run_bands(& scan_converter::apply_band);
+};
 
-  // addjust the pixel buffer pointer to the start of the subimage
-  pix += x0 + y0 * span;
+void
+scan_converter::apply_band (int b) {
+#ifdef SCVT_HAVE_AVX2
+  if (use_simd) {
+    apply_avx2(bands[b]);
+    return;
+  }
+#endif
+  apply_scalar(bands[b]);
+};
 
-  // convenience variables
-  k = w;
+void
+scan_converter::apply_scalar (const band & bd) {
+  const int *base = bd.base;
+  const uint8_t *code = bd.codes;
+  const int *off = ang_off.data();
+  const t_sample *samp = args.samp;
+  const t_palette *pal = args.pal;
+  int span = args.span;
+  int sample_origin = args.sample_origin;
+  int sample_scale = args.sample_scale;
 
-  // apply the sparse linear map
+  // addjust the pixel buffer pointer to the start of the band
+  t_pixel *pix = args.pix + x0 + (y0 + bd.j0) * span;
 
-#ifdef DO_SCAN_CONVERSION_SMOOTHING
-  sample_sum = sample_count = 0;
-#endif
+  // apply the sparse linear map to each run of pixels with data;
+  // other pixels keep their existing value
 
-  for (i = 0, j = 0; i < num_inds; ++i) {
-#ifdef DO_SCAN_CONVERSION_SMOOTHING
-    if (inds[i] >= 0) {
-      sample_sum += samp[inds[i] >> SCVT_EXTRA_PRECISION_BITS] - sample_origin;
-      ++sample_count;
-    } else { 
-#endif
-      if (inds[i] != SCVT_NODATA_VALUE) {
-	// a negative index represents the last one for
-	// its pixel, so compute the mean and lookup the colour from the
-	// palette for its class.
-#ifdef DO_SCAN_CONVERSION_SMOOTHING
-        // note: rather than divide by sample_count + 1, we shift right by ((sample_count + 1) / 2)
-        // This works because sample_count is 0, 1, or 3 corresponding to 1, 2, or 4 samples being averaged.
-        palind = (sample_sum + samp[ (~ inds[i]) >> SCVT_EXTRA_PRECISION_BITS] - sample_origin) / ((sample_count + 1) * sample_scale);
+  for (size_t r = 0; r < bd.nruns; ++r) {
+    t_pixel *p = pix + bd.runs[r].row * span + bd.runs[r].col;
+    for (int i = 0; i < bd.runs[r].len; ++i) {
+#ifdef DO_ALPHA_BLENDING
+      INLINE_ALPHA_BLEND(pixel_colour(samp, *base++, *code++, off, pal, sample_origin, sample_scale), p[i]);
 #else
-        palind = ((((samp[inds[i] >> SCVT_EXTRA_PRECISION_BITS])) >> sample_shift) & mask);
+      p[i] = pixel_colour(samp, *base++, *code++, off, pal, sample_origin, sample_scale);
 #endif
+    }
+  }
+};
+
+void
+scan_converter::apply_pulses (t_sample *samp,
+                              t_pixel *pix,
+                              int span,
+                              t_palette *pal,
+                              int sample_origin,
+                              int sample_scale,
+                              int first,
+                              int n
+                              ) {
+  // e.g. after set_azimuths() with no pulses
+  if (nr <= 0)
+    return;
+
+  if (pulse_pixel_first.empty())
+    index_pulses();
+
+  const int *off = ang_off.data();
+  t_pixel *sub = pix + x0 + y0 * span;
+  first %= nr;
+  if (first < 0)
+    first += nr;
+  n = std::min(n, nr);
+
+  // each pulse's samples are read in order of range
+  for (int m = 0; m < n; ++m) {
+    int t = first + m < nr ? first + m : first + m - nr;
+    int l0 = t * snc;
+    for (size_t k = pulse_pixel_first[t]; k < pulse_pixel_first[t + 1]; ++k) {
+      uint32_t q = pulse_pixel_pos[k];
+      t_pixel *p = sub + (q >> 16) * span + (q & 0xffff);
 #ifdef DO_ALPHA_BLENDING
-        INLINE_ALPHA_BLEND(pal[palind], pix[j]);
+      INLINE_ALPHA_BLEND(pixel_colour(samp, l0 + pulse_pixel_range[k], pulse_pixel_code[k], off, pal, sample_origin, sample_scale), *p);
 #else
-        pix[j] = pal[palind];
-#endif
-#ifdef DO_SCAN_CONVERSION_SMOOTHING
-	sample_sum = sample_count = 0;
+      *p = pixel_colour(samp, l0 + pulse_pixel_range[k], pulse_pixel_code[k], off, pal, sample_origin, sample_scale);
 #endif
-      } else {
-	// This is a pixel for which no data value exists;
-	// its existing value is preserved.
+    }
+  }
+};
 
-	/* do nothing */
+void
+scan_converter::index_pulses () {
+  // every pixel, in table order, with its pulse and range
+  size_t n = 0;
+  for (size_t b = 0; b < bands.size(); ++b)
+    n += bands[b].npix;
+  std::vector < uint32_t > pos(n);
+  std::vector < int > pulse(n);
+  std::vector < uint16_t > range(n);
+  std::vector < uint8_t > code(n);
+  size_t k = 0;
+  for (size_t b = 0; b < bands.size(); ++b) {
+    const band & bd = bands[b];
+    const int *base = bd.base;
+    const uint8_t *c = bd.codes;
+    for (size_t r = 0; r < bd.nruns; ++r) {
+      for (int i = 0; i < bd.runs[r].len; ++i, ++k) {
+        pos[k] = (uint32_t) (bd.j0 + bd.runs[r].row) << 16 | (bd.runs[r].col + i);
+        int l = *base++;
+        pulse[k] = l / snc;
+        range[k] = l - pulse[k] * snc;
+        code[k] = *c++;
       }
-      // we're finished with the current pixel
-      if (++j == k) {
-	// we've finished a row, so do alpha blending
-	// start the next image row
+    }
+  }
+
+  // sort by range, then stably by pulse; both are counting sorts
+  std::vector < size_t > by_range(n);
+  std::vector < size_t > next(snc + 1, 0);
+  for (k = 0; k < n; ++k)
+    ++next[range[k] + 1];
+  for (int r = 0; r < snc; ++r)
+    next[r + 1] += next[r];
+  for (k = 0; k < n; ++k)
+    by_range[next[range[k]]++] = k;
+
+  pulse_pixel_first.assign(nr + 1, 0);
+  for (k = 0; k < n; ++k)
+    ++pulse_pixel_first[pulse[k] + 1];
+  for (int t = 0; t < nr; ++t)
+    pulse_pixel_first[t + 1] += pulse_pixel_first[t];
+  next.assign(pulse_pixel_first.begin(), pulse_pixel_first.end() - 1);
+  pulse_pixel_pos.resize(n);
+  pulse_pixel_range.resize(n);
+  pulse_pixel_code.resize(n);
+  for (size_t m = 0; m < n; ++m) {
+    k = by_range[m];
+    size_t d = next[pulse[k]]++;
+    pulse_pixel_pos[d] = pos[k];
+    pulse_pixel_range[d] = range[k];
+    pulse_pixel_code[d] = code[k];
+  }
+};
+
+#ifdef SCVT_HAVE_AVX2
 
-	j = 0;
-	pix += span;
+// gather the samples at indexes l, reading each as the aligned 32-bit
+// word holding it, so that no load crosses the end of the sample
+// buffer; words is the sample buffer rounded down to 32-bit alignment,
+// and odd is 1 if that moved it back by one sample.  Only lanes set in
+// mask are read (neighbour indexes of lanes without that neighbour
+// may be outside the buffer); the others are 0.
+__attribute__((target("avx2"))) static inline __m256i
+gather_samples (const int *words, __m256i l, __m256i odd, __m256i mask = _mm256_set1_epi32(-1)) {
+  const __m256i one = _mm256_set1_epi32(1);
+  __m256i s = _mm256_add_epi32(_mm256_srli_epi32(l, SCVT_EXTRA_PRECISION_BITS), odd);
+  __m256i w32 = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), words, _mm256_srli_epi32(s, 1), mask, 4);
+  s = _mm256_srlv_epi32(w32, _mm256_slli_epi32(_mm256_and_si256(s, one), 4));
+  return _mm256_and_si256(s, _mm256_set1_epi32(0xffff));
+};
+
+// the doubles of r selected by the indexes 0..3 in k
+__attribute__((target("avx2"))) static inline __m256d
+pick_reciprocal (__m256i r, __m128i k) {
+  __m256i k2 = _mm256_slli_epi64(_mm256_cvtepu32_epi64(k), 1);
+  __m256i idx = _mm256_or_si256(k2, _mm256_slli_epi64(_mm256_add_epi64(k2, _mm256_set1_epi64x(1)), 32));
+  return _mm256_castsi256_pd(_mm256_permutevar8x32_epi32(r, idx));
+};
+
+__attribute__((target("avx2"))) void
+scan_converter::apply_avx2 (const band & bd) {
+  // Eight pixels at a time: the samples named by their base indexes
+  // and neighbour codes are gathered, summed and divided, and the
+  // colours gathered from the palette.
+
+  const int *base = bd.base;
+  const uint8_t *code = bd.codes;
+  const int *off = ang_off.data();
+  const t_sample *samp = args.samp;
+  const t_palette *pal = args.pal;
+  int span = args.span;
+  int sample_origin = args.sample_origin;
+  int sample_scale = args.sample_scale;
+
+  int odd = ((uintptr_t) samp & 2) >> 1;   // is samp not 32-bit aligned?
+  const int *words = (const int *) (samp - odd);
+
+  // Division by the number of samples times sample_scale is done by
+  // multiplying by a reciprocal, in double precision, so that
+  // truncation gives the same quotient as integer division; the
+  // reciprocal is enlarged by 2^-40 so exact multiples aren't rounded
+  // down.
+  double rcp[SCVT_MAX_INDS + 1];
+  rcp[0] = 0;
+  for (int n = 1; n <= SCVT_MAX_INDS; ++n)
+    rcp[n] = (1 + ldexp(1.0, -40)) / ((double) n * sample_scale);
+  // the reciprocal for each combination of the radial and angular
+  // bits, picked by a permute rather than a gather
+  const __m256i rcps = _mm256_castpd_si256(_mm256_setr_pd(rcp[1], rcp[2], rcp[2], rcp[4]));
+
+  const __m256i vodd = _mm256_set1_epi32(odd);
+  const __m256i radial_bit = _mm256_set1_epi32(SCVT_CODE_RADIAL);
+  const __m256i angular_bit = _mm256_set1_epi32(SCVT_CODE_ANGULAR);
+  const __m256i next = _mm256_set1_epi32(SCVT_EXTRA_PRECISION_FACTOR);
+  const __m256i origin = _mm256_set1_epi32(sample_origin);
+  const __m256i both_bits = _mm256_set1_epi32(SCVT_CODE_RADIAL | SCVT_CODE_ANGULAR);
+
+  t_pixel *pix = args.pix + x0 + (y0 + bd.j0) * span;
+
+  for (size_t r = 0; r < bd.nruns; ++r) {
+    t_pixel *p = pix + bd.runs[r].row * span + bd.runs[r].col;
+    int len = bd.runs[r].len;
+    int i = 0;
+    for (; i + 8 <= len; i += 8, base += 8, code += 8) {
+      __m256i l = _mm256_loadu_si256((const __m256i *) base);
+      __m256i c = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) code));
+      __m256i radial = _mm256_cmpeq_epi32(_mm256_and_si256(c, radial_bit), radial_bit);
+      __m256i angular = _mm256_cmpeq_epi32(_mm256_and_si256(c, angular_bit), angular_bit);
+
+      __m256i sum = _mm256_sub_epi32(gather_samples(words, l, vodd), origin);
+      if (! _mm256_testz_si256(radial, radial))
+        sum = _mm256_add_epi32(sum, _mm256_and_si256(radial, _mm256_sub_epi32(gather_samples(words, _mm256_add_epi32(l, next), vodd, radial), origin)));
+      if (! _mm256_testz_si256(angular, angular)) {
+        __m256i lp = _mm256_add_epi32(l, _mm256_i32gather_epi32(off, _mm256_srli_epi32(c, SCVT_CODE_NEIGHBOUR_SHIFT), 4));
+        sum = _mm256_add_epi32(sum, _mm256_and_si256(angular, _mm256_sub_epi32(gather_samples(words, lp, vodd, angular), origin)));
+        __m256i diagonal = _mm256_and_si256(radial, angular);
+        if (! _mm256_testz_si256(diagonal, diagonal))
+          sum = _mm256_add_epi32(sum, _mm256_and_si256(diagonal, _mm256_sub_epi32(gather_samples(words, _mm256_add_epi32(lp, next), vodd, diagonal), origin)));
       }
-#ifdef DO_SCAN_CONVERSION_SMOOTHING
+
+      __m256i k = _mm256_and_si256(c, both_bits);
+      __m128i q_lo = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(sum)),
+                                                       pick_reciprocal(rcps, _mm256_castsi256_si128(k))));
+      __m128i q_hi = _mm256_cvttpd_epi32(_mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(sum, 1)),
+                                                       pick_reciprocal(rcps, _mm256_extracti128_si256(k, 1))));
+      __m256i palind = _mm256_set_m128i(q_hi, q_lo);
+      _mm256_storeu_si256((__m256i *) (p + i), _mm256_i32gather_epi32((const int *) pal, palind, 4));
     }
-#endif
+    for (; i < len; ++i)
+      p[i] = pixel_colour(samp, *base++, *code++, off, pal, sample_origin, sample_scale);
   }
 };
+
+#endif // SCVT_HAVE_AVX2
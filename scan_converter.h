@@ -20,18 +20,42 @@
 #define SCVT_EXTRA_PRECISION_FACTOR (1 << SCVT_EXTRA_PRECISION_BITS)
 #define SCVT_EXTRA_PRECISION_DROP (SCVT_EXTRA_PRECISION_FACTOR - 1)
 
-#define SCVT_NODATA_VALUE 0x80000001
-#define SCVT_IND(x)      inds[num_inds++] =   (x)
-// negative cache entries mark the last index for a given pixel; we use "~" instead of "-" 
-// so that index zero can still be marked as last.
-#define SCVT_IND_LAST(x) inds[num_inds++] = (~(x))
-#define SCVT_NO_IND      inds[num_inds++] = SCVT_NODATA_VALUE
+// each pixel averages up to this many input slots
+
+#define SCVT_MAX_INDS 4
+
+// Each pixel's input slots are given by the index of its central slot
+// and an 8-bit neighbour code: whether it also uses the next slot in
+// range (radial), the slot at the same range in the pulse's angular
+// neighbour (angular), and both of these plus the next slot in range
+// from the angular neighbour.  The top bits of the code select the
+// offset to the angular neighbour from a small per-converter table.
+
+#define SCVT_CODE_RADIAL 1
+#define SCVT_CODE_ANGULAR 2
+#define SCVT_CODE_NEIGHBOUR_SHIFT 2
+#define SCVT_MAX_NEIGHBOURS (256 >> SCVT_CODE_NEIGHBOUR_SHIFT) // distinct angular neighbour offsets
+#define SCVT_NO_NEIGHBOUR 0xff  // pulse code for a pulse without an angular neighbour
+
+// the output image is divided into bands of this many rows, each with
+// its own index table, so that bands can be built and applied by
+// different threads
+
+#define SCVT_BAND_ROWS 32
 
 // the number of bits of fractional precision to apply in zooming existing
 // indexes; this is the number of fractional bits used in representing old->pps / pps
 
 #define SCVT_ZOOM_FACTOR_PRECISION_BITS 16     
 
+// the number of bits of azimuth resolution in the lookup table from
+// azimuth to pulse used with set_azimuths(); 16 bits is ~ 0.0055 degrees
+
+#define SCVT_AZI_LUT_BITS 16
+#define SCVT_AZI_LUT_SIZE (1 << SCVT_AZI_LUT_BITS)
+#define SCVT_NO_PULSE (-1)     // azimuth lookup table entry for no pulse
+#define SCVT_NO_RANGE 0xffff   // pixel range for pixels outside the data
+
 /**
    @class scan_converter 
    @brief conversion of polar radar data to rectangular coordinates
@@ -45,6 +69,9 @@
 */
 
 #include <stdint.h>
+#include <pthread.h>
+#include <vector>
+#include <string>
 
 typedef uint16_t      t_sample;
 typedef uint32_t      t_pixel;
@@ -55,7 +82,8 @@ class scan_converter {
  public:
   int nr, nc;  // dimensions of source data buffer in angle count, radius count
                // data must be stored in increasing radius within increasing angle
-               // FIXME:  for now we assume the angles are evenly spaced
+               // The angles are assumed evenly spaced from azi_begin to azi_end,
+               // unless set_azimuths() has been called.
 
   int w, h;  // dimensions of image sub-buffer in pixels (width, height)
 
@@ -90,11 +118,46 @@ class scan_converter {
 		   double scale,
 		   double first_range,
                    double azi_begin,
-                   double azi_end
+                   double azi_end,
+                   int threads = 1
                    );
 
   ~scan_converter();
 
+  // use n threads (including the caller's) for building and applying
+  // the index tables.  The image is the same for any number of threads.
+  void set_threads (int n);
+
+  int get_threads () {return workers.size() + 1;};
+
+  // the shape of the sample buffer apply() reads: get_nr() pulses of
+  // get_nc() samples
+  int get_nr () {return nr;};
+  int get_nc () {return nc;};
+
+  // use the actual azimuth of each pulse rather than evenly spaced
+  // azimuths; this lets every pulse of a sweep be drawn without
+  // resampling.  azi[i] is the azimuth of pulse i [0..1] (as in the
+  // sweep file), to which azi_offset is added.  Pulses whose azimuth is
+  // NaN are not drawn.  The sweep's pulses are then np rows of nc
+  // samples, so nr becomes np.
+  //
+  // Each pixel shows the pulse nearest it in azimuth, unless that is
+  // further than the typical spacing between pulses, in which case the
+  // pixel has no data.  Pulses with the same azimuth (e.g. from a
+  // quantized azimuth encoder) share the same pixels, which show the
+  // latest of them, and the spacing is that between distinct azimuths.
+  // The angular neighbour of a pulse (for smoothing) is the pulse
+  // before it in azimuth.
+  //
+  // The first call computes the azimuth and range of each pixel; later
+  // calls, even with a different number of pulses, only rebuild the
+  // index list from those and the azimuth lookup table.
+  void set_azimuths (const float *azi,
+                     int np,
+                     double azi_offset = 0
+                     );
+
   void apply (t_sample *samp, 
               t_pixel *pix,
               int span,
@@ -102,16 +165,276 @@ class scan_converter {
               int sample_origin,
               int sample_scale
               );
+
+  // Render only the pixels drawn from pulses first .. first + n - 1
+  // (modulo nr), such as those just received, into an image otherwise
+  // kept up to date by apply() or earlier calls; other pixels keep
+  // their value.  The other arguments are as for apply(), with samp
+  // holding the whole sweep.  A pixel smoothed with its angular
+  // neighbour uses that pulse's samples as they are at the time, so
+  // rendering each pulse once its neighbour has arrived gives the same
+  // image as apply().
+  //
+  // The first call lists the pixels of each pulse, sorted by sample,
+  // which takes about as long as building the tables; the list lasts
+  // until set_azimuths().  Only the calling thread is used.
+  void apply_pulses (t_sample *samp,
+                     t_pixel *pix,
+                     int span,
+                     t_palette *pal,
+                     int sample_origin,
+                     int sample_scale,
+                     int first,
+                     int n
+                     );
+
+  // Derive a new converter from this one, for adjusting a live
+  // display, without building its index tables from scratch.  The
+  // caller deletes the new converter.  Its tables are not cached.
+
+  // the image turned by turns [0..1] in the direction of increasing
+  // azimuth.  When evenly spaced pulses fill the circle, this is
+  // rounded to a whole number of pulses and each pixel's pulse is
+  // shifted modulo nr; a sector of pulses is rebuilt.  With actual
+  // azimuths, the azimuth lookup table is shifted by the nearest
+  // number of bins; later calls to set_azimuths() replace this, so
+  // their azi_offset should include the rotation.
+  scan_converter * rotated (double turns) const;
+
+  // the view moved dx pixels right and dy pixels down over the data,
+  // i.e. with the centre at (xc - dx, yc - dy).  Pixels still in view
+  // keep their indexes, and only those newly in view are computed, so
+  // the tables are the same as those built from scratch.
+  scan_converter * panned (int dx, int dy) const;
+
+  // the image magnified by factor about the centre (xc, yc), so scale
+  // becomes scale * factor.  Each pixel takes the indexes of the pixel
+  // at the corresponding position in this converter, which is found
+  // in fixed point with SCVT_ZOOM_FACTOR_PRECISION_BITS fractional
+  // bits; pixels beyond this converter's image are computed.  The
+  // result is approximate: a pixel is sampled where the centre of its
+  // source pixel is, up to half a source pixel from where a converter
+  // built with the new scale would sample it.  With actual azimuths,
+  // each pixel's polar coordinates are recomputed instead.
+  scan_converter * zoomed (double factor) const;
+
+  bool use_simd; // use the vectorised apply kernel; true by default when the CPU supports AVX2
+
+  // the number of bytes used by the index tables
+  size_t table_bytes ();
+
+  // do this converter's index tables match those of sc?
+  bool same_tables (const scan_converter & sc) const;
+
+  // if true, converters constructed (or given azimuths) afterwards
+  // compute every pixel's azimuth with atan2(), rather than with a
+  // faster approximation checked against pulse boundaries.  The
+  // tables are the same either way; this is for testing.
+  static bool exact_geometry;
+
+  // If not empty, the directory in which converters cache their index
+  // tables, one file per set of constructor parameters.  A converter
+  // whose tables are in the cache maps them from the file rather than
+  // building them, and all processes using that file share one copy
+  // of the tables in memory.  Tables built by set_azimuths() are not
+  // cached.
+  static std::string cache_dir;
+
+  // are the index tables mapped from a cache file?
+  bool tables_mapped () {return map != 0;};
   
  protected:
   // We don't use floating point coefficients.  Instead, for each output slot,
-  // we maintain a list of up to 5 indexes of slots in the input buffer.  The
+  // we maintain a list of up to SCVT_MAX_INDS indexes of slots in the input buffer.  The
   // value for the output slot is then obtained as the average of these input
-  // slots.
+  // slots.  The indexes are stored compactly (see SCVT_CODE_RADIAL),
+  // and only for pixels with data, which are grouped into runs along
+  // each row; pixels outside the runs keep their existing value.
+
+  struct run {
+    int row;   // row of the run in its band
+    int col;   // column of the first pixel in the run
+    int len;   // number of pixels in the run
+  };
+
+  struct band {
+    int j0;                          // first row of the band in the sub-image
+    int rows;                        // number of rows in the band
+    const run * runs;                // runs of pixels with data, in row-major order
+    size_t nruns;                    // number of runs
+    const int * base;                // index of the central slot for each pixel in the runs
+    const uint8_t * codes;           // neighbour code for each pixel in the runs
+    size_t npix;                     // number of pixels in the runs
+
+    // the tables as built; runs, base and codes point either into
+    // these or into the cache file
+    std::vector < run > run_buf;
+    std::vector < int > base_buf;
+    std::vector < uint8_t > code_buf;
+  };
+
+  std::vector < band > bands;
+
+  // arguments to the apply() call in progress
+  struct apply_args {
+    t_sample *samp;
+    t_pixel *pix;
+    int span;
+    t_palette *pal;
+    int sample_origin;
+    int sample_scale;
+  } args;
+
+  int snc; // scaled version of nc with extra precision
+  bool use_radial_neighbours; // true if radially neighbouring input slots are used for each output slot
+  int angular_neighbour_thresh; // the minimum (in pixels) at which angular neighbours are not used for each pixel
+
+  std::vector < uint16_t > pixel_azi;   // azimuth of each pixel, in units of 1 / SCVT_AZI_LUT_SIZE; empty until set_azimuths() is called
+  std::vector < uint16_t > pixel_range; // scaled range of each pixel, or SCVT_NO_RANGE
+  std::vector < int > azi_lut;          // pulse for each azimuth, or SCVT_NO_PULSE
+
+  double circle_pulses;                 // the number of pulses which would fill the circle, for smoothing
+
+  std::vector < uint8_t > pulse_code;   // code for the offset to each pulse's angular neighbour, or SCVT_NO_NEIGHBOUR
+  std::vector < int > ang_off;          // offset to the angular neighbour for each code
+
+  // The pixels of each pulse, for apply_pulses(): those of pulse t
+  // are [pulse_pixel_first[t], pulse_pixel_first[t + 1]), sorted by
+  // range.  Empty until needed.
+  std::vector < size_t > pulse_pixel_first;
+  std::vector < uint32_t > pulse_pixel_pos;    // row << 16 | column of each pixel in the sub-image
+  std::vector < uint16_t > pulse_pixel_range;  // scaled range of each pixel's central slot
+  std::vector < uint8_t > pulse_pixel_code;    // neighbour code of each pixel
+
+  // list the pixels of each pulse from the index tables
+  void index_pulses ();
+
+  // set use_radial_neighbours and angular_neighbour_thresh from scale and circle_pulses
+  void set_smoothing ();
+
+  // set pulse_code and ang_off, given the angular neighbour prev[t] of each pulse t
+  void code_neighbours (const std::vector < int > & prev);
+
+  // add pixel (i, j) of band bd, which is at the given scaled range in pulse theta
+  inline void add_pixel (band & bd, int i, int j, int theta, int range);
+
+  // remove all pixels from band bd
+  void clear_band (band & bd);
+
+  // point band bd's tables at the ones just built
+  void publish_band (band & bd);
+
+  // the cache file mapped for the index tables, if any
+  void * map;
+  size_t map_size;
+
+  // the parameters which determine the index tables built by the
+  // constructor, and the name of their cache file
+  std::string cache_key ();
+  std::string cache_path (const std::string & key);
+
+  // map the index tables from the cache; returns false if they aren't there
+  bool load_tables ();
+
+  // write the index tables to the cache, then map them from there
+  void save_tables ();
+
+  // stop using the cache file, if any
+  void unmap_tables ();
+
+  // Work done one band at a time, by run_bands()
+
+  // build band b's index table from evenly spaced azimuths
+  void build_band (int b);
+
+  // add pixels [ilo, ihi) of row j of the sub-image to band bd, using
+  // approx as scratch space for ihi - ilo values
+  void build_row (band & bd, int j, int ilo, int ihi, double * approx);
+
+  // compute pixel_azi and pixel_range for band b
+  void polar_band (int b);
+
+  // compute pixel_azi and pixel_range for pixels [ilo, ihi) of row j
+  void polar_row (int j, int ilo, int ihi, double * approx);
+
+  // A derived converter starts as a copy of another's parameters,
+  // azimuths and smoothing, but with empty tables.
+  scan_converter (const scan_converter & sc);
+
+  // how a derived converter's pixels correspond to its source's
+  struct derive_args {
+    const scan_converter * src;
+    int shift;      // pulses by which to decrease each pixel's pulse, modulo nr
+    int zoom;       // source pixels per pixel, with SCVT_ZOOM_FACTOR_PRECISION_BITS fractional bits
+  } derive;
+
+  // the source pixel column or row corresponding to column i or row j,
+  // which may be outside the source image
+  inline int derive_col (int i);
+  inline int derive_row (int j);
+
+  // the columns [ilo, ihi) which have a source pixel
+  inline void derive_cols (int & ilo, int & ihi);
+
+  // add n pixels starting at (i, j) of band bd, with the given indexes
+  // from the source, adjusted for derive.shift
+  void copy_pixels (band & bd, int i, int j, const int * base, const uint8_t * codes, int n);
+
+  // fill band b's index table or polar coordinates from the source
+  void derive_band (int b);
+  void derive_polar_band (int b);
+
+  // finish deriving a converter from derive.src
+  void derive_tables ();
+
+  // build band b's index table from azi_lut
+  void lookup_band (int b);
+
+  // apply band b's index table using args
+  void apply_band (int b);
+
+  // apply a band's index table, one pixel at a time
+  void apply_scalar (const band & bd);
+
+  // apply a band's index table eight pixels at a time with AVX2.
+  //
+  // This is bound by loads, not arithmetic: each pixel gathers 7 or 8
+  // samples (its own and up to three neighbours, for two channels) at
+  // about 1 ns per element, and the samples of a production sweep
+  // (21.6 MB) don't fit in L2, so about 8 ms of a frame is spent on
+  // misses.  Measured per production frame: scalar ~27 ms, this ~17.5
+  // ms; with the samples shrunk to fit L2, ~12 ms.  There is no
+  // AVX-512 path because its gathers cost no less per element (14M
+  // elements: ~14.6 ms vs ~14 ms with AVX2), so wider vectors can't
+  // help.
+  void apply_avx2 (const band & bd);
+
+  // A pool of worker threads, which share the bands of each job with
+  // the calling thread.
+
+  typedef void (scan_converter::*band_fn) (int b);
+
+  std::vector < pthread_t > workers;
+  pthread_mutex_t pool_mutex;
+  pthread_cond_t pool_cond;
+  band_fn pool_fn;     // function being run on each band
+  int pool_job;        // incremented for each job
+  int pool_first_job;  // the job number when the current workers were started
+  int pool_busy;       // workers still running the current job
+  bool pool_quit;      // true when workers should exit
+  int next_band;       // the next band to be claimed by a thread
+
+  // run fn on every band, using all threads; returns when all are done
+  void run_bands (band_fn fn);
+
+  // claim and process bands until there are none left
+  void do_bands ();
+
+  // the loop run by each worker thread
+  static void * run_worker (void * sc);
 
-  int inds_alloc; // how big have we allocated the index list
-  int num_inds; // how many indices are actually in index list
-  int *inds; // pointer to the indexes; if NULL, there are none
+  // stop and join the worker threads
+  void stop_workers ();
 };
   
 
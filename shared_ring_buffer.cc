@@ -1,24 +1,42 @@
 /**
    @file shared_ring_buffer.cc
    @author John Brzustowski <jbrzusto is at fastmail dot fm>
-   @version 0.1
+   @version 0.2
    @date 2015
    @license GPL v2 or later
  */
 
 #include "shared_ring_buffer.h"
 #include <stdexcept>
+#include <new>
 #include <memory.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
 
-shared_ring_buffer::shared_ring_buffer  (int chunk_size, int num_chunks) :
+shared_ring_buffer::shared_ring_buffer  (int chunk_size, int num_chunks, overrun_policy policy) :
   chunk_size (chunk_size),
   num_chunks (num_chunks),
-  buf (chunk_size * num_chunks),
-  reader_chunk_index (-1),
-  writer_chunk_index (-1),
-  chunk_write_complete (false),
-  chunk_read_complete (false),
-  index_mutex (PTHREAD_MUTEX_INITIALIZER),
+  policy (policy),
+  buf (chunk_size * (num_chunks + 1)),
+  head (0),
+  writing_spare (false),
+  chunk_write_complete (true),
+  num_writing (0),
+  writer_waiting (false),
+  chunks_dropped (0),
+  chunks_overwritten (0),
+  writer_waits (0),
+  high_water (0),
+  tail (0),
+  reader_hold (SRB_NO_HOLD),
+  chunk_read_complete (true),
+  num_reading (0),
+  reader_waiting (false),
+  max_spin (0),
+  spin (0),
+  chunks_read (0),
   m_done(false)
 {
   if (chunk_size < 1)
@@ -26,74 +44,249 @@ shared_ring_buffer::shared_ring_buffer  (int chunk_size, int num_chunks) :
 
   if (num_chunks < 2)
     throw std::runtime_error("shared_ring_buffer: invalid number of chunks; must be >= 2");
+
+  pthread_condattr_t attr;
+  pthread_condattr_init (& attr);
+  pthread_condattr_setclock (& attr, CLOCK_MONOTONIC);
+  pthread_cond_init (& wait_cond, & attr);
+  pthread_cond_init (& room_cond, & attr);
+  pthread_condattr_destroy (& attr);
+  pthread_mutex_init (& wait_mutex, 0);
 };
 
 shared_ring_buffer::~shared_ring_buffer ()
 {
-  pthread_mutex_destroy (& index_mutex);
+  pthread_cond_destroy (& room_cond);
+  pthread_cond_destroy (& wait_cond);
+  pthread_mutex_destroy (& wait_mutex);
+};
+
+void *
+shared_ring_buffer::operator new (size_t size)
+{
+  void * p;
+  if (posix_memalign(& p, SRB_CACHE_LINE_SIZE, size))
+    throw std::bad_alloc();
+  return p;
+};
+
+void
+shared_ring_buffer::operator delete (void * p)
+{
+  free(p);
+};
+
+void
+shared_ring_buffer::get_spans(uint64_t seq, int n, chunk_span span[2])
+{
+  int ci = seq % num_chunks;
+  int n0 = n < num_chunks - ci ? n : num_chunks - ci;
+  span[0].p = & buf[ci * chunk_size];
+  span[0].n = n0;
+  span[1].p = n > n0 ? & buf[0] : 0;
+  span[1].n = n - n0;
 };
 
 unsigned char *
-shared_ring_buffer::read_chunk() 
+shared_ring_buffer::read_chunk()
 {
-  int ci;
-  pthread_mutex_lock(&index_mutex);
-
-  // if we've caught up with the writer, fail; we have already read this chunk,
-  // which the writer had finished, but the writer has not advanced to a new
-  // chunk yet.  This fixes the problem of the reader passing the writer.
-  if (reader_chunk_index == writer_chunk_index) {
-    pthread_mutex_unlock(&index_mutex);
-    return 0;
+  chunk_span span[2];
+  return read_chunks(1, span) ? span[0].p : 0;
+};
+
+int
+shared_ring_buffer::read_chunks(int max_n, chunk_span span[2])
+{
+  // a reader asking for new chunks is finished with the old ones
+  done_reading_chunk();
+
+  for (;;) {
+    // the acquire load of head makes the writer's stores to the
+    // chunks visible.
+    uint64_t t = tail.load(std::memory_order_acquire);
+    uint64_t avail = head.load(std::memory_order_acquire) - t;
+    if (avail == 0 || max_n < 1) {
+      reader_hold.store(SRB_NO_HOLD, std::memory_order_release);
+      return 0;
+    }
+    int n = avail < (uint64_t) max_n ? (int) avail : max_n;
+
+    // announce the hold before claiming, so that a writer which sees
+    // our new tail also sees the hold (see room())
+    reader_hold.store(t, std::memory_order_seq_cst);
+    if (tail.compare_exchange_strong(t, t + n, std::memory_order_acq_rel)) {
+      num_reading = n;
+      get_spans(t, n, span);
+      begin_reading_chunk();
+      return n;
+    }
+    // the writer discarded the oldest chunk under us; try again
   }
+};
 
-  // try bump up to the next chunk in the ring
-  ci = (1 + reader_chunk_index) % num_chunks;
+unsigned char *
+shared_ring_buffer::wait_for_chunk(double timeout)
+{
+  chunk_span span[2];
+  return wait_for_chunks(1, span, timeout) ? span[0].p : 0;
+};
 
-  // if it's the writer's chunk, or if no chunks have been written,
-  // we fail.  Note that we might fail because the writer
-  // has passed us and ended up on the next chunk, which means
-  // the writer is writing much faster than the reader, at least
-  // sometimes, and a larger number of chunks should be used.
-  if ((ci == writer_chunk_index && ! is_done_writing_chunk()) || writer_chunk_index == -1) {
-    ci = -1;
-  } else {
-    reader_chunk_index = ci;
-    begin_reading_chunk();
-  };
+int
+shared_ring_buffer::wait_for_chunks(int max_n, chunk_span span[2], double timeout)
+{
+  // check the done flag before the ring, so that chunks published
+  // just before done() are not missed
+  bool d = is_done();
+  int n = read_chunks(max_n, span);
+  if (n || d)
+    return n;
 
-  // Note: it's possible the writer has passed us, which means the
-  // writer has been writing faster than the reader has been reading,
-  // at least for a while.  In this case, we opt to skip forward,
-  // favouring trying to keep up with the writer over always reading
-  // the oldest chunk in the ring.  This results in a simpler
-  // algorithm.  If this occurs (and the class provides no evidence
-  // of it), the client code should use a larger number of chunks.
+  // poll for a while, if recent polling has paid off; always poll
+  // at least once when spinning is enabled, so that spin can grow again
+  int polls = spin > 0 ? spin : (max_spin > 0 ? 1 : 0);
+  for (int i = 0; i < polls; ++i) {
+    sched_yield();
+    d = is_done();
+    n = read_chunks(max_n, span);
+    if (n || d) {
+      if (n && spin < max_spin)
+        spin = spin * 2 + 1 < max_spin ? spin * 2 + 1 : max_spin;
+      return n;
+    }
+  }
+  spin /= 2;
 
-  pthread_mutex_unlock(&index_mutex);
+  struct timespec deadline;
+  if (timeout >= 0) {
+    clock_gettime(CLOCK_MONOTONIC, & deadline);
+    long ns = deadline.tv_nsec + (long) (1e9 * (timeout - (long) timeout));
+    deadline.tv_sec += (long) timeout + ns / 1000000000;
+    deadline.tv_nsec = ns % 1000000000;
+  }
 
-  return ci >= 0 ? & buf[ci * chunk_size] : 0;
+  pthread_mutex_lock(& wait_mutex);
+  reader_waiting.store(true, std::memory_order_relaxed);
+  // pairs with the fence in wake: either the writer sees
+  // reader_waiting, or we see the writer's new head
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  for (;;) {
+    d = is_done();
+    n = read_chunks(max_n, span);
+    if (n || d)
+      break;
+    int rv = timeout >= 0
+      ? pthread_cond_timedwait(& wait_cond, & wait_mutex, & deadline)
+      : pthread_cond_wait(& wait_cond, & wait_mutex);
+    if (rv == ETIMEDOUT) {
+      n = read_chunks(max_n, span);
+      break;
+    }
+  }
+  reader_waiting.store(false, std::memory_order_relaxed);
+  pthread_mutex_unlock(& wait_mutex);
+  return n;
 };
 
-unsigned char * 
+void
+shared_ring_buffer::set_max_spin(int max_spin) {
+  this->max_spin = max_spin > 0 ? max_spin : 0;
+  spin = this->max_spin;
+};
+
+void
+shared_ring_buffer::wake(std::atomic < bool > & waiting, pthread_cond_t * cond, bool always) {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (always || waiting.load(std::memory_order_relaxed)) {
+    pthread_mutex_lock(& wait_mutex);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(& wait_mutex);
+  }
+};
+
+uint64_t
+shared_ring_buffer::room () {
+  // Load tail before reader_hold: if we see the reader's claim of
+  // chunks, we also see the hold it announced before claiming them.
+  // The acquire load of reader_hold ensures the reader has finished
+  // with chunks before we overwrite them.
+  uint64_t t = tail.load(std::memory_order_acquire);
+  uint64_t hold = reader_hold.load(std::memory_order_acquire);
+  uint64_t in_use = head.load(std::memory_order_relaxed) - (hold < t ? hold : t);
+  return in_use < (uint64_t) num_chunks ? num_chunks - in_use : 0;
+};
+
+void
+shared_ring_buffer::wait_for_room () {
+  writer_waits.store(writer_waits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  pthread_mutex_lock(& wait_mutex);
+  writer_waiting.store(true, std::memory_order_relaxed);
+  // pairs with the fence in wake: either the reader sees
+  // writer_waiting, or we see the reader's release of chunks
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  while (room() == 0 && ! is_done())
+    pthread_cond_wait(& room_cond, & wait_mutex);
+  writer_waiting.store(false, std::memory_order_relaxed);
+  pthread_mutex_unlock(& wait_mutex);
+};
+
+unsigned char *
 shared_ring_buffer::chunk_for_writing () {
-  int ci;
-  pthread_mutex_lock(&index_mutex);
-  ci = (1 + writer_chunk_index) % num_chunks;
-  if (ci == reader_chunk_index && ! is_done_reading_chunk())
-    ci = (1 + ci) % num_chunks;
-  writer_chunk_index = ci;
+  chunk_span span[2];
+  chunks_for_writing(1, span);
+  return span[0].p;
+};
+
+int
+shared_ring_buffer::chunks_for_writing (int n, chunk_span span[2]) {
+  // a writer asking for new chunks is finished with the old ones
+  done_writing_chunk();
+
+  uint64_t avail;
+  for (;;) {
+    avail = room();
+    if (avail > 0 || is_done())
+      break;
+    if (policy == BLOCK_WRITER) {
+      wait_for_room();
+      continue;
+    }
+    if (policy == DROP_OLDEST) {
+      // discard the oldest unread chunk, unless the reader is holding
+      // chunks, since those are what's in our way.  If the reader
+      // claims the chunk first, the exchange fails and we try again.
+      uint64_t t = tail.load(std::memory_order_acquire);
+      if (head.load(std::memory_order_relaxed) - t < (uint64_t) num_chunks)
+        continue; // the reader has made room since we checked
+      if (reader_hold.load(std::memory_order_acquire) == SRB_NO_HOLD) {
+        if (tail.compare_exchange_strong(t, t + 1, std::memory_order_acq_rel))
+          chunks_overwritten.store(chunks_overwritten.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        continue;
+      }
+    }
+    break;
+  }
+
+  if (avail == 0) {
+    // ring is full: write into the spare chunk, which is never published
+    writing_spare = true;
+    num_writing = 1;
+    span[0].p = & buf[num_chunks * chunk_size];
+    span[0].n = 1;
+    span[1].p = 0;
+    span[1].n = 0;
+  } else {
+    writing_spare = false;
+    num_writing = avail < (uint64_t) n ? (int) avail : (n > 1 ? n : 1);
+    get_spans(head.load(std::memory_order_relaxed), num_writing, span);
+  }
   begin_writing_chunk();
-  pthread_mutex_unlock(&index_mutex);
-  return & buf[ci * chunk_size];
+  return num_writing;
 };
 
 void
 shared_ring_buffer::write_chunk (unsigned char *p) {
-  // Write data to the next available chunk.  Normally, it's the next
-  // chunk in the ring, but we skip over the reader's current chunk.
-  // Because there are at least two chunks in the ring, we are guaranteed
-  // to find a destination chunk.
+  // Write data to the next available chunk.  If the ring is full,
+  // what happens depends on the overrun policy.
 
   memcpy(chunk_for_writing(), p, chunk_size);
   done_writing_chunk();
@@ -106,50 +299,95 @@ shared_ring_buffer::get_chunk_size () {
 
 void
 shared_ring_buffer::done() {
-  m_done = true;
+  m_done.store(true, std::memory_order_release);
+  wake(reader_waiting, & wait_cond, true);
+  wake(writer_waiting, & room_cond, true);
 };
 
 bool
 shared_ring_buffer::is_done() {
-  return m_done;
+  return m_done.load(std::memory_order_acquire);
 };
 
-// the following are atomic reads/writes of a boolean
-// value so we don't protect with the mutex
-
 void
 shared_ring_buffer::begin_writing_chunk() {
-  chunk_write_complete = false;
+  chunk_write_complete.store(false, std::memory_order_relaxed);
 };
 
 void
 shared_ring_buffer::done_writing_chunk() {
-  chunk_write_complete = true;
+  done_writing_chunks(num_writing);
+};
+
+int
+shared_ring_buffer::done_writing_chunks(int n) {
+  if (chunk_write_complete.load(std::memory_order_relaxed))
+    return 0;
+  if (n > num_writing)
+    n = num_writing;
+  if (writing_spare) {
+    chunks_dropped.store(chunks_dropped.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    n = 0;
+  } else if (n > 0) {
+    // publish the chunks; the release store orders all writes to
+    // the chunks before the reader can see the new head
+    uint64_t h = head.load(std::memory_order_relaxed) + n;
+    head.store(h, std::memory_order_release);
+    wake(reader_waiting, & wait_cond);
+    int unread = h - tail.load(std::memory_order_relaxed);
+    if (unread > high_water.load(std::memory_order_relaxed))
+      high_water.store(unread, std::memory_order_relaxed);
+  }
+  num_writing = 0;
+  chunk_write_complete.store(true, std::memory_order_relaxed);
+  return n;
 };
 
 bool
 shared_ring_buffer::is_done_writing_chunk() {
-  return chunk_write_complete;
+  return chunk_write_complete.load(std::memory_order_relaxed);
 };
 
 void
 shared_ring_buffer::begin_reading_chunk() {
-  chunk_read_complete = false;
+  chunk_read_complete.store(false, std::memory_order_relaxed);
 };
 
 void
 shared_ring_buffer::done_reading_chunk() {
-  chunk_read_complete = true;
+  if (chunk_read_complete.load(std::memory_order_relaxed))
+    return;
+  chunks_read.store(chunks_read.load(std::memory_order_relaxed) + num_reading, std::memory_order_relaxed);
+  // free the chunks; the release store orders all our reads of
+  // the chunks before the writer can reuse them
+  reader_hold.store(SRB_NO_HOLD, std::memory_order_release);
+  num_reading = 0;
+  chunk_read_complete.store(true, std::memory_order_relaxed);
+  if (policy == BLOCK_WRITER)
+    wake(writer_waiting, & room_cond);
 };
 
 bool
 shared_ring_buffer::is_done_reading_chunk() {
-  return chunk_read_complete;
+  return chunk_read_complete.load(std::memory_order_relaxed);
 };
 
 void
 shared_ring_buffer::get_indices(int & reader_index, int & writer_index) {
-  reader_index = reader_chunk_index;
-  writer_index = writer_chunk_index;
+  reader_index = tail.load(std::memory_order_relaxed) % num_chunks;
+  writer_index = head.load(std::memory_order_relaxed) % num_chunks;
   return;
 };
+
+shared_ring_buffer_stats
+shared_ring_buffer::get_stats() {
+  shared_ring_buffer_stats s;
+  s.chunks_written = head.load(std::memory_order_relaxed);
+  s.chunks_read = chunks_read.load(std::memory_order_relaxed);
+  s.chunks_dropped = chunks_dropped.load(std::memory_order_relaxed);
+  s.chunks_overwritten = chunks_overwritten.load(std::memory_order_relaxed);
+  s.writer_waits = writer_waits.load(std::memory_order_relaxed);
+  s.high_water = high_water.load(std::memory_order_relaxed);
+  s.num_chunks = num_chunks;
+  return s;
+};
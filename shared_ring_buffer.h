@@ -1,51 +1,159 @@
 /**
    @file shared_ring_buffer.h
    @author John Brzustowski <jbrzusto is at fastmail dot fm>
-   @version 0.1
+   @version 0.2
    @date 2015
    @license GPL v2 or later
  */
 
 #pragma once
 #include <vector>
+#include <atomic>
+#include <stdint.h>
 #include <pthread.h>
+
+//! size of a cache line; reader and writer state are kept on separate lines
+#define SRB_CACHE_LINE_SIZE 64
+
+//! value of shared_ring_buffer::reader_hold when the reader holds no chunks
+#define SRB_NO_HOLD UINT64_MAX
+
 /**
    @class shared_ring_buffer
-   @brief Buffer fixed-sized chunks of data between a reader and writer, 
+   @brief Buffer fixed-sized chunks of data between a reader and writer,
    preserving chunk integrity.
+
+   There must be exactly one reader thread and one writer thread.  No
+   mutex is used: the writer publishes chunks by advancing `head` with
+   release semantics.  The reader claims chunks by advancing `tail`,
+   recording the first chunk it holds in `reader_hold`, and frees them
+   by clearing `reader_hold` with release semantics.  A chunk is
+   never visible to the reader until the writer has finished with it,
+   and never reused by the writer until the reader has finished with
+   it.
+
+   What happens when the writer needs a chunk but the ring is full is
+   set by the overrun policy:
+
+   - BLOCK_WRITER: the writer waits until the reader frees a chunk.
+
+   - DROP_NEWEST: the writer is given a spare chunk which is never
+     published; i.e. the new chunk is dropped.
+
+   - DROP_OLDEST: the writer discards the oldest unread chunk and
+     reuses it.  Chunks the reader is currently holding can't be
+     discarded, so if one of those is in the way, the new chunk is
+     dropped instead.
+
+   In every case, chunks the reader sees are complete and in the order
+   written, although some may be missing.  Counts of dropped and
+   discarded chunks, and the highest occupancy seen, are available
+   from get_stats().
+
+   Chunks can also be claimed in batches, as up to two contiguous
+   spans (two only when the batch wraps around the end of the ring),
+   so that index updates are paid once per batch rather than once per
+   chunk.
+
+   A reader with nothing else to do can block in wait_for_chunk(); the
+   writer only takes a lock to wake it when the reader is actually
+   asleep, so the fast path remains lock-free.  The same holds for a
+   writer blocked under the BLOCK_WRITER policy.
 */
 
+//! a contiguous run of chunks in a shared_ring_buffer
+struct chunk_span {
+  unsigned char * p; //!< first chunk in the run; NULL if n is 0
+  int n;             //!< number of chunks in the run
+};
+
+//! counters describing ring buffer traffic
+struct shared_ring_buffer_stats {
+  uint64_t chunks_written;     //!< chunks published by the writer
+  uint64_t chunks_read;        //!< chunks released by the reader
+  uint64_t chunks_dropped;     //!< new chunks dropped because the ring was full
+  uint64_t chunks_overwritten; //!< unread chunks discarded to make room for new ones
+  uint64_t writer_waits;       //!< times the writer had to wait for room
+  int high_water;              //!< largest number of unread chunks seen
+  int num_chunks;              //!< capacity of the ring, for comparison with high_water
+};
+
 class shared_ring_buffer {
  public:
+  //! what the writer does when the ring is full
+  enum overrun_policy {BLOCK_WRITER, DROP_NEWEST, DROP_OLDEST};
+
   //! constructor
-  shared_ring_buffer (int chunk_size, int num_chunks);
+  shared_ring_buffer (int chunk_size, int num_chunks, overrun_policy policy = DROP_OLDEST);
 
   //! destructor
   ~shared_ring_buffer ();
 
+  //! allocate on a cache line boundary, as alignas requires of the
+  // head, tail and done members; under C++11, plain new only
+  // guarantees alignment for fundamental types
+  static void * operator new (size_t size);
+
+  //! free memory from operator new
+  static void operator delete (void * p);
+
   //! return a pointer to the next available chunk from the buffer, returning NULL if
   // no chunk is available;
   unsigned char * read_chunk ();
 
+  //! like read_chunk, but if no chunk is available, wait up to
+  // timeout seconds for one (forever if timeout is negative).
+  // Returns NULL on timeout or once done() has been called and no
+  // chunks remain.
+  unsigned char * wait_for_chunk (double timeout = -1);
+
+  //! get up to max_n available chunks as one or two spans, returning
+  // the total number of chunks, which is 0 if none is available.
+  // All of them are released by done_reading_chunk().
+  int read_chunks (int max_n, chunk_span span[2]);
+
+  //! like read_chunks, but wait as for wait_for_chunk.
+  int wait_for_chunks (int max_n, chunk_span span[2], double timeout = -1);
+
+  //! set the maximum number of times wait_for_chunk polls the ring
+  // before sleeping; the actual number adapts between 0 and this,
+  // depending on whether recent polling found data.  Default is 0:
+  // always sleep immediately.
+  void set_max_spin (int max_spin);
+
   //! get a pointer to the next available writable chunk in the buffer
   unsigned char * chunk_for_writing ();
 
+  //! get up to n writable chunks as one or two spans, returning the
+  // total number of chunks.  This is at least 1: if the ring is full
+  // and the policy is not BLOCK_WRITER, it can be the spare chunk,
+  // which is never published.
+  int chunks_for_writing (int n, chunk_span span[2]);
+
   //! write data to the next available chunk in the buffer
   void write_chunk (unsigned char *p);
 
   //! let writer indicate they are using current chunk
   void begin_writing_chunk();
 
-  //! let writer indicate they are done with current chunk
+  //! let writer indicate they are done with current chunk (or with
+  // all chunks obtained from chunks_for_writing)
   void done_writing_chunk();
 
+  //! let writer indicate they are done with the current chunks,
+  // publishing only the first n of them; the rest are returned to
+  // the ring unpublished.  Returns the number published, which is 0
+  // if the writer had the spare chunk.
+  int done_writing_chunks(int n);
+
   //! is writer done with current chunk?
   bool is_done_writing_chunk();
 
   //! let reader indicate they are using current chunk
   void begin_reading_chunk();
 
-  //! let reader indicate they are done with current chunk
+  //! let reader indicate they are done with current chunk (or with
+  // all chunks obtained from read_chunks)
   void done_reading_chunk();
 
   //! is reader done with current chunk?
@@ -63,6 +171,9 @@ class shared_ring_buffer {
   //! get current reader/writer indices
   void get_indices(int & reader_index, int & writer_index);
 
+  //! get a snapshot of traffic counters; may be called from any thread
+  shared_ring_buffer_stats get_stats ();
+
  protected:
   //! size of each chunk, in bytes
   int chunk_size;
@@ -70,26 +181,85 @@ class shared_ring_buffer {
   //! number of chunks allocated for ring buffer
   int num_chunks;
 
-  //! buffer of chunks.
+  //! what to do when the writer finds the ring full
+  overrun_policy policy;
+
+  //! buffer of chunks; there is one extra chunk at the end, handed
+  //! to the writer when the ring is full
   std::vector < unsigned char > buf;
 
-  //! chunk number currently being read; -1 means none
-  int reader_chunk_index;
+  // -------------------- writer's cache line --------------------
 
-  //! chunk number currently being written to; -1 means none
-  int writer_chunk_index;
+  //! number of chunks published by the writer; only the writer stores here
+  alignas(SRB_CACHE_LINE_SIZE) std::atomic < uint64_t > head;
 
-  //! true iff chunk write for current index has completed
-  bool chunk_write_complete;
+  //! true iff the writer's current chunk is the spare one
+  bool writing_spare;
 
   //! true iff chunk write for current index has completed
-  bool chunk_read_complete;
+  std::atomic < bool > chunk_write_complete;
+
+  //! number of chunks currently held by the writer
+  int num_writing;
+
+  //! true while the writer is (about to be) asleep waiting for room
+  std::atomic < bool > writer_waiting;
+
+  //! counters maintained by the writer
+  std::atomic < uint64_t > chunks_dropped;
+  std::atomic < uint64_t > chunks_overwritten;
+  std::atomic < uint64_t > writer_waits;
+  std::atomic < int > high_water;
+
+  // -------------------- reader's cache line --------------------
+
+  //! sequence number of the first unclaimed chunk; the reader
+  // advances this to claim chunks, and under the DROP_OLDEST policy
+  // the writer advances it to discard them
+  alignas(SRB_CACHE_LINE_SIZE) std::atomic < uint64_t > tail;
+
+  //! sequence number of the first chunk held by the reader, or
+  // SRB_NO_HOLD; only the reader stores here
+  std::atomic < uint64_t > reader_hold;
 
-  //! mutex to protect read/write above three fields indexes
-  pthread_mutex_t index_mutex;
+  //! true iff chunk read for current index has completed
+  std::atomic < bool > chunk_read_complete;
+
+  //! number of chunks currently held by the reader
+  int num_reading;
+
+  //! true while the reader is (about to be) asleep in wait_for_chunk
+  std::atomic < bool > reader_waiting;
+
+  //! upper limit on polls before sleeping in wait_for_chunk
+  int max_spin;
+
+  //! current number of polls before sleeping in wait_for_chunk
+  int spin;
+
+  //! counter maintained by the reader
+  std::atomic < uint64_t > chunks_read;
+
+  // -------------------- shared --------------------
 
   //! flag set to true when either reader or writer is finished
-  bool m_done;
+  alignas(SRB_CACHE_LINE_SIZE) std::atomic < bool > m_done;
 
+  //! mutex and conditions used only to put the reader or writer to sleep
+  pthread_mutex_t wait_mutex;
+  pthread_cond_t wait_cond;
+  pthread_cond_t room_cond;
+
+  //! wake the reader or writer if it is asleep on cond
+  void wake (std::atomic < bool > & waiting, pthread_cond_t * cond, bool always = false);
+
+  //! fill span with the n chunks starting at sequence number seq
+  void get_spans (uint64_t seq, int n, chunk_span span[2]);
+
+  //! return the number of chunks free for the writer, starting at head
+  uint64_t room ();
+
+  //! wait until the writer has room for a chunk, or done() is called
+  void wait_for_room ();
 };
-    
+
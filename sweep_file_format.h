@@ -0,0 +1,63 @@
+/*
+  sweep_file_format.h - binary layout of version 2 sweep files
+
+  A version 2 sweep file begins with a sweep_file_header, padded to
+  header_size bytes.  The header is followed by the columns listed in
+  its directory, each starting at a multiple of SWEEP_FILE_ALIGN bytes
+  from the start of the file, so that any column can be mapped into
+  memory page-aligned and used in place.  Columns are, in order:
+
+     "clock":   np x 32-bit int; number of digitizing clocks since ARP for each pulse
+     "azi":     np x 32-bit float; fraction of sweep 0...1 for each pulse
+     "trig":    np x 32-bit int; number of trigger pulses since ARP, including missed pulses
+     "samples": np x ns 16-bit int, or compressed as given by the column's codec and filter
+
+  Each column and the header itself carry a CRC32C (see crc32c.h).
+  The header also holds the JSON description used by version 1 files
+  (see sweep_file_writer.h), for extra fields and human readers.
+
+  All values are little-endian.
+*/
+
+#ifndef _SWEEP_FILE_FORMAT_H_
+#define _SWEEP_FILE_FORMAT_H_
+
+#include <stdint.h>
+
+#define SWEEP_FILE_MAGIC "DigDarV2"   // first 8 bytes of a version 2 file (no terminating NUL)
+#define SWEEP_FILE_ALIGN 4096         // alignment of columns within file
+#define SWEEP_FILE_MAX_COLUMNS 8      // size of column directory
+
+typedef struct {
+  char     name[8];   // column name, NUL-padded
+  uint64_t offset;    // bytes from start of file to column; a multiple of SWEEP_FILE_ALIGN
+  uint64_t length;    // bytes of data in column
+  uint32_t crc32c;    // CRC32C of the column's data
+  uint32_t codec;     // 0: uncompressed; otherwise a sample_codec::codec_type
+  uint32_t filter;    // sample_codec::filter_type applied before compression
+  uint32_t reserved;  // 0
+} sweep_file_column;
+
+typedef struct {
+  char     magic[8];       // SWEEP_FILE_MAGIC
+  uint32_t version[3];     // major, minor, patch: 2, 0, 0
+  uint32_t header_size;    // bytes before first column; a multiple of SWEEP_FILE_ALIGN
+  uint32_t header_crc32c;  // CRC32C of the header_size bytes of header, with this field set to 0
+  uint32_t num_columns;    // entries used in columns[]
+  int32_t  arp;            // ARP count of sweep
+  uint32_t np;             // pulses in file
+  uint32_t ns;             // samples per pulse
+  uint32_t fmt;            // bits per sample with or'd flags
+  int32_t  decim;          // number of clock samples per file sample
+  uint32_t reserved;       // 0
+  double   ts0;            // timestamp of first pulse
+  double   tsn;            // timestamp of last pulse
+  double   range0;         // range of first sample, in metres
+  double   clock;          // rate of digitizing clock, in MHz
+  char     mode[16];       // how clock samples are converted to file samples: "first", "mean", "sum"; NUL-padded
+  uint32_t json_offset;    // bytes from start of file to JSON description
+  uint32_t json_length;    // bytes of JSON description
+  sweep_file_column columns[SWEEP_FILE_MAX_COLUMNS];
+} sweep_file_header;
+
+#endif /* _SWEEP_FILE_FORMAT_H_ */
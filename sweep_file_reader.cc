@@ -0,0 +1,280 @@
+/**
+ * @file sweep_file_reader.cc
+ *
+ * @brief  Read radar sweeps from a file
+ *
+ * @author John Brzustowski <jbrzusto is at fastmail dot fm>
+ * @version 0.1
+ * @date 2015
+ * @license GPL v2 or later
+ *
+ */
+
+#include "sweep_file_reader.h"
+#include "sweep_file_format.h"
+#include "crc32c.h"
+#include <stdexcept>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define SWEEP_FILE_V1_MAGIC "DigDar radar sweep file\n"
+
+// deflate never expands its input by more than this factor, so
+// sizes claimed for decompressed data can be checked against it
+#define DEFLATE_MAX_RATIO 1032
+
+sweep_file_reader::sweep_file_reader (const std::string & path, bool verify) :
+  path(path),
+  map(0),
+  map_size(0),
+  base(0),
+  size(0)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("sweep_file_reader: unable to open " + path);
+  struct stat st;
+  if (fstat(fd, & st) || st.st_size == 0) {
+    close(fd);
+    throw std::runtime_error("sweep_file_reader: " + path + " is not a sweep file");
+  }
+  // private and writable, so callers can scribble on columns without
+  // touching the file
+  void * m = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED)
+    throw std::runtime_error("sweep_file_reader: unable to map " + path);
+  map = (unsigned char *) m;
+  map_size = st.st_size;
+  base = map;
+  size = map_size;
+
+  try {
+    if (size >= 2 && base[0] == 0x1f && base[1] == 0x8b)
+      gunzip();
+
+    if (size >= sizeof(sweep_file_header) && ! memcmp(base, SWEEP_FILE_MAGIC, 8))
+      parse_v2(verify);
+    else
+      parse_v1();
+
+    // np and ns come from the file, and size the samples buffer
+    if (np < 1 || ns < 1)
+      throw std::runtime_error("sweep_file_reader: " + path + " has no pulses or no samples");
+    if (codec != sample_codec::NONE && (size_t) np * ns * sizeof(uint16_t) / DEFLATE_MAX_RATIO > col_length[3])
+      throw std::runtime_error("sweep_file_reader: " + path + " claims more samples than its compressed data can hold");
+
+    // decompress samples if necessary
+    if (codec != sample_codec::NONE) {
+      sample_codec sc(codec, filter);
+      samples.resize((size_t) np * ns);
+      sc.decompress(base + col_offset[3], col_length[3], & samples[0], np, ns);
+    } else if (col_length[3] != (size_t) np * ns * sizeof(uint16_t)) {
+      throw std::runtime_error("sweep_file_reader: " + path + " has the wrong number of sample bytes");
+    }
+  } catch (...) {
+    if (map)
+      munmap(map, map_size);
+    throw;
+  }
+};
+
+sweep_file_reader::~sweep_file_reader () {
+  if (map)
+    munmap(map, map_size);
+};
+
+void
+sweep_file_reader::gunzip () {
+  // the gzip trailer gives the decoded size mod 2^32, which is exact
+  // for any sweep file of a single gzip member.  No member is shorter
+  // than its 10-byte header and 8-byte trailer.
+  if (map_size < 18)
+    throw std::runtime_error("sweep_file_reader: " + path + " is not a valid gzip file");
+  uint32_t isize;
+  memcpy(& isize, map + map_size - sizeof(isize), sizeof(isize));
+  // the trailer isn't trusted beyond what the input could decode to;
+  // the buffer grows as needed
+  size_t guess = isize > 0 ? isize : 1 << 20;
+  if (guess / DEFLATE_MAX_RATIO > map_size)
+    guess = map_size * DEFLATE_MAX_RATIO;
+  data.resize(guess);
+
+  z_stream z;
+  memset(& z, 0, sizeof(z));
+  if (inflateInit2(& z, 16 + MAX_WBITS) != Z_OK)
+    throw std::runtime_error("sweep_file_reader: unable to initialize zlib");
+  z.next_in = map;
+  z.avail_in = map_size;
+  size_t got = 0;
+  int rv;
+  for (;;) {
+    if (got == data.size())
+      data.resize(2 * data.size());
+    z.next_out = & data[got];
+    z.avail_out = data.size() - got;
+    rv = inflate(& z, Z_NO_FLUSH);
+    got = data.size() - z.avail_out;
+    if (rv == Z_STREAM_END) {
+      // concatenated gzip members decode to concatenated contents
+      if (z.avail_in == 0)
+        break;
+      rv = inflateReset(& z);
+    }
+    // Z_BUF_ERROR with room for output means the input is truncated
+    if (rv != Z_OK && ! (rv == Z_BUF_ERROR && z.avail_out == 0))
+      break;
+  }
+  inflateEnd(& z);
+  if (rv != Z_STREAM_END)
+    throw std::runtime_error("sweep_file_reader: " + path + " is not a valid gzip file");
+
+  // the compressed mapping is no longer needed
+  munmap(map, map_size);
+  map = 0;
+  map_size = 0;
+  data.resize(got);
+  base = & data[0];
+  size = got;
+};
+
+void
+sweep_file_reader::parse_v1 () {
+  // two lines of text header; the JSON line can be padded with spaces
+  size_t n1 = strlen(SWEEP_FILE_V1_MAGIC);
+  if (size < n1 || memcmp(base, SWEEP_FILE_V1_MAGIC, n1))
+    throw std::runtime_error("sweep_file_reader: " + path + " is not a sweep file");
+  unsigned char * eol = (unsigned char *) memchr(base + n1, '\n', size - n1);
+  if (! eol)
+    throw std::runtime_error("sweep_file_reader: " + path + " is not a sweep file");
+  header = std::string((char *) base + n1, eol - (base + n1));
+
+  np = atoi(get_field("np").c_str());
+  ns = atoi(get_field("ns").c_str());
+  size_t bytes = strtoul(get_field("bytes").c_str(), 0, 10);
+  size_t off = eol + 1 - base;
+  if (off + bytes > size || bytes < 3 * sizeof(uint32_t) * np)
+    throw std::runtime_error("sweep_file_reader: " + path + " is truncated");
+
+  // columns are contiguous
+  for (int k = 0; k < 3; ++k) {
+    col_offset[k] = off + k * sizeof(uint32_t) * np;
+    col_length[k] = sizeof(uint32_t) * np;
+  }
+  col_offset[3] = off + 3 * sizeof(uint32_t) * np;
+  col_length[3] = bytes - 3 * sizeof(uint32_t) * np;
+
+  std::string c = get_field("codec");
+  codec = c == "" ? sample_codec::NONE : sample_codec::codec_from_name(c);
+  filter = codec == sample_codec::NONE ? sample_codec::NO_FILTER : sample_codec::filter_from_name(get_field("filter"));
+};
+
+void
+sweep_file_reader::parse_v2 (bool verify) {
+  sweep_file_header h;
+  memcpy(& h, base, sizeof(h));
+  if (h.header_size < sizeof(h) || h.header_size > size)
+    throw std::runtime_error("sweep_file_reader: " + path + " is truncated");
+
+  // the header's CRC is computed with its CRC field zeroed
+  uint32_t zero = 0;
+  uint32_t crc = crc32c(0, base, offsetof(sweep_file_header, header_crc32c));
+  crc = crc32c(crc, & zero, sizeof(zero));
+  size_t rest = offsetof(sweep_file_header, header_crc32c) + sizeof(zero);
+  crc = crc32c(crc, base + rest, h.header_size - rest);
+  if (crc != h.header_crc32c)
+    throw std::runtime_error("sweep_file_reader: " + path + " has a corrupt header");
+
+  np = h.np;
+  ns = h.ns;
+  if (h.json_offset + (size_t) h.json_length <= h.header_size)
+    header = std::string((char *) base + h.json_offset, h.json_length);
+  while (! header.empty() && (header[header.length() - 1] == '\n' || header[header.length() - 1] == ' '))
+    header.erase(header.length() - 1);
+
+  static const char * names[] = {"clock", "azi", "trig", "samples"};
+  for (int k = 0; k < 4; ++k) {
+    unsigned i;
+    for (i = 0; i < h.num_columns && i < SWEEP_FILE_MAX_COLUMNS; ++i)
+      if (! strncmp(h.columns[i].name, names[k], sizeof(h.columns[i].name)))
+        break;
+    if (i == h.num_columns || i == SWEEP_FILE_MAX_COLUMNS)
+      throw std::runtime_error("sweep_file_reader: " + path + " has no " + names[k] + " column");
+    sweep_file_column & c = h.columns[i];
+    if (c.offset + c.length > size)
+      throw std::runtime_error("sweep_file_reader: " + path + " is truncated");
+    if (verify && crc32c(0, base + c.offset, c.length) != c.crc32c)
+      throw std::runtime_error("sweep_file_reader: " + path + " has a corrupt " + names[k] + " column");
+    col_offset[k] = c.offset;
+    col_length[k] = c.length;
+    if (k < 3 && c.length != sizeof(uint32_t) * np)
+      throw std::runtime_error("sweep_file_reader: " + path + " has the wrong size of " + names[k] + " column");
+    if (k == 3) {
+      codec = (sample_codec::codec_type) c.codec;
+      filter = (sample_codec::filter_type) c.filter;
+    }
+  }
+};
+
+const std::string &
+sweep_file_reader::get_header () {
+  return header;
+};
+
+std::string
+sweep_file_reader::get_field (const std::string & key) {
+  size_t i = header.find("\"" + key + "\":");
+  if (i == std::string::npos)
+    return "";
+  i += key.length() + 3;
+  if (i < header.length() && header[i] == '"') {
+    size_t j = header.find('"', i + 1);
+    return header.substr(i + 1, j == std::string::npos ? std::string::npos : j - i - 1);
+  }
+  size_t j = header.find_first_of(",}", i);
+  return header.substr(i, j == std::string::npos ? std::string::npos : j - i);
+};
+
+int
+sweep_file_reader::get_np () {
+  return np;
+};
+
+int
+sweep_file_reader::get_ns () {
+  return ns;
+};
+
+double
+sweep_file_reader::get_ts0 () {
+  return atof(get_field("ts0").c_str());
+};
+
+const uint32_t *
+sweep_file_reader::get_clocks () {
+  return (const uint32_t *) (base + col_offset[0]);
+};
+
+const float *
+sweep_file_reader::get_azi () {
+  return (const float *) (base + col_offset[1]);
+};
+
+const uint32_t *
+sweep_file_reader::get_trigs () {
+  return (const uint32_t *) (base + col_offset[2]);
+};
+
+const uint16_t *
+sweep_file_reader::get_samples () {
+  if (! samples.empty())
+    return & samples[0];
+  return (const uint16_t *) (base + col_offset[3]);
+};
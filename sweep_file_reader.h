@@ -0,0 +1,84 @@
+/**
+ * @file sweep_file_reader.h
+ *
+ * @brief read sweeps from files written by sweep_file_writer
+ *
+ * @author John Brzustowski <jbrzusto is at fastmail dot fm>
+ * @version 0.1
+ * @date 2015
+ * @license GPL v2 or later
+ *
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "sample_codec.h"
+
+/**
+   @class sweep_file_reader
+   @brief read a sweep file, as described in sweep_file_writer.h,
+   decompressing its samples if necessary.  Both format 1 and format 2
+   (sweep_file_format.h) files are read; the checksums in format 2
+   files are verified.
+
+   The file is mapped into memory rather than read, and the column
+   pointers returned by get_clocks() etc. point into the mapping, so
+   opening a sweep costs little more than parsing its header.  Pages
+   are mapped private and writable, so a caller may modify columns in
+   place without changing the file.
+
+   A gzip-compressed sweep file (e.g. one gzipped by the filer) is
+   decoded from its mapping into memory, and then read the same way.
+*/
+
+class sweep_file_reader {
+ public:
+  //!< constructor; maps the file, throwing std::runtime_error if it
+  // isn't a valid sweep file.  If verify is false, the CRCs of format 2
+  // columns are not checked, so the columns aren't read until used.
+  sweep_file_reader (const std::string & path, bool verify = true);
+
+  ~sweep_file_reader ();
+
+  //!< return the JSON header line, without its trailing newline
+  const std::string & get_header ();
+
+  //!< return the value of a header field as text, without quotes; empty if the field is missing
+  std::string get_field (const std::string & key);
+
+  int get_np (); //!< number of pulses
+  int get_ns (); //!< samples per pulse
+  double get_ts0 (); //!< timestamp of first pulse
+
+  const uint32_t * get_clocks (); //!< digitizing clocks since ARP, for each pulse
+  const float * get_azi (); //!< fraction of sweep, for each pulse
+  const uint32_t * get_trigs (); //!< trigger pulses since ARP, for each pulse
+  const uint16_t * get_samples (); //!< np x ns samples
+
+ protected:
+  std::string path; //!< path to the file
+  std::string header; //!< JSON header line
+  int np; //!< number of pulses
+  int ns; //!< samples per pulse
+  unsigned char * map; //!< mapping of the file; NULL if not mapped
+  size_t map_size; //!< bytes in mapping
+  unsigned char * base; //!< contents of the file: map, or data for a gzipped file
+  size_t size; //!< bytes in contents
+  std::vector < unsigned char > data; //!< contents of a gzipped file, decoded
+  std::vector < uint16_t > samples; //!< samples, if they had to be decompressed
+  size_t col_offset[4]; //!< offset in contents of the clock, azi, trig and sample columns
+  size_t col_length[4]; //!< bytes in each column
+  sample_codec::codec_type codec; //!< how the sample column is compressed
+  sample_codec::filter_type filter; //!< how the sample column was filtered
+
+  void gunzip (); //!< decode a gzipped mapping into data
+  void parse_v1 (); //!< find columns in a format 1 file
+  void parse_v2 (bool verify); //!< find and check columns in a format 2 file
+
+ private:
+  // not copyable; the mapping is owned
+  sweep_file_reader (const sweep_file_reader &);
+  sweep_file_reader & operator= (const sweep_file_reader &);
+};
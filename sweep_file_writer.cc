@@ -11,8 +11,22 @@
  */
 
 #include "sweep_file_writer.h"
+#include "sweep_file_format.h"
+#include "crc32c.h"
+#include <stdexcept>
+#include <vector>
 #include <boost/filesystem.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+
+//! O_DIRECT transfers must be multiples of this, from buffers aligned to it
+#define DIRECT_IO_ALIGN 4096
+
+//! bytes reserved for the text lines at the start of a streamed sweep file
+#define STREAM_HEADER_RESERVE 1024
 
 sweep_file_writer::sweep_file_writer (std::string folder, std::string site, std::string logfile, int max_pulses, int samples, 
                                       int fmt, double range0, double clock, int decim, std::string mode ) : 
@@ -27,62 +41,300 @@ sweep_file_writer::sweep_file_writer (std::string folder, std::string site, std:
   decim(decim),
   mode(mode)
 {
-  np = 0;
   nARP = -1;
-  clock_buf = new uint32_t[max_pulses];
-  trig_buf = new uint32_t[max_pulses];
-  azi_buf = new float[max_pulses];
-  sample_buf = new uint16_t[max_pulses * samples];
+  last_ts = -1;
+  for (int i = 0; i < 2; ++i) {
+    bufs[i].np = 0;
+    bufs[i].clock_buf = new uint32_t[max_pulses];
+    bufs[i].trig_buf = new uint32_t[max_pulses];
+    bufs[i].azi_buf = new float[max_pulses];
+    bufs[i].sample_buf = new uint16_t[max_pulses * samples];
+    bufs[i].flushed = 0;
+    bufs[i].fd = -1;
+    blocks[i] = 0;
+  }
+  cur = & bufs[0];
+  pending.s = 0;
+  block_pulses = 0;
+  cur_block = 0;
   logfs = new std::ofstream(logfile);
+  method = BUFFERED_WRITE;
+  compressing = false;
+  format = 1;
+  staging = 0;
+  staging_size = 0;
+
+  memset(& stats, 0, sizeof(stats));
+  io_quit = false;
+  pthread_mutex_init(& io_mutex, 0);
+  pthread_cond_init(& io_cond, 0);
+  if (pthread_create(& io_thread, NULL, & run_io, this))
+    throw std::runtime_error("sweep_file_writer: unable to create I/O thread");
 }
 
 
 
 sweep_file_writer::~sweep_file_writer ()
 {
-  write_file();
+  if (cur->np > 0)
+    hand_off();
+  pthread_mutex_lock(& io_mutex);
+  io_quit = true;
+  pthread_cond_broadcast(& io_cond);
+  pthread_mutex_unlock(& io_mutex);
+  pthread_join(io_thread, NULL);
+  pthread_cond_destroy(& io_cond);
+  pthread_mutex_destroy(& io_mutex);
+
   delete logfs;
-  delete [] sample_buf;
-  delete [] trig_buf;
-  delete [] azi_buf;
-  delete [] clock_buf;
+  free(staging);
+  for (int i = 0; i < 2; ++i) {
+    delete [] blocks[i];
+    delete [] bufs[i].sample_buf;
+    delete [] bufs[i].trig_buf;
+    delete [] bufs[i].azi_buf;
+    delete [] bufs[i].clock_buf;
+  }
 };
 
 
 int
 sweep_file_writer::record_pulse (double ts, uint32_t trigs, uint32_t trig_clock, float azi, uint32_t num_arp, float elev, float rot, void * buffer)
 {
-  static double last_ts = -1;
   if (ts < last_ts) 
     std::cerr << "Time inversion: new pulse = " << ts << "; last pulse = " << last_ts << std::endl;
   last_ts = ts;
   if (nARP != num_arp) {
     if (nARP >= 0)
-      write_file();
+      hand_off();
     nARP = num_arp;
   }
 
-  if (np == max_pulses)
+  sweep & s = * cur;
+  if (s.np == max_pulses)
     return 1; // max pulse count exceeded
 
-  if (np == 0)
-    ts0 = ts;
+  if (s.np == 0) {
+    s.ts0 = ts;
+    s.nARP = nARP;
+  }
+
+  s.clock_buf[s.np] = trig_clock;
+  s.azi_buf[s.np] = azi;
+  s.trig_buf[s.np] = trigs;
+  // samples received directly into their slot needn't be copied; others
+  // may be in the other buffer, or (after a second new sweep) in a later
+  // slot of this one
+  uint16_t * dst = slot(s.np);
+  if (buffer != dst)
+    memmove (dst, buffer, ((fmt & 0xff) * samples + 7 ) / 8);
+  ++s.np;
 
-  clock_buf[np] = trig_clock;
-  azi_buf[np] = azi;
-  trig_buf[np] = trigs;
-  memcpy (& sample_buf[np * samples], buffer, ((fmt & 0xff) * samples + 7 ) / 8);
-  ++np;
+  // when streaming, a full block goes to the I/O thread
+  if (block_pulses > 0 && s.np - s.flushed == block_pulses) {
+    submit(block_pulses, blocks[cur_block], false);
+    cur_block = 1 - cur_block;
+  }
   return 0;
 }
 
+uint16_t *
+sweep_file_writer::slot(int i) {
+  if (block_pulses > 0)
+    return & blocks[cur_block][(i - cur->flushed) * samples];
+  return & cur->sample_buf[i * samples];
+};
+
+int
+sweep_file_writer::free_pulses() {
+  int n = max_pulses - cur->np;
+  if (block_pulses > 0 && n > block_pulses - (cur->np - cur->flushed))
+    n = block_pulses - (cur->np - cur->flushed);
+  return n;
+};
+
+uint16_t *
+sweep_file_writer::sample_slot(int k) {
+  return slot(cur->np + k);
+};
+
+void
+sweep_file_writer::set_block_pulses (int n) {
+  block_pulses = n;
+  for (int i = 0; i < 2; ++i) {
+    // streamed sweeps only need samples for the current block
+    delete [] bufs[i].sample_buf;
+    bufs[i].sample_buf = n > 0 ? 0 : new uint16_t[max_pulses * samples];
+    delete [] blocks[i];
+    blocks[i] = n > 0 ? new uint16_t[n * samples] : 0;
+  }
+};
+
+void
+sweep_file_writer::hand_off() {
+  if (cur->np == 0)
+    return;
+  if (block_pulses > 0) {
+    submit(cur->np - cur->flushed, blocks[cur_block], true);
+    cur_block = 1 - cur_block;
+  } else {
+    submit(cur->np, cur->sample_buf, true);
+  }
+  cur = cur == & bufs[0] ? & bufs[1] : & bufs[0];
+  cur->np = 0;
+  cur->flushed = 0;
+};
+
+void
+sweep_file_writer::submit(int n, uint16_t * sample_buf, bool last) {
+  pthread_mutex_lock(& io_mutex);
+  if (pending.s) {
+    // the I/O thread hasn't finished with the other buffer; we have
+    // to wait for it
+    ++stats.io_busy;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, & t0);
+    while (pending.s)
+      pthread_cond_wait(& io_cond, & io_mutex);
+    clock_gettime(CLOCK_MONOTONIC, & t1);
+    stats.io_wait += (t1.tv_sec - t0.tv_sec) + 1e-9 * (t1.tv_nsec - t0.tv_nsec);
+  }
+  pending.s = cur;
+  pending.first = cur->np - n;
+  pending.n = n;
+  pending.sample_buf = sample_buf;
+  pending.last = last;
+  cur->flushed = cur->np;
+  pthread_cond_broadcast(& io_cond);
+  pthread_mutex_unlock(& io_mutex);
+};
+
+void *
+sweep_file_writer::run_io (void * sfw) {
+  ((sweep_file_writer *) sfw)->io_loop();
+  return 0;
+};
+
+void
+sweep_file_writer::io_loop() {
+  pthread_mutex_lock(& io_mutex);
+  for (;;) {
+    while (! pending.s && ! io_quit)
+      pthread_cond_wait(& io_cond, & io_mutex);
+    if (! pending.s)
+      break;
+    io_job j = pending;
+    pthread_mutex_unlock(& io_mutex);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, & t0);
+    if (block_pulses > 0)
+      write_block(j);
+    else
+      write_file(* j.s);
+    clock_gettime(CLOCK_MONOTONIC, & t1);
+    double dt = (t1.tv_sec - t0.tv_sec) + 1e-9 * (t1.tv_nsec - t0.tv_nsec);
+
+    pthread_mutex_lock(& io_mutex);
+    if (j.last)
+      ++stats.sweeps_written;
+    stats.total_write_time += dt;
+    if (dt > stats.max_write_time)
+      stats.max_write_time = dt;
+    pending.s = 0;
+    pthread_cond_broadcast(& io_cond);
+  }
+  pthread_mutex_unlock(& io_mutex);
+};
+
+void
+sweep_file_writer::set_write_method (write_method method) {
+  this->method = method;
+};
+
+void
+sweep_file_writer::set_format (int version) {
+  if (version != 1 && version != 2)
+    throw std::runtime_error("sweep_file_writer: format version must be 1 or 2");
+  format = version;
+};
+
+void
+sweep_file_writer::set_compression (sample_codec::codec_type codec, sample_codec::filter_type filter, int level) {
+  this->codec = sample_codec(codec, filter, level);
+  compressing = codec != sample_codec::NONE;
+};
+
+sweep_file_writer_stats
+sweep_file_writer::get_stats() {
+  pthread_mutex_lock(& io_mutex);
+  sweep_file_writer_stats st = stats;
+  pthread_mutex_unlock(& io_mutex);
+  return st;
+};
+
 int 
-sweep_file_writer::write_file() {
-  
-  time_t ts = (time_t) floor(ts0);
-  int us = round(1000000 * fmod(ts0, 1.0));
-  // path length:   FOLDER / YYYY-MM-DD / HH / SITE-YYYY-MM-DDTHH-MM-SS.UUUUUU.dat
-  char path_buf[folder.length() + site.length() + 32 + 10];
+sweep_file_writer::write_file(sweep & s) {
+  std::string path = file_path(s);
+
+  const void * sample_data = s.sample_buf;
+  size_t sample_bytes = (size_t) s.np * samples * sizeof(s.sample_buf[0]);
+  if (compressing) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, & t0);
+    size_t n;
+    try {
+      n = codec.compress(s.sample_buf, s.np, samples);
+    } catch (std::runtime_error & e) {
+      // this runs in the I/O thread, where nothing else would catch it
+      std::cerr << e.what() << "; sweep not written to " << path << std::endl;
+      return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, & t1);
+    pthread_mutex_lock(& io_mutex);
+    stats.sample_bytes_in += sample_bytes;
+    stats.sample_bytes_out += n;
+    stats.compress_time += (t1.tv_sec - t0.tv_sec) + 1e-9 * (t1.tv_nsec - t0.tv_nsec);
+    pthread_mutex_unlock(& io_mutex);
+    sample_data = codec.data();
+    sample_bytes = n;
+  }
+  // the file's contents, as pieces to be written at given offsets
+  std::vector < file_segment > segs;
+  std::string header;
+  std::vector < unsigned char > header2;
+  if (format == 2) {
+    header2 = header_v2(s, s.np, s.np, sample_bytes, crc32c(0, sample_data, sample_bytes));
+    segs.push_back(file_segment(0, & header2[0], header2.size()));
+    segs.push_back(file_segment(column_offset_v2(0, s.np), s.clock_buf, s.np * sizeof(s.clock_buf[0])));
+    segs.push_back(file_segment(column_offset_v2(1, s.np), s.azi_buf, s.np * sizeof(s.azi_buf[0])));
+    segs.push_back(file_segment(column_offset_v2(2, s.np), s.trig_buf, s.np * sizeof(s.trig_buf[0])));
+    segs.push_back(file_segment(column_offset_v2(3, s.np), sample_data, sample_bytes));
+  } else {
+    header = header_text(s, s.np, sample_bytes);
+    off_t off = 0;
+    segs.push_back(file_segment(off, header.c_str(), header.length()));
+    segs.push_back(file_segment(off += header.length(), s.clock_buf, s.np * sizeof(s.clock_buf[0])));
+    segs.push_back(file_segment(off += s.np * sizeof(s.clock_buf[0]), s.azi_buf, s.np * sizeof(s.azi_buf[0])));
+    segs.push_back(file_segment(off += s.np * sizeof(s.azi_buf[0]), s.trig_buf, s.np * sizeof(s.trig_buf[0])));
+    segs.push_back(file_segment(off += s.np * sizeof(s.trig_buf[0]), sample_data, sample_bytes));
+  }
+
+  int rv = method == DIRECT_WRITE ? write_direct(path, segs) : write_buffered(path, segs);
+  if (rv)
+    return rv;
+
+  // report file written to logfile
+  (*logfs) << path << std::endl << std::flush;
+
+  return 0;
+};
+
+std::string
+sweep_file_writer::file_path(sweep & s) {
+  time_t ts = (time_t) floor(s.ts0);
+  int us = round(1000000 * fmod(s.ts0, 1.0));
+  // path:   FOLDER / YYYY-MM-DD / HH / SITE-YYYY-MM-DDTHH-MM-SS.UUUUUU.dat
 
   std::string tplate = folder;
   tplate += "/";
@@ -101,44 +353,263 @@ sweep_file_writer::write_file() {
   strftime(filename, fnlen, tplate.c_str(), gmtime(& ts));
   
   boost::filesystem::path p(filename);
+  return p.string();
+};
 
-  FILE *f = fopen(p.string().c_str(), "wb");
-
-  // put out two lines of text header
-  fputs("DigDar radar sweep file\n", f);
+std::string
+sweep_file_writer::header_text(sweep & s, int np, size_t sample_bytes) {
+  // two lines of text header
   // fixme: add an arbitrary JSON property list using methods
   // addParam(std::string, double)
   // addParam(std::string, int)
   // addParam(std::string, std::string)
 
-  fprintf(f, "{\"version\":\"%s\",\"arp\":%d,\"np\":%d,\"ns\":%d,\"fmt\":%d,\"ts0\":%.6f,\"tsn\":%.6f,\"range0\":%.3f,\"clock\":%.6f,\"decim\":%d,\"mode\":\"%s\",\"bytes\":%lu}\n",
-          VERSION,
-          nARP,
+  // compressed samples are described by extra fields
+  char codec_fields[128] = "";
+  if (compressing && block_pulses == 0)
+    snprintf(codec_fields, sizeof(codec_fields), ",\"codec\":\"%s\",\"filter\":\"%s\",\"sample_bytes\":%lu",
+             codec.codec_name(), codec.filter_name(), sample_bytes);
+
+  char json[512];
+  snprintf(json, sizeof(json), "{\"version\":\"%s\",\"arp\":%d,\"np\":%d,\"ns\":%d,\"fmt\":%d,\"ts0\":%.6f,\"tsn\":%.6f,\"range0\":%.3f,\"clock\":%.6f,\"decim\":%d,\"mode\":\"%s\",\"bytes\":%lu%s}\n",
+          format == 2 ? VERSION_2 : VERSION,
+          s.nARP,
           np,
           samples,
           fmt,
-          ts0,
-          ts0 + (clock_buf[np - 1] - clock_buf[0]) / (1e6 * clock), // clock is in MHz
+          s.ts0,
+          s.ts0 + (s.clock_buf[np - 1] - s.clock_buf[0]) / (1e6 * clock), // clock is in MHz
           range0,
           clock,
           decim,
           mode.c_str(),
-          np * (sizeof(clock_buf[0]) + sizeof(azi_buf[0]) + sizeof(trig_buf[0]) + sizeof(sample_buf[0]) * samples)
+          np * (sizeof(s.clock_buf[0]) + sizeof(s.azi_buf[0]) + sizeof(s.trig_buf[0])) + sample_bytes,
+          codec_fields
           );
+  std::string header = "DigDar radar sweep file\n";
+  header += json;
+  return header;
+};
 
-  // write each binary object
-  fwrite(clock_buf, sizeof(clock_buf[0]), np, f);
-  fwrite(azi_buf, sizeof(azi_buf[0]), np, f);
-  fwrite(trig_buf, sizeof(trig_buf[0]), np, f);
-  fwrite(sample_buf, sizeof(sample_buf[0]), np * samples, f);
-  fclose(f);
+off_t
+sweep_file_writer::column_offset_v2(int k, int capacity) {
+  // each of the first three columns has 4 bytes per pulse
+  off_t len = ((off_t) capacity * 4 + SWEEP_FILE_ALIGN - 1) / SWEEP_FILE_ALIGN * SWEEP_FILE_ALIGN;
+  return SWEEP_FILE_ALIGN + k * len;
+};
 
-  // report file written to logfile
-  (*logfs) << p.string() << std::endl << std::flush;
+std::vector < unsigned char >
+sweep_file_writer::header_v2(sweep & s, int np, int capacity, size_t sample_bytes, uint32_t sample_crc) {
+  std::vector < unsigned char > buf(SWEEP_FILE_ALIGN);
+  sweep_file_header * h = (sweep_file_header *) & buf[0];
+  memcpy(h->magic, SWEEP_FILE_MAGIC, sizeof(h->magic));
+  sscanf(VERSION_2, "%u.%u.%u", & h->version[0], & h->version[1], & h->version[2]);
+  h->header_size = SWEEP_FILE_ALIGN;
+  h->arp = s.nARP;
+  h->np = np;
+  h->ns = samples;
+  h->fmt = fmt;
+  h->decim = decim;
+  h->ts0 = s.ts0;
+  h->tsn = s.ts0 + (s.clock_buf[np - 1] - s.clock_buf[0]) / (1e6 * clock); // clock is in MHz
+  h->range0 = range0;
+  h->clock = clock;
+  strncpy(h->mode, mode.c_str(), sizeof(h->mode) - 1);
+
+  static const char * names[] = {"clock", "azi", "trig", "samples"};
+  const void * cols[] = {s.clock_buf, s.azi_buf, s.trig_buf};
+  h->num_columns = 4;
+  for (int k = 0; k < 4; ++k) {
+    sweep_file_column & c = h->columns[k];
+    strncpy(c.name, names[k], sizeof(c.name));
+    c.offset = column_offset_v2(k, capacity);
+    c.length = k < 3 ? np * 4 : sample_bytes;
+    c.crc32c = k < 3 ? crc32c(0, cols[k], c.length) : sample_crc;
+  }
+  if (compressing && block_pulses == 0) {
+    h->columns[3].codec = codec.get_codec();
+    h->columns[3].filter = codec.get_filter();
+  }
+
+  // the JSON description, without the line identifying a version 1 file
+  std::string json = header_text(s, np, sample_bytes);
+  json = json.substr(json.find('\n') + 1);
+  h->json_offset = sizeof(sweep_file_header);
+  h->json_length = json.length();
+  memcpy(& buf[h->json_offset], json.c_str(), json.length());
+
+  h->header_crc32c = crc32c(0, & buf[0], buf.size());
+  return buf;
+};
+
+int
+sweep_file_writer::write_block(io_job & j) {
+  sweep & s = * j.s;
+  int np = j.first + j.n;
+  size_t sample_bytes = samples * sizeof(uint16_t);
+  // samples go where they'd be in a sweep of max_pulses pulses
+  off_t data_offset = STREAM_HEADER_RESERVE + max_pulses * (sizeof(s.clock_buf[0]) + sizeof(s.azi_buf[0]) + sizeof(s.trig_buf[0]));
+
+  if (j.first == 0) {
+    s.path = file_path(s);
+    s.fd = open(s.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (s.fd < 0)
+      perror(("sweep_file_writer: unable to open " + s.path).c_str());
+  }
+  if (s.fd < 0)
+    return 1;
 
-  // mark buffers as empty
-  np = 0;
+  if (format == 2)
+    data_offset = column_offset_v2(3, max_pulses);
+
+  int rv = 0;
+  if (j.n > 0 && pwrite(s.fd, j.sample_buf, j.n * sample_bytes, data_offset + j.first * sample_bytes) < (ssize_t) (j.n * sample_bytes))
+    rv = 1;
+
+  if (format == 2) {
+    // the directory has room for the columns of a full sweep; the
+    // header and columns so far are rewritten, and the samples' CRC
+    // is continued from the previous block
+    s.sample_crc = crc32c(j.first > 0 ? s.sample_crc : 0, j.sample_buf, j.n * sample_bytes);
+    std::vector < unsigned char > header = header_v2(s, np, max_pulses, np * sample_bytes, s.sample_crc);
+    const void * cols[] = {s.clock_buf, s.azi_buf, s.trig_buf};
+    if (pwrite(s.fd, & header[0], header.size(), 0) < (ssize_t) header.size())
+      rv = 1;
+    for (int k = 0; k < 3; ++k)
+      if (pwrite(s.fd, cols[k], np * 4, column_offset_v2(k, max_pulses)) < np * 4)
+        rv = 1;
+    if (rv)
+      perror(("sweep_file_writer: unable to write " + s.path).c_str());
+    if (j.last) {
+      close(s.fd);
+      s.fd = -1;
+      // report file written to logfile
+      (*logfs) << s.path << std::endl << std::flush;
+    }
+    return rv;
+  }
+
+  // rewrite the header and columns for all pulses so far, so that
+  // they end where the samples begin; the JSON line is padded with
+  // spaces
+  std::string header = header_text(s, np, np * sample_bytes);
+  size_t cols = np * sizeof(s.clock_buf[0]);
+  if (header.length() + 3 * cols > (size_t) data_offset) {
+    // samples already written fix where the header must end
+    std::cerr << "sweep_file_writer: header of " << s.path << " is longer than the " << STREAM_HEADER_RESERVE << " bytes reserved for it" << std::endl;
+    rv = 1;
+  } else {
+    header.insert(header.length() - 1, data_offset - 3 * cols - header.length(), ' ');
+    std::vector < unsigned char > front(header.begin(), header.end());
+    front.resize(data_offset);
+    memcpy(& front[header.length()], s.clock_buf, cols);
+    memcpy(& front[header.length() + cols], s.azi_buf, cols);
+    memcpy(& front[header.length() + 2 * cols], s.trig_buf, cols);
+    if (pwrite(s.fd, & front[0], data_offset, 0) < (ssize_t) data_offset)
+      rv = 1;
+    if (rv)
+      perror(("sweep_file_writer: unable to write " + s.path).c_str());
+  }
+
+  if (j.last) {
+    close(s.fd);
+    s.fd = -1;
+    // report file written to logfile
+    (*logfs) << s.path << std::endl << std::flush;
+  }
+  return rv;
+};
+
+int
+sweep_file_writer::write_buffered(const std::string & path, const std::vector < file_segment > & segs) {
+  FILE *f = fopen(path.c_str(), "wb");
+  if (! f) {
+    perror(("sweep_file_writer: unable to open " + path).c_str());
+    return 1;
+  }
+
+  // write each binary object, skipping any gap before it
+  int rv = 0;
+  for (unsigned i = 0; i < segs.size() && ! rv; ++i) {
+    if (ftello(f) != segs[i].offset && fseeko(f, segs[i].offset, SEEK_SET))
+      rv = 1;
+    else if (fwrite(segs[i].data, 1, segs[i].length, f) < segs[i].length)
+      rv = 1;
+  }
+  if (fclose(f))
+    rv = 1;
+  if (rv)
+    perror(("sweep_file_writer: unable to write " + path).c_str());
+  return rv;
+};
+
+int
+sweep_file_writer::write_direct(const std::string & path, const std::vector < file_segment > & segs) {
+  // assemble the whole file in an aligned buffer, padded to a whole
+  // number of blocks
+  size_t size = segs.back().offset + segs.back().length;
+  size_t padded = (size + DIRECT_IO_ALIGN - 1) / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+  if (padded > staging_size) {
+    free(staging);
+    staging = 0;
+    staging_size = 0;
+    if (posix_memalign((void **) & staging, DIRECT_IO_ALIGN, padded)) {
+      std::cerr << "sweep_file_writer: unable to allocate " << padded << " bytes for writing " << path << std::endl;
+      return 1;
+    }
+    staging_size = padded;
+  }
+  size_t off = 0;
+  for (unsigned i = 0; i < segs.size(); ++i) {
+    memset(staging + off, 0, segs[i].offset - off);
+    memcpy(staging + segs[i].offset, segs[i].data, segs[i].length);
+    off = segs[i].offset + segs[i].length;
+  }
+  memset(staging + size, 0, padded - size);
+
+  bool direct = true;
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+  if (fd < 0 && errno == EINVAL) {
+    // filesystem doesn't do O_DIRECT
+    direct = false;
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    pthread_mutex_lock(& io_mutex);
+    ++stats.direct_fallbacks;
+    pthread_mutex_unlock(& io_mutex);
+  }
+  if (fd < 0) {
+    perror(("sweep_file_writer: unable to open " + path).c_str());
+    return 1;
+  }
+
+  // reserve all the file's blocks at once; failure (e.g. because the
+  // filesystem doesn't support it) only costs contiguity
+  fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, padded);
+
+  size_t len = direct ? padded : size;
+  for (size_t off = 0; off < len; ) {
+    ssize_t n = write(fd, staging + off, len - off);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror(("sweep_file_writer: unable to write " + path).c_str());
+      close(fd);
+      return 1;
+    }
+    off += n;
+  }
+  if (direct) {
+    // drop the padding
+    if (ftruncate(fd, size))
+      perror(("sweep_file_writer: unable to truncate " + path).c_str());
+  } else {
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  }
+  close(fd);
   return 0;
 };
 
 const char * const sweep_file_writer::VERSION = "1.0.0";
+
+const char * const sweep_file_writer::VERSION_2 = "2.0.0";
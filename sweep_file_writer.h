@@ -15,8 +15,13 @@
 #include <ostream>
 #include <fstream>
 
+#include <vector>
+
 #include <time.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "sample_codec.h"
 
 /**
    @class sweep_file_writer 
@@ -51,13 +56,72 @@
 
    For expansion, extra content can be added to the JSON string, and extra columns can be appended to
    the binary portion.
+
+   Files are written by a separate I/O thread, so that recording pulses
+   doesn't stall while a sweep is written.  Pulses accumulate in one of
+   two sweep buffers; when a sweep is complete, it is handed to the I/O
+   thread and the other buffer is used for the next sweep.  Recording
+   only waits if the I/O thread is still writing the previous sweep
+   when the next one is complete.
+
+   By default, files are written through stdio and the page cache.
+   With the DIRECT_WRITE method, each file is assembled in an aligned
+   buffer, its blocks are preallocated, and it is written with
+   O_DIRECT, so writing doesn't evict other files from the page cache
+   and its latency doesn't depend on when the kernel flushes dirty
+   pages.  Where the filesystem doesn't support O_DIRECT, the file is
+   written normally, synced, and dropped from the page cache.
+
+   Sweeps can instead be streamed to their files in blocks of a fixed
+   number of pulses, as the pulses arrive (see set_block_pulses()), so
+   that disk traffic is spread across the rotation, only two blocks of
+   samples are held in memory, and a crash loses at most one block.  A
+   streamed file has the same layout as any other: the samples are
+   written at the offset they'd have in a sweep of max_pulses pulses,
+   and after each block, the header and per-pulse columns for the
+   pulses so far are rewritten in front of them, with the JSON line
+   padded with spaces to fill the gap.  Streamed files are always
+   written through the page cache.
+
+   The sample block of each file can be compressed by the I/O thread
+   (see set_compression()); the header then has extra fields:
+      "codec": "CODEC",       // string: how samples are compressed; see sample_codec
+      "filter": "FILTER",     // string: how samples were filtered before compression
+      "sample_bytes": BYTES   // integer: size of the compressed sample block
+   and "bytes" counts the compressed sample block.  Streamed sweeps are
+   not compressed.
+
+   Files can also be written in version 2 format (see set_format()),
+   which has a fixed binary header with a directory of page-aligned,
+   checksummed columns, so readers can map the samples in place
+   without parsing anything; see sweep_file_format.h.  The header
+   includes the JSON line above, with "version" set to VERSION_2.
 */
 
+//! counters describing sweep file output
+struct sweep_file_writer_stats {
+  uint64_t sweeps_written; //!< sweep files written
+  uint64_t io_busy;        //!< sweeps completed while the I/O thread was still writing the previous one
+  double io_wait;          //!< total seconds record_pulse waited for the I/O thread
+  double max_write_time;   //!< longest time taken to write one sweep file (or block, when streaming), in seconds
+  double total_write_time; //!< total time taken to write sweep files, in seconds
+  uint64_t direct_fallbacks; //!< DIRECT_WRITE files written without O_DIRECT because the filesystem doesn't support it
+  uint64_t sample_bytes_in;  //!< bytes of samples compressed
+  uint64_t sample_bytes_out; //!< bytes of compressed samples written
+  double compress_time;      //!< total time spent compressing samples, in seconds
+};
+
 class sweep_file_writer {
  public:
 
   static const char * const VERSION;
 
+  //! version of files written in format 2
+  static const char * const VERSION_2;
+
+  //! how sweep files are written
+  enum write_method {BUFFERED_WRITE, DIRECT_WRITE};
+
   //!< constructor
   sweep_file_writer (std::string folder, std::string site, std::string logfile, int max_pulses, int samples, 
                      int fmt, double range0, double clock, int decim, std::string mode );
@@ -70,8 +134,68 @@ class sweep_file_writer {
 
   int record_pulse (double ts, uint32_t trigs, uint32_t trig_clock, float azi, uint32_t num_arp, float elev, float rot, void * buffer);
 
+  //!< return the number of pulses which can still be recorded in the current sweep
+  int free_pulses ();
+
+  //!< return where the samples of the k'th pulse after those already recorded will be
+  // stored, for 0 <= k < free_pulses().  Samples can be received directly into these
+  // slots; record_pulse doesn't copy samples which are already in place.
+  uint16_t * sample_slot (int k);
+
+  //!< set how sweep files are written; must be called before recording any pulses
+  void set_write_method (write_method method);
+
+  //!< set the sweep file format: 1 (text header) or 2 (binary header
+  // and aligned columns); default is 1.  Must be called before
+  // recording any pulses.
+  void set_format (int version);
+
+  //!< compress the samples in each sweep file; codec NONE means don't.
+  // Must be called before recording any pulses.
+  void set_compression (sample_codec::codec_type codec, sample_codec::filter_type filter = sample_codec::RANGE_DELTA, int level = 1);
+
+  //!< stream each sweep to its file in blocks of n pulses, rather than
+  // writing it all once complete; 0 means don't stream.  Must be
+  // called before recording any pulses.
+  void set_block_pulses (int n);
+
+  //!< get a snapshot of output counters; may be called from any thread
+  sweep_file_writer_stats get_stats ();
+
  protected:
 
+  //! buffers for one sweep's worth of pulses
+  struct sweep {
+    int np; //!< number of pulses in this sweep so far.
+    int nARP; //!< ARP count of this sweep
+    double ts0; //!< timestamp at first pulse
+    uint32_t * clock_buf; //!< buffer of clocks for each pulse
+    float    * azi_buf;    //!< buffer of azimuth values for each pulse
+    uint32_t * trig_buf;  //!< buffer of trigger pulse counts for each pulse
+    uint16_t * sample_buf; //!< buffer of all samples for all pulses; NULL when streaming
+    int flushed; //!< pulses already handed to the I/O thread, when streaming
+    int fd; //!< file being streamed to, or -1; used only by the I/O thread
+    std::string path; //!< path of file being streamed to; used only by the I/O thread
+    uint32_t sample_crc; //!< CRC32C of samples streamed so far, in format 2; used only by the I/O thread
+  };
+
+  //! part of a file's contents, written at a given offset
+  struct file_segment {
+    off_t offset; //!< where in the file
+    const void * data; //!< what to write
+    size_t length; //!< how many bytes
+    file_segment (off_t offset, const void * data, size_t length) : offset(offset), data(data), length(length) {};
+  };
+
+  //! pulses handed to the I/O thread
+  struct io_job {
+    sweep * s; //!< sweep they belong to; NULL if none
+    int first; //!< index of first pulse in the sweep
+    int n; //!< number of pulses
+    uint16_t * sample_buf; //!< their samples
+    bool last; //!< true iff the sweep is complete
+  };
+
   std::string folder; //!< path to top-level folder
   std::string site;   //!< name of site
   std::string logfile; //!< name of file to log full paths of sweep files written, one per line
@@ -83,15 +207,55 @@ class sweep_file_writer {
   double clock; //!< sampling clock rate, in MHz
   int decim; //!< clock samples per file sample
   std::string mode; //!< how clock samples are converted to files sample; eg. "first", "sum", "mean"
-  int np; //!< number of pulses in this sweep so far.
   int nARP; //!< ARP count of currently accumulating sweep; -1 means no sweep so far
-  double ts0; //!< timestamp at first pulse
-  uint32_t * clock_buf; //!< buffer of clocks for each pulse
-  float    * azi_buf;    //!< buffer of azimuth values for each pulse
-  uint32_t * trig_buf;  //!< buffer of trigger pulse counts for each pulse
-  uint16_t * sample_buf; //!< buffer of all samples for all pulses
-  std::ofstream * logfs; //!< filestream for logging sweep files names
-
-  int write_file(); //!< write accumulated pulses to appropriate file, and clear buffers, returning 0 on success
+  double last_ts; //!< timestamp of previous pulse, for detecting time inversions
+  std::ofstream * logfs; //!< filestream for logging sweep files names; used only by the I/O thread
+  write_method method; //!< how sweep files are written
+  int format; //!< sweep file format version: 1 or 2
+  bool compressing; //!< are sample blocks compressed?
+  sample_codec codec; //!< compressor of sample blocks; used only by the I/O thread
+
+  unsigned char * staging; //!< aligned buffer for assembling DIRECT_WRITE files; used only by the I/O thread
+  size_t staging_size; //!< size of staging, in bytes
+
+  sweep bufs[2]; //!< the two sweep buffers
+  sweep * cur; //!< the sweep being accumulated
+  io_job pending; //!< the full sweep (or block) the I/O thread is writing or about to write
+
+  int block_pulses; //!< pulses per streamed block; 0 means sweeps aren't streamed
+  uint16_t * blocks[2]; //!< sample buffers for streamed blocks
+  int cur_block; //!< index of block being accumulated
+
+  pthread_t io_thread; //!< thread which writes sweep files
+  pthread_mutex_t io_mutex; //!< protects pending, io_quit and stats
+  pthread_cond_t io_cond; //!< signalled when pending or io_quit changes
+  bool io_quit; //!< tells the I/O thread to exit once pending has been written
+  sweep_file_writer_stats stats; //!< output counters
+
+  void hand_off(); //!< give the current sweep to the I/O thread and switch to the other buffer
+
+  void submit(int n, uint16_t * sample_buf, bool last); //!< give the current sweep's next n pulses to the I/O thread, waiting until it's free
+
+  uint16_t * slot(int i); //!< where the samples of the current sweep's i'th pulse are stored
+
+  static void * run_io (void * sfw); //!< entry point of the I/O thread
+
+  void io_loop(); //!< write sweeps as they're handed off, until told to quit
+
+  int write_file(sweep & s); //!< write a sweep to the appropriate file, returning 0 on success
+
+  std::string file_path(sweep & s); //!< return the path of the file for a sweep
+
+  std::string header_text(sweep & s, int np, size_t sample_bytes); //!< return the text lines which begin the file for the first np pulses of a sweep, whose sample block has the given size
+
+  int write_block(io_job & j); //!< write a block of a streamed sweep, returning 0 on success
+
+  off_t column_offset_v2(int k, int capacity); //!< return the offset of the k'th column in a format 2 file with room for capacity pulses
+
+  std::vector < unsigned char > header_v2(sweep & s, int np, int capacity, size_t sample_bytes, uint32_t sample_crc); //!< return the header of a format 2 file for the first np pulses of a sweep, with room for capacity pulses
+
+  int write_buffered(const std::string & path, const std::vector < file_segment > & segs); //!< write a file through stdio, from segments in order of offset
+
+  int write_direct(const std::string & path, const std::vector < file_segment > & segs); //!< write a file with O_DIRECT, from segments in order of offset
 
 };
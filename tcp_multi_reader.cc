@@ -0,0 +1,103 @@
+/**
+   @file tcp_multi_reader.cc
+   @author John Brzustowski <jbrzusto is at fastmail dot fm>
+   @version 0.1
+   @date 2015
+   @license GPL v2 or later
+ */
+
+#include "tcp_multi_reader.h"
+
+#include <stdexcept>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+
+// epoll event data: index of reader, times two, plus one for a
+// connected (rather than listening) socket
+#define EV_DATA(i, connected) (2 * (uint64_t) (i) + (connected))
+
+tcp_multi_reader::tcp_multi_reader () :
+  epfd(-1)
+{
+};
+
+tcp_multi_reader::~tcp_multi_reader () {
+  if (epfd >= 0)
+    close(epfd);
+};
+
+void
+tcp_multi_reader::add (tcp_reader * reader) {
+  readers.push_back(reader);
+};
+
+void
+tcp_multi_reader::go () {
+  epfd = epoll_create1(0);
+  if (epfd < 0)
+    throw std::runtime_error("tcp_multi_reader: unable to create epoll instance\n");
+
+  for (unsigned i = 0; i < readers.size(); ++i) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = EV_DATA(i, 0);
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, readers[i]->open_listener(), & ev))
+      throw std::runtime_error("tcp_multi_reader: unable to add listening socket to epoll\n");
+  }
+
+  int open = readers.size();
+  while (open > 0) {
+    struct epoll_event evs[16];
+    int n = epoll_wait(epfd, evs, sizeof(evs) / sizeof(evs[0]), -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("tcp_multi_reader: epoll_wait");
+      break;
+    }
+    for (int j = 0; j < n; ++j) {
+      int i = evs[j].data.u64 / 2;
+      tcp_reader * r = readers[i];
+      if (evs[j].data.u64 % 2 == 0) {
+        // a connection on a listening socket; like tcp_reader::go(),
+        // we serve only one connection per reader at a time, so stop
+        // listening until it closes
+        epoll_ctl(epfd, EPOLL_CTL_DEL, r->listen_fd, 0);
+        int fd = r->accept_connection();
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.u64 = EV_DATA(i, 1);
+        if (fd < 0
+            || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK)
+            || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, & ev)) {
+          perror("tcp_multi_reader: unable to accept connection");
+          r->finish();
+          --open;
+        }
+      } else {
+        // data (or end of file) on a connection; read once, so that a
+        // busy source can't starve the others.  epoll is level-triggered,
+        // so anything left will be reported again.
+        int m = r->read_some();
+        if (m == 0 || (m < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+          epoll_ctl(epfd, EPOLL_CTL_DEL, r->fd, 0);
+          r->close_connection();
+          if (r->persistent) {
+            // wait for the sender to reconnect
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.u64 = EV_DATA(i, 0);
+            epoll_ctl(epfd, EPOLL_CTL_ADD, r->listen_fd, & ev);
+          } else {
+            r->finish();
+            --open;
+          }
+        }
+      }
+    }
+  }
+};
@@ -0,0 +1,48 @@
+/**
+   @file tcp_multi_reader.h
+   @author John Brzustowski <jbrzusto is at fastmail dot fm>
+   @version 0.1
+   @date 2015
+   @license GPL v2 or later
+ */
+
+#pragma once
+#include <vector>
+#include "tcp_reader.h"
+
+/**
+   @class tcp_multi_reader
+   @brief Serve several tcp_readers from one thread, using epoll.
+
+   Each tcp_reader listens on its own port, accepts one connection at
+   a time, and writes into its own shared_ring_buffer, exactly as if it were
+   running in its own thread with tcp_reader::go().  Connections are
+   made non-blocking and read whenever epoll reports data, so a busy
+   source doesn't delay the others; but a reader whose ring buffer
+   has the BLOCK_WRITER policy will stall all sources while it waits
+   for room.
+*/
+
+class tcp_multi_reader {
+ public:
+  //! constructor
+  tcp_multi_reader ();
+
+  //! destructor
+  ~tcp_multi_reader ();
+
+  //! add a reader; must be called before go()
+  void add (tcp_reader * reader);
+
+  //! listen on all readers' ports, and read from their connections
+  // until every connection has been closed, and no reader is
+  // persistent.
+  void go ();
+
+ protected:
+  //! the readers we serve
+  std::vector < tcp_reader * > readers;
+
+  //! epoll instance
+  int epfd;
+};
@@ -18,26 +18,47 @@
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <string.h>
+#include <stdio.h>
 #include <iostream>
 
-tcp_reader::tcp_reader (const std::string &interface, const std::string &port, shared_ring_buffer * buf) :
+tcp_reader::tcp_reader (const std::string &interface, const std::string &port, shared_ring_buffer * buf, int rcvbuf, int busy_poll) :
   interface(interface),
   port(port),
-  buf(buf)
+  buf(buf),
+  rcvbuf(rcvbuf),
+  busy_poll(busy_poll),
+  listen_fd(-1),
+  fd(-1),
+  partial(0),
+  partial_at(0),
+#ifdef DEBUG2
+  last_ts(-1),
+#endif
+  in_sync(true),
+  persistent(true),
+  bytes(0),
+  reads(0),
+  chunks(0),
+  connections(0),
+  resyncs(0),
+  bytes_skipped(0)
 {
 };
 
 tcp_reader::~tcp_reader () {
+  if (fd >= 0)
+    close(fd);
+  if (listen_fd >= 0)
+    close(listen_fd);
 };
 
-void
-tcp_reader::go() {
+int
+tcp_reader::open_listener() {
   struct addrinfo hints;
   struct addrinfo *result, *local;
-  struct sockaddr_storage peer_addr;
-  socklen_t peer_addr_len;
 
   memset(&hints, 0, sizeof(struct addrinfo));
   hints.ai_family = AF_INET;        /* Allow IPv4 only */
@@ -63,70 +84,248 @@ tcp_reader::go() {
 
     int enable = 1;
     setsockopt(infd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+
+    // the receive buffer must be sized before listening, so that
+    // an appropriate TCP window scale is negotiated; the accepted
+    // socket inherits it
+    if (rcvbuf > 0 && setsockopt(infd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(int)))
+      perror("tcp_reader: unable to set SO_RCVBUF");
     
     if (bind(infd, local->ai_addr, local->ai_addrlen) != -1)
       break;                  /* Success */
     
     close(infd);
   }
+  freeaddrinfo(result);
   
   if (local == NULL) {               /* No address succeeded */
-    throw std::runtime_error("Could not bind to listening address and port\n");
+    throw std::runtime_error("Could not bind to listening address and port " + port + "\n");
   }
 
   listen(infd, 0);
+  listen_fd = infd;
+  return infd;
+};
 
+int
+tcp_reader::accept_connection() {
+  struct sockaddr_storage peer_addr;
   socklen_t peer_len = sizeof(peer_addr);
   memset( (char *) &peer_addr, 0, peer_len);
-  
-  // return code from read;
-  int m;
 
-  // listen for one connection
-  int fd = accept(infd, local->ai_addr, &local->ai_addrlen);
-    
-  // pulse count
-  int pc = 0;
+  fd = accept(listen_fd, (struct sockaddr *) &peer_addr, &peer_len);
+  if (fd < 0)
+    return fd;
+  count(connections, 1);
 
-#ifdef DEBUG2
-  double last_ts = -1;
+#ifdef SO_BUSY_POLL
+  if (busy_poll > 0 && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(int)))
+    perror("tcp_reader: unable to set SO_BUSY_POLL");
 #endif
 
-  // read from the connection for as long as there are data
-  do {
-    // get the location of an available chunk 
-    unsigned char * p = buf->chunk_for_writing();
-#ifdef DEBUG2
-    pulse_metadata *p0 = (pulse_metadata *) p;
-#endif
-    int n = buf->get_chunk_size();
-    // read into the current chunk until full
-    int m;
-    do {
-      m = read(fd, p, n);
-      if (m < 0 || errno != 0)
-        break;
-      if (m == 0) {
-        pthread_yield();
-        usleep(1000);
-        continue;
-      }
-      p += m;
-      n -= m;
-    } while (n > 0);
-    buf->done_writing_chunk();
+  // any incomplete chunk left by the previous connection is lost
+  if (partial > 0)
+    count(bytes_skipped, partial);
+  partial = 0;
+  partial_at = 0;
+  in_sync = true;
+  return fd;
+};
+
+void
+tcp_reader::set_sync_markers (const std::vector < uint64_t > & markers) {
+  if (! markers.empty() && buf && buf->get_chunk_size() < (int) sizeof(uint64_t))
+    throw std::runtime_error("tcp_reader: chunks are too small to hold sync markers\n");
+  this->markers = markers;
+};
+
+void
+tcp_reader::set_persistent (bool persistent) {
+  this->persistent = persistent;
+};
+
+// The data being checked are split between the two spans; these treat
+// them as a single array of bytes.
+
+static void
+copy_from_spans (chunk_span span[2], int cs, int off, int n, unsigned char * dst) {
+  int len0 = span[0].n * cs;
+  int n0 = off < len0 ? (n < len0 - off ? n : len0 - off) : 0;
+  if (n0 > 0)
+    memcpy(dst, span[0].p + off, n0);
+  if (n > n0)
+    memcpy(dst + n0, span[1].p + off + n0 - len0, n - n0);
+};
+
+static void
+copy_to_spans (chunk_span span[2], int cs, int off, int n, const unsigned char * src) {
+  int len0 = span[0].n * cs;
+  int n0 = off < len0 ? (n < len0 - off ? n : len0 - off) : 0;
+  if (n0 > 0)
+    memcpy(span[0].p + off, src, n0);
+  if (n > n0)
+    memcpy(span[1].p + off + n0 - len0, src + n0, n - n0);
+};
+
+// return the offset of the first occurrence of marker in p[0..n-1], or
+// -1 if there is none; memchr is vectorised, so we use it to find
+// candidates for the first byte
+int
+tcp_reader::find_marker (const unsigned char * p, int n, uint64_t marker) {
+  if (n < (int) sizeof(marker))
+    return -1;
+  const unsigned char * m = (const unsigned char *) & marker;
+  const unsigned char * end = p + n - sizeof(marker);
+  for (const unsigned char * q = p; q <= end; ++q) {
+    q = (const unsigned char *) memchr(q, m[0], end - q + 1);
+    if (! q)
+      break;
+    if (! memcmp(q, m, sizeof(marker)))
+      return q - p;
+  }
+  return -1;
+};
+
+bool
+tcp_reader::is_marker (const unsigned char * p) {
+  uint64_t v;
+  memcpy(& v, p, sizeof(v));
+  for (unsigned i = 0; i < markers.size(); ++i)
+    if (v == markers[i])
+      return true;
+  return false;
+};
+
+int
+tcp_reader::check_sync (chunk_span span[2], int have) {
+  int cs = buf->get_chunk_size();
+  for (int k = 0; (k + 1) * cs <= have; ++k) {
+    if (is_marker(k < span[0].n ? span[0].p + k * cs : span[1].p + (k - span[0].n) * cs)) {
+      in_sync = true;
+      continue;
+    }
+    if (in_sync) {
+      count(resyncs, 1);
+      in_sync = false;
+    }
+    // look for a marker in what follows the start of this chunk, and
+    // move data from there to the start of this chunk.  If there's no
+    // marker, keep only the tail, which might hold the start of one.
+    int off = k * cs;
+    int n = have - off - 1;
+    resync_buf.resize(n);
+    copy_from_spans(span, cs, off + 1, n, & resync_buf[0]);
+    int at = find_marker(& resync_buf[0], n, markers[0]);
+    int keep = at >= 0 ? n - at : (n < (int) sizeof(uint64_t) - 1 ? n : sizeof(uint64_t) - 1);
+    copy_to_spans(span, cs, off, keep, & resync_buf[n - keep]);
+    count(bytes_skipped, have - off - keep);
+    have = off + keep;
+    // check this chunk again
+    --k;
+  }
+  return have;
+};
+
+int
+tcp_reader::read_some() {
+  int cs = buf->get_chunk_size();
+
+  // get a batch of available chunks, and read into both spans at
+  // once, so that each readv() fills as many chunks as the socket
+  // has data for
+  chunk_span span[2];
+  buf->chunks_for_writing(MAX_BATCH, span);
+  unsigned char * p = span[0].p;
+
+  // the previous read ended part-way through a chunk; normally that
+  // chunk is the first one we now have, but if we've switched
+  // to or from the ring buffer's spare chunk, move the data there.
+  if (partial > 0 && partial_at != p)
+    memmove(p, partial_at, partial);
+  partial_at = p;
+
+  struct iovec iov[2];
+  iov[0].iov_base = p + partial;
+  iov[0].iov_len = span[0].n * cs - partial;
+  iov[1].iov_base = span[1].p;
+  iov[1].iov_len = span[1].n * cs;
+
+  int m = readv(fd, iov, span[1].n > 0 ? 2 : 1);
+  if (m <= 0) {
+    // hand back the chunks; any partial one is still at partial_at
+    buf->done_writing_chunks(0);
+    return m;
+  }
+  count(bytes, m);
+  count(reads, 1);
+
+  // complete chunks are contiguous in the ring, apart from the jump
+  // between spans; a chunk never straddles the two spans
+  int have = partial + m;
+  if (! markers.empty())
+    have = check_sync(span, have);
+  int full = have / cs;
+  partial = have - full * cs;
+  partial_at = full < span[0].n ? p + full * cs : span[1].p + (full - span[0].n) * cs;
 #ifdef DEBUG2
+  for (int i = 0; i < full; ++i) {
+    pulse_metadata *p0 = (pulse_metadata *) (i < span[0].n ? p + i * cs : span[1].p + (i - span[0].n) * cs);
     double ts = p0->arp_clock_sec + 1.0e-9*(p0->arp_clock_nsec + 8 * p0->trig_clock);
     if (ts < last_ts) {
       std::cerr << "tcpreader: time inversion from " << last_ts << " to " << ts << std::endl;
       std::cerr << "trig_clock: " << p0->num_trig << "; num_trig: " << p0->num_trig << std::endl;
     }
     last_ts = ts;
-
+  }
 #endif
-    ++pc;
-    //    std::cerr << "Read pulses from socket: " << pc << "\n";
-  } while (m >= 0);
-  close(fd);
-  buf->done();
+  // publish the complete chunks; any incomplete one stays ours, and
+  // those in the spare chunk are dropped rather than published
+  count(chunks, buf->done_writing_chunks(full));
+  return m;
+};
+
+void
+tcp_reader::close_connection() {
+  if (fd >= 0)
+    close(fd);
+  fd = -1;
+};
+
+void
+tcp_reader::finish() {
+  if (fd >= 0)
+    close(fd);
+  if (listen_fd >= 0)
+    close(listen_fd);
+  fd = listen_fd = -1;
+  if (buf)
+    buf->done();
+};
+
+void
+tcp_reader::go() {
+  open_listener();
+
+  // serve connections one at a time
+  while (accept_connection() >= 0) {
+    // read from the connection for as long as there are data
+    while (read_some() > 0)
+      ;
+    close_connection();
+    if (! persistent)
+      break;
+  }
+  finish();
+};
+
+tcp_reader_stats
+tcp_reader::get_stats() {
+  tcp_reader_stats st;
+  st.bytes = bytes.load(std::memory_order_relaxed);
+  st.reads = reads.load(std::memory_order_relaxed);
+  st.chunks = chunks.load(std::memory_order_relaxed);
+  st.connections = connections.load(std::memory_order_relaxed);
+  st.resyncs = resyncs.load(std::memory_order_relaxed);
+  st.bytes_skipped = bytes_skipped.load(std::memory_order_relaxed);
+  return st;
 };
@@ -8,33 +8,168 @@
 
 #pragma once
 #include <string>
+#include <atomic>
+#include <vector>
+#include <stdint.h>
 #include "shared_ring_buffer.h"
 
 /**
    @class tcp_reader
    @brief Read fixed-size chunks of data from a TCP socket and write them into a shared_ring_buffer.
 
+   Data are read with readv() directly into as many free chunks of the
+   ring buffer as are available (up to MAX_BATCH), including both
+   spans when the free region wraps around the end of the ring, so a
+   single system call can land many pulses.
+
+   go() serves a single connection, blocking in readv().  Alternatively,
+   the steps open_listener(), accept_connection(), read_some() and
+   finish() can be driven by an event loop serving several readers;
+   see tcp_multi_reader.
+
+   If sync markers have been set, every chunk must begin with one of
+   them.  When a chunk doesn't (e.g. because bytes were lost, or the
+   sender restarted part-way through a chunk), the data are scanned for
+   the next occurrence of the first marker, and chunk boundaries are
+   realigned there; the bytes skipped are never published.
+
+   By default, the listening socket stays open, and a new connection
+   is accepted whenever the previous one closes, so a restarted sender
+   can reconnect without losing the ring buffer's reader.
 */
 
+//! counters describing socket traffic
+struct tcp_reader_stats {
+  uint64_t bytes;    //!< bytes received
+  uint64_t reads;    //!< calls to readv which returned data
+  uint64_t chunks;   //!< complete chunks published to the ring buffer
+  uint64_t connections;   //!< connections accepted
+  uint64_t resyncs;       //!< times the stream lost sync with chunk boundaries
+  uint64_t bytes_skipped; //!< bytes discarded while regaining sync
+};
+
 class tcp_reader {
  public:
-  //! constructor
-  tcp_reader (const std::string &interface, const std::string &port, shared_ring_buffer * buf);
+  //! maximum number of chunks claimed from the ring buffer at once;
+  // matches the number of pulses digdar sends per block (its -c option)
+  static const int MAX_BATCH = 64;
+
+  //! constructor; if rcvbuf is positive, it is the requested socket
+  // receive buffer size, in bytes; if busy_poll is positive, it is the
+  // number of microseconds the kernel should busy-poll the device
+  // queue for data before sleeping (SO_BUSY_POLL)
+  tcp_reader (const std::string &interface, const std::string &port, shared_ring_buffer * buf, int rcvbuf = 0, int busy_poll = 0);
 
   //! destructor
-  ~tcp_reader ();
+  virtual ~tcp_reader ();
+
+  //! set the markers one of which must begin each chunk; the first is
+  // the one searched for when the stream loses sync.  If none are set,
+  // chunks are not checked.
+  void set_sync_markers (const std::vector < uint64_t > & markers);
+
+  //! if persistent is false, go() returns after serving one connection
+  // instead of waiting for another; default is true
+  void set_persistent (bool persistent);
 
-  //! bind socket, listen for connection, write incoming data to shared ring buffer
+  //! bind socket, listen for connections, write incoming data to shared ring buffer
   void go();
 
+  //! bind socket and listen for a connection; returns the listening socket
+  int open_listener();
+
+  //! accept a connection on the listening socket; returns the connected
+  // socket, or -1 on error
+  virtual int accept_connection();
+
+  //! read once from the connection into the ring buffer, publishing
+  // any complete chunks; returns the result of readv(): bytes read,
+  // 0 at end of file, or -1 on error (including EAGAIN when the
+  // socket is non-blocking)
+  virtual int read_some();
+
+  //! close the current connection, leaving the listening socket open
+  void close_connection();
+
+  //! close sockets and tell the ring buffer's reader we are done
+  void finish();
+
+  //! return the port this reader listens on
+  const std::string & get_port() { return port; };
+
+  //! get a snapshot of traffic counters; may be called from any thread
+  tcp_reader_stats get_stats();
+
  protected:
+  friend class tcp_multi_reader;
+
   //! interface on which to listen for a connection
   std::string interface;
 
   //! port on which to listen for a connection
   std::string port;
 
-  //! pointer to shared ring buffer of chunks; we are the writer
+  //! pointer to shared ring buffer of chunks; we are the writer.
+  // NULL if a derived class puts data elsewhere.
   shared_ring_buffer * buf;
+
+  //! requested socket receive buffer size, in bytes; 0 means system default
+  int rcvbuf;
+
+  //! SO_BUSY_POLL time, in microseconds; 0 means don't busy-poll
+  int busy_poll;
+
+  //! listening socket, or -1
+  int listen_fd;
+
+  //! connected socket, or -1
+  int fd;
+
+  //! bytes of an incomplete chunk left over from the previous read,
+  //! and where they are
+  int partial;
+  unsigned char * partial_at;
+
+  //! markers which begin chunks; empty means don't check
+  std::vector < uint64_t > markers;
+
+  //! true unless the last chunk checked didn't begin with a marker
+  bool in_sync;
+
+  //! accept another connection when one closes?
+  bool persistent;
+
+  //! scratch space for realigning data
+  std::vector < unsigned char > resync_buf;
+
+  //! check that each complete chunk among the first have bytes of
+  //! span begins with a marker, realigning data where one doesn't;
+  //! returns the number of bytes remaining
+  int check_sync (chunk_span span[2], int have);
+
+  //! does p begin with one of the markers?
+  bool is_marker (const unsigned char * p);
+
+  //! return the offset of the first occurrence of marker in p[0..n-1],
+  //! or -1 if there is none
+  static int find_marker (const unsigned char * p, int n, uint64_t marker);
+
+  //! add n to one of the counters; only the reading thread does this
+  static void count (std::atomic < uint64_t > & counter, uint64_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  };
+
+#ifdef DEBUG2
+  //! timestamp of previous pulse, for detecting time inversions
+  double last_ts;
+#endif
+
+  //! counters maintained by read_some()
+  std::atomic < uint64_t > bytes;
+  std::atomic < uint64_t > reads;
+  std::atomic < uint64_t > chunks;
+  std::atomic < uint64_t > connections;
+  std::atomic < uint64_t > resyncs;
+  std::atomic < uint64_t > bytes_skipped;
 };
     
@@ -0,0 +1,160 @@
+/**
+   @file tcp_sweep_reader.cc
+   @author John Brzustowski <jbrzusto is at fastmail dot fm>
+   @version 0.1
+   @date 2015
+   @license GPL v2 or later
+ */
+
+#include "tcp_sweep_reader.h"
+
+#include <unistd.h>
+#include <string.h>
+
+tcp_sweep_reader::tcp_sweep_reader (const std::string &interface, const std::string &port, sweep_file_writer * cap, int samples, int rcvbuf, int busy_poll) :
+  tcp_reader(interface, port, 0, rcvbuf, busy_poll),
+  cap(cap),
+  sample_bytes(samples * sizeof(uint16_t)),
+  pulse_size(HEADER_SIZE + samples * sizeof(uint16_t)),
+  scratch(MAX_BATCH * samples * sizeof(uint16_t))
+{
+};
+
+int
+tcp_sweep_reader::accept_connection() {
+  int rv = tcp_reader::accept_connection();
+  if (rv >= 0) {
+    count(bytes_skipped, stash.size());
+    stash.clear();
+  }
+  return rv;
+};
+
+int
+tcp_sweep_reader::prepare_batch (struct iovec * iov) {
+  // receive samples into the slots they'll occupy in the current
+  // sweep, unless it's full
+  int n = cap->free_pulses();
+  bool use_scratch = n <= 0;
+  if (use_scratch || n > MAX_BATCH)
+    n = MAX_BATCH;
+  for (int k = 0; k < n; ++k)
+    samp[k] = use_scratch ? & scratch[k * sample_bytes] : (unsigned char *) cap->sample_slot(k);
+
+  // the samples of a partial pulse move to the new first slot; its
+  // metadata are already at hdrs[0]
+  if (partial > HEADER_SIZE && partial_at != samp[0])
+    memmove(samp[0], partial_at, partial - HEADER_SIZE);
+
+  for (int k = 0; k < n; ++k) {
+    iov[2 * k].iov_base = hdrs[k];
+    iov[2 * k].iov_len = HEADER_SIZE;
+    iov[2 * k + 1].iov_base = samp[k];
+    iov[2 * k + 1].iov_len = sample_bytes;
+  }
+  int skip0 = partial < HEADER_SIZE ? partial : HEADER_SIZE;
+  iov[0].iov_base = hdrs[0] + skip0;
+  iov[0].iov_len -= skip0;
+  iov[1].iov_base = samp[0] + (partial - skip0);
+  iov[1].iov_len -= partial - skip0;
+  return n;
+};
+
+void
+tcp_sweep_reader::land (int have) {
+  int full = have / pulse_size;
+  for (int k = 0; k < full; ++k) {
+    if (! markers.empty() && ! is_marker(hdrs[k])) {
+      resync(k, have);
+      return;
+    }
+    in_sync = true;
+    const pulse_metadata * meta = (const pulse_metadata *) hdrs[k];
+    // skip the pulse digdar sends when it stops
+    if (meta->magic_number != PULSE_METADATA_MAGIC)
+      continue;
+    cap->record_pulse (pulse_metadata_ts(meta),
+                       meta->num_trig,
+                       meta->trig_clock,
+                       meta->acp_clock,
+                       meta->num_arp,
+                       0, // constant 0 elevation angle for FORCE radar
+                       0, // constant polarization for FORCE radar
+                       samp[k]);
+    count(chunks, 1);
+  }
+  partial = have - full * pulse_size;
+  if (partial > 0) {
+    memmove(hdrs[0], hdrs[full], partial < HEADER_SIZE ? partial : HEADER_SIZE);
+    partial_at = samp[full];
+  }
+};
+
+void
+tcp_sweep_reader::resync (int k, int have) {
+  if (in_sync) {
+    count(resyncs, 1);
+    in_sync = false;
+  }
+  // gather the rest of the batch as a stream of bytes, ahead of
+  // anything already stashed
+  std::vector < unsigned char > rest;
+  rest.reserve(have - k * pulse_size + stash.size());
+  int full = have / pulse_size;
+  for (int j = k; j < full; ++j) {
+    rest.insert(rest.end(), hdrs[j], hdrs[j] + HEADER_SIZE);
+    rest.insert(rest.end(), samp[j], samp[j] + sample_bytes);
+  }
+  int tail = have - full * pulse_size;
+  if (tail > 0) {
+    int h = tail < HEADER_SIZE ? tail : HEADER_SIZE;
+    rest.insert(rest.end(), hdrs[full], hdrs[full] + h);
+    rest.insert(rest.end(), samp[full], samp[full] + tail - h);
+  }
+  rest.insert(rest.end(), stash.begin(), stash.end());
+  stash.swap(rest);
+  partial = 0;
+
+  // drop bytes up to the next marker after the bad pulse's first
+  // byte; if there's none, keep only the tail, which might hold the
+  // start of one.
+  int n = stash.size() - 1;
+  int at = find_marker(& stash[1], n, markers[0]);
+  int keep = at >= 0 ? n - at : (n < (int) sizeof(uint64_t) - 1 ? n : sizeof(uint64_t) - 1);
+  count(bytes_skipped, stash.size() - keep);
+  stash.erase(stash.begin(), stash.end() - keep);
+};
+
+int
+tcp_sweep_reader::unstash () {
+  struct iovec iov[2 * MAX_BATCH];
+  int n = prepare_batch(iov);
+  int m = 0;
+  for (int i = 0; i < 2 * n && m < (int) stash.size(); ++i) {
+    int len = stash.size() - m;
+    if (len > (int) iov[i].iov_len)
+      len = iov[i].iov_len;
+    memcpy(iov[i].iov_base, & stash[m], len);
+    m += len;
+  }
+  stash.erase(stash.begin(), stash.begin() + m);
+  return m;
+};
+
+int
+tcp_sweep_reader::read_some() {
+  struct iovec iov[2 * MAX_BATCH];
+  int n = prepare_batch(iov);
+  int m = readv(fd, iov, 2 * n);
+  if (m <= 0)
+    return m;
+  count(bytes, m);
+  count(reads, 1);
+  land(partial + m);
+
+  // land whatever followed a lost pulse boundary now, rather than
+  // waiting for more data; each pass records a pulse or drops bytes
+  while (! stash.empty())
+    land(partial + unstash());
+  return m;
+};
@@ -0,0 +1,93 @@
+/**
+   @file tcp_sweep_reader.h
+   @author John Brzustowski <jbrzusto is at fastmail dot fm>
+   @version 0.1
+   @date 2015
+   @license GPL v2 or later
+ */
+
+#pragma once
+#include <vector>
+#include <sys/uio.h>
+#include "tcp_reader.h"
+#include "sweep_file_writer.h"
+#include "pulse_metadata.h"
+
+/**
+   @class tcp_sweep_reader
+   @brief Read pulses from a TCP socket straight into a sweep_file_writer's buffers.
+
+   Rather than landing each pulse in a shared_ring_buffer chunk, from
+   which the consumer copies samples into the current sweep, each
+   readv() scatters the stream so that a pulse's metadata goes to a
+   small header array and its samples go directly to the slot they
+   will occupy in the sweep being accumulated.  Recording the pulse
+   then only stores its metadata; the samples are touched once, by
+   the kernel, before being written to disk.
+
+   Samples land in the wrong slot only when the sweep changes part-way
+   through a batch (or a pulse is skipped), in which case record_pulse()
+   moves them, and when the current sweep is already full, in which
+   case they go to scratch space.
+
+   Record_pulse() is called from the reading thread, so there is no
+   decoupling between the network and the sweep file writer: a reader
+   stalls while the writer waits for its I/O thread to finish the
+   previous sweep.  Sync markers are handled as by tcp_reader: a pulse
+   not beginning with one makes us realign on the next occurrence of
+   the first marker.
+*/
+
+class tcp_sweep_reader : public tcp_reader {
+ public:
+  //! bytes of metadata preceding each pulse's samples
+  static const int HEADER_SIZE = sizeof(pulse_metadata) - sizeof(uint16_t);
+
+  //! constructor; pulses have the given number of 16-bit samples; other
+  // parameters are as for tcp_reader
+  tcp_sweep_reader (const std::string &interface, const std::string &port, sweep_file_writer * cap, int samples, int rcvbuf = 0, int busy_poll = 0);
+
+  //! accept a connection, discarding anything left from the previous one
+  virtual int accept_connection();
+
+  //! read once from the connection, recording any complete pulses
+  virtual int read_some();
+
+ protected:
+  //! writer of sweep files; we record pulses to it
+  sweep_file_writer * cap;
+
+  //! bytes of samples per pulse
+  int sample_bytes;
+
+  //! bytes per pulse, including metadata
+  int pulse_size;
+
+  //! metadata of pulses in the current batch
+  unsigned char hdrs[MAX_BATCH][HEADER_SIZE];
+
+  //! where samples of each pulse in the current batch are received
+  unsigned char * samp[MAX_BATCH];
+
+  //! where samples are received when the current sweep is full
+  std::vector < unsigned char > scratch;
+
+  //! bytes received but not yet landed, after realigning on a marker
+  std::vector < unsigned char > stash;
+
+  //! set up iov to receive the next batch of pulses, after any partial
+  //! one; returns the number of pulses in the batch
+  int prepare_batch (struct iovec * iov);
+
+  //! record the complete pulses among the first have bytes of the
+  //! batch, and keep any partial one for the next batch
+  void land (int have);
+
+  //! move the pulses from k onward, plus any partial one, to the
+  //! stash, and drop bytes from its start up to the next marker
+  void resync (int k, int have);
+
+  //! move bytes from the stash into the next batch; returns the
+  //! number moved
+  int unstash ();
+};
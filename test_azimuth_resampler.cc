@@ -0,0 +1,120 @@
+/**
+   @file test_azimuth_resampler.cc
+   @brief test of azimuth_resampler against outputs worked out by hand:
+   each mode is applied to a sweep with output pulses before and after
+   its input pulses, to one whose azimuths are out of order and
+   repeated (so are stable-sorted), and to one with input pulses
+   beyond both ends of the output range (which the end bins take).
+   The samples and the source pulse of each output pulse must be
+   exactly as expected.
+
+   Returns 0 on success, 1 on failure.
+
+   @author John Brzustowski <jbrzusto is at fastmail dot fm>
+   @license GPL v2 or later
+ */
+
+#include "azimuth_resampler.h"
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#define NS 3
+
+// resample the np pulses of samp at azimuths azi into n pulses from
+// azi_begin to azi_end; count output samples and source pulses which
+// differ from those expected
+static bool
+check (const char * name, azimuth_resampler::mode_type mode, int n, double azi_begin, double azi_end,
+       const float * azi, const t_sample * samp, int np, const t_sample * want, const int * want_src) {
+  azimuth_resampler ar(n, azi_begin, azi_end, mode);
+  std::vector < t_sample > out(n * NS);
+  ar.resample(azi, samp, np, NS, & out[0]);
+  int bad = 0;
+  for (int i = 0; i < n * NS; ++i)
+    bad += out[i] != want[i];
+  for (int i = 0; i < n; ++i)
+    bad += ar.get_source_pulses()[i] != want_src[i];
+  std::cout << name << ": mismatches: " << bad << std::endl;
+  if (bad)
+    std::cout << "  ^^^ FAILED" << std::endl;
+  return ! bad;
+};
+
+int
+main (int argc, char *argv[]) {
+  // azimuths are multiples of 1/64, so all are exact in float and double
+  bool ok = true;
+
+  // sorted: outputs at 0, 3/16, 3/8, 9/16, 3/4; the first is before
+  // every input pulse, and the last two are after them
+  {
+    float azi[] = {0.125, 0.25, 0.4375, 0.5};
+    t_sample samp[] = {100, 200, 300,   400, 100, 300,   1000, 0, 65535,   0, 500, 10};
+    // 3/16 is as near pulse 0 as pulse 1, and the earlier wins
+    int src[] = {0, 0, 2, 3, 3};
+    t_sample nearest[] = {100, 200, 300,   100, 200, 300,   1000, 0, 65535,   0, 500, 10,   0, 500, 10};
+    // half way from pulse 0 to 1, and two thirds of the way from 1 to 2, rounded
+    t_sample linear[] = {100, 200, 300,   250, 150, 300,   800, 33, 43790,   0, 500, 10,   0, 500, 10};
+    // bins are 3/16 wide; the first and last are empty, so take the
+    // nearest pulse; the second holds pulses 0 and 1
+    t_sample max[] = {100, 200, 300,   400, 200, 300,   1000, 0, 65535,   0, 500, 10,   0, 500, 10};
+    ok = check("sorted, nearest", azimuth_resampler::NEAREST, 5, 0, 0.75, azi, samp, 4, nearest, src) && ok;
+    ok = check("sorted, linear", azimuth_resampler::LINEAR, 5, 0, 0.75, azi, samp, 4, linear, src) && ok;
+    ok = check("sorted, max hold", azimuth_resampler::MAX_HOLD, 5, 0, 0.75, azi, samp, 4, max, src) && ok;
+  }
+
+  // out of order, with two pulses at 1/4: sorted, the pulses are
+  // 1, 0, 2, 4, 3.  Outputs at 1/8, 5/16, 1/2.
+  {
+    float azi[] = {0.25, 0.125, 0.25, 0.5, 0.375};
+    t_sample samp[] = {10, 20, 30,   40, 5, 6,   7, 80, 9,   1, 1, 1,   50, 2, 90};
+    // 5/16 is as near pulse 2 (the later of those at 1/4) as pulse 4
+    int src[] = {1, 2, 3};
+    t_sample nearest[] = {40, 5, 6,   7, 80, 9,   1, 1, 1};
+    // half way from pulse 2 to 4, rounded
+    t_sample linear[] = {40, 5, 6,   29, 41, 50,   1, 1, 1};
+    // the middle bin holds pulses 0, 2 and 4
+    t_sample max[] = {40, 5, 6,   50, 80, 90,   1, 1, 1};
+    ok = check("unsorted, nearest", azimuth_resampler::NEAREST, 3, 0.125, 0.5, azi, samp, 5, nearest, src) && ok;
+    ok = check("unsorted, linear", azimuth_resampler::LINEAR, 3, 0.125, 0.5, azi, samp, 5, linear, src) && ok;
+    ok = check("unsorted, max hold", azimuth_resampler::MAX_HOLD, 3, 0.125, 0.5, azi, samp, 5, max, src) && ok;
+  }
+
+  // input pulses beyond both ends of outputs at 1/4 and 3/4
+  {
+    float azi[] = {0, 0.0625, 0.5, 0.9375};
+    t_sample samp[] = {10, 900, 5,   700, 20, 5,   3, 3, 60000,   8, 2000, 1};
+    int src[] = {1, 3};
+    t_sample nearest[] = {700, 20, 5,   8, 2000, 1};
+    // 3/7 of the way from pulse 1 to 2, and 4/7 from 2 to 3, rounded
+    t_sample linear[] = {401, 13, 25717,   6, 1144, 25715};
+    // the first bin holds pulses 0 and 1; the last, 2 and 3
+    t_sample max[] = {700, 900, 5,   8, 2000, 60000};
+    ok = check("end bins, nearest", azimuth_resampler::NEAREST, 2, 0.25, 0.75, azi, samp, 4, nearest, src) && ok;
+    ok = check("end bins, linear", azimuth_resampler::LINEAR, 2, 0.25, 0.75, azi, samp, 4, linear, src) && ok;
+    ok = check("end bins, max hold", azimuth_resampler::MAX_HOLD, 2, 0.25, 0.75, azi, samp, 4, max, src) && ok;
+  }
+
+  // mode names
+  int bad = (azimuth_resampler::mode_from_name("nearest") != azimuth_resampler::NEAREST)
+    + (azimuth_resampler::mode_from_name("linear") != azimuth_resampler::LINEAR)
+    + (azimuth_resampler::mode_from_name("max") != azimuth_resampler::MAX_HOLD);
+  try {
+    azimuth_resampler::mode_from_name("cubic");
+    ++bad;
+  } catch (std::runtime_error & e) {
+  }
+  std::cout << "mode names: mismatches: " << bad << std::endl;
+  if (bad) {
+    std::cout << "  ^^^ FAILED" << std::endl;
+    ok = false;
+  }
+
+  if (! ok) {
+    std::cout << "FAILED" << std::endl;
+    return 1;
+  }
+  std::cout << "PASSED" << std::endl;
+  return 0;
+}
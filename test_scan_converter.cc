@@ -0,0 +1,491 @@
+/**
+   @file test_scan_converter.cc
+   @brief consistency test for scan_converter: images rendered with
+   the vectorised apply kernel must be identical to those rendered
+   one pixel at a time, for evenly spaced and actual azimuths, for
+   image widths that aren't a multiple of the vector width, and for
+   sample buffers that aren't 32-bit aligned.  For several geometries,
+   including the production one, images must also be identical to
+   those drawn by a copy of the original construction loop, which
+   computes every pixel's indexes with atan2().  Converters built and
+   applied by several threads must render the same images as with
+   one thread.  Index tables built with the fast azimuth approximation
+   must be identical to those built with atan2().  Tables mapped from
+   the cache must be identical to freshly built ones, and a damaged
+   cache file must be rebuilt rather than used.  Panned converters
+   must have the same tables as those built from scratch, rotated
+   ones must render rotated data, and zoomed ones must show nearly
+   the same samples as converters built with the zoomed scale.
+   Images rendered a wedge of pulses at a time must be the same as
+   those rendered all at once, and wedges of a converter with no
+   pulses must draw nothing.  Pulses given actual azimuths must be
+   drawn at those azimuths, and azimuths quantized more coarsely than
+   the pulses must give the same image as evenly spaced pulses.
+
+   Returns 0 on success, 1 on failure.
+
+   @author John Brzustowski <jbrzusto is at fastmail dot fm>
+   @license GPL v2 or later
+ */
+
+#include "scan_converter.h"
+#include <iostream>
+#include <vector>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#define NR 900
+#define NC 512
+#define ORIGIN 8192
+#define SCALE 32
+
+// render sc's image of samp into a buffer with a few spare columns
+static std::vector < t_pixel >
+render (scan_converter & sc, t_sample * samp, const std::vector < t_palette > & pal) {
+  int span = sc.x0 + sc.w + 3;
+  std::vector < t_pixel > pix((size_t) span * (sc.y0 + sc.h), 1);
+  sc.apply(samp, & pix[0], span, const_cast < t_palette * > (& pal[0]), ORIGIN, SCALE);
+  return pix;
+};
+
+// render sc's image of samp a wedge of up to n pulses at a time,
+// starting from pulse first
+static std::vector < t_pixel >
+render_wedges (scan_converter & sc, t_sample * samp, const std::vector < t_palette > & pal, int first, int n) {
+  int span = sc.x0 + sc.w + 3;
+  std::vector < t_pixel > pix((size_t) span * (sc.y0 + sc.h), 1);
+  for (int t = 0; t < sc.nr; t += n)
+    sc.apply_pulses(samp, & pix[0], span, const_cast < t_palette * > (& pal[0]), ORIGIN, SCALE, first + t, std::min(n, sc.nr - t));
+  return pix;
+};
+
+static int
+count_differences (const std::vector < t_pixel > & a, const std::vector < t_pixel > & b) {
+  int bad = 0;
+  for (size_t i = 0; i < a.size(); ++i)
+    bad += a[i] != b[i];
+  return bad;
+};
+
+// render sc's image of samp both ways; count differing pixels
+static int
+compare (scan_converter & sc, t_sample * samp, const std::vector < t_palette > & pal) {
+  bool use_simd = sc.use_simd;
+  sc.use_simd = false;
+  std::vector < t_pixel > scalar = render(sc, samp, pal);
+  sc.use_simd = use_simd;
+  return count_differences(scalar, render(sc, samp, pal));
+};
+
+// build the converter described by its arguments with and without
+// exact_geometry, with even and then actual azimuths; count those
+// whose tables differ (0, 1 or 2)
+static int
+compare_geometry (int nr, int nc, int w, int h, int x0, int y0, int xc, int yc, bool smooth,
+                  double scale, double first_range, double azi_begin, double azi_end,
+                  const std::vector < float > & azi) {
+  scan_converter::exact_geometry = true;
+  scan_converter exact(nr, nc, w, h, x0, y0, xc, yc, smooth, scale, first_range, azi_begin, azi_end);
+  scan_converter::exact_geometry = false;
+  scan_converter fast(nr, nc, w, h, x0, y0, xc, yc, smooth, scale, first_range, azi_begin, azi_end);
+  int bad = ! exact.same_tables(fast);
+  scan_converter::exact_geometry = true;
+  exact.set_azimuths(& azi[0], azi.size(), azi_begin);
+  scan_converter::exact_geometry = false;
+  fast.set_azimuths(& azi[0], azi.size(), azi_begin);
+  return bad + ! exact.same_tables(fast);
+};
+
+// The construction loop and apply() of the original scan_converter,
+// fused so each pixel is drawn as its indexes are computed (and with
+// SCVT_EXTRA_PRECISION_BITS 0): the image of samp as drawn by a
+// converter with these arguments into a buffer like render()'s.
+static std::vector < t_pixel >
+render_original (int nr, int nc, int w, int h, int x0, int y0, int xc, int yc, bool always_smooth_angular,
+                 double scale, double first_range, double azi_begin, double azi_end,
+                 t_sample * samp, const std::vector < t_palette > & pal) {
+  int span = x0 + w + 3;
+  std::vector < t_pixel > image((size_t) span * (y0 + h), 1);
+  t_pixel * pix = & image[x0 + y0 * span];
+  double azi_step = (azi_end - azi_begin) / (nr - 1.0);
+  bool use_radial_neighbours = scale < 1.0;
+  first_range *= scale;
+  int angular_neighbour_thresh = (int) (always_smooth_angular ?  nc * scale : (1 + nr / (2 * M_PI * scale)));
+  bool normal_limits = azi_begin <= azi_end;
+  for (int j = x0; j < x0 + h; ++j, pix += span) {
+    double y = (j - yc + 0.5);
+    for (int i = y0; i < y0 + w; ++i) {
+      double x = i - xc + 0.5;
+      double bb = fmod( 2 * M_PI + atan2(y, x), 2 * M_PI) / (2 * M_PI) - azi_begin;
+      int theta = (int) (0.5 +  bb / azi_step);
+      int range = (int) (0.5 + (sqrt(x * x + y * y) - first_range) / scale);
+      if (! (range >= 0 && range < nc && normal_limits && theta >= 0 && theta < nr))
+        continue;
+      int l = theta * nc + range;
+      int inds[4], n = 0;
+      int prev = theta > 0 ? l - nc : l + (nr - 1) * nc;
+      if (range < angular_neighbour_thresh) {
+        if (use_radial_neighbours && range <= nc - 2) {
+          inds[n++] = l + 1;
+          inds[n++] = prev;
+          inds[n++] = prev + 1;
+        } else {
+          inds[n++] = prev;
+        }
+      } else if (use_radial_neighbours && range <= nc - 2) {
+        inds[n++] = l + 1;
+      }
+      inds[n++] = l;
+      int sum = 0;
+      for (int k = 0; k < n; ++k)
+        sum += samp[inds[k]] - ORIGIN;
+      pix[i - y0] = pal[sum / (n * SCALE)];
+    }
+  }
+  return image;
+};
+
+// count pixels which differ between the image of samp drawn by a
+// converter with these arguments and by the original one
+static int
+compare_original (int nr, int nc, int w, int h, int x0, int y0, int xc, int yc, bool smooth,
+                  double scale, double first_range, double azi_begin, double azi_end,
+                  t_sample * samp, const std::vector < t_palette > & pal) {
+  scan_converter sc(nr, nc, w, h, x0, y0, xc, yc, smooth, scale, first_range, azi_begin, azi_end);
+  return count_differences(render(sc, samp, pal),
+                           render_original(nr, nc, w, h, x0, y0, xc, yc, smooth, scale, first_range, azi_begin, azi_end, samp, pal));
+};
+
+// render sc's image of samp, given by pulse and sample, with palette
+// index i as colour i, and a background that isn't a colour
+static std::vector < t_pixel >
+render_fn (scan_converter & sc, int (*fn) (int t, int r)) {
+  std::vector < t_sample > samp((size_t) sc.nr * sc.nc);
+  for (int t = 0; t < sc.nr; ++t)
+    for (int r = 0; r < sc.nc; ++r)
+      samp[(size_t) t * sc.nc + r] = ORIGIN + SCALE * fn(t, r);
+  std::vector < t_palette > pal(256);
+  for (int i = 0; i < 256; ++i)
+    pal[i] = i;
+  int span = sc.x0 + sc.w;
+  std::vector < t_pixel > pix((size_t) span * (sc.y0 + sc.h), 0xffffffff);
+  sc.apply(& samp[0], & pix[0], span, & pal[0], ORIGIN, SCALE);
+  return pix;
+};
+
+// sample values that change by less than one palette index between
+// adjacent samples in range, or adjacent pulses around the circle
+static int by_range (int t, int r) {return r * 255 / (NC - 1);};
+static int by_pulse (int t, int r) {return 2 * std::min(t, NR - t) * 255 / NR;};
+
+// a sweep of quant_pulses pulses whose azimuths are quantized to
+// 1 / quant_levels of a circle: the last pulse at each azimuth has a
+// value that changes slowly around the circle, and the others have a
+// value that mustn't be drawn
+static int quant_pulses, quant_levels;
+static int quantum (int t) {return (int) ((long long) t * quant_levels / quant_pulses);};
+static int by_quantum (int t, int r) {return std::min(t, quant_levels - t) * 254 / quant_levels;};
+static int by_quantized_pulse (int t, int r) {return quantum(t + 1) == quantum(t) ? 255 : by_quantum(quantum(t), r);};
+static int by_pulse_number (int t, int r) {return t % 256;};
+
+// Count pixels of a converter given np pulses with azimuths quantized
+// to 1 / levels which differ by more than one palette index from those
+// of one built with levels evenly spaced pulses, or which have data in
+// only one of them (edge).
+static int
+quantized_errors (int np, int levels, int & edge, int & npix) {
+  quant_pulses = np;
+  quant_levels = levels;
+  std::vector < float > azi(np);
+  for (int t = 0; t < np; ++t)
+    azi[t] = quantum(t) / (float) levels;
+  scan_converter even(levels, NC, 301, 277, 0, 0, 150, 140, false, 0.4, 0, 0, (levels - 1.0) / levels);
+  scan_converter quant(np, NC, 301, 277, 0, 0, 150, 140, false, 0.4, 0, 0, 1);
+  quant.set_azimuths(& azi[0], np);
+  std::vector < t_pixel > a = render_fn(quant, by_quantized_pulse), b = render_fn(even, by_quantum);
+  int bad = 0;
+  for (size_t i = 0; i < a.size(); ++i) {
+    if ((a[i] == 0xffffffff) != (b[i] == 0xffffffff))
+      ++edge;
+    else
+      bad += abs((int) a[i] - (int) b[i]) > 1;
+  }
+  npix += a.size();
+  return bad;
+};
+
+// Count the pixels along the ray at the azimuth of each of pulses
+// which don't show that pulse.
+static int
+ray_errors (const std::vector < float > & azi, const std::vector < int > & pulses) {
+  scan_converter sc(azi.size(), NC, 1024, 1024, 0, 0, 512, 512, false, 1, 0, 0, 1);
+  sc.set_azimuths(& azi[0], azi.size());
+  std::vector < t_pixel > pix = render_fn(sc, by_pulse_number);
+  int bad = 0;
+  for (size_t p = 0; p < pulses.size(); ++p) {
+    double a = 2 * M_PI * azi[pulses[p]];
+    for (int d = 200; d <= 500; d += 50) {
+      int i = (int) floor(sc.xc + d * cos(a)), j = (int) floor(sc.yc + d * sin(a));
+      bad += pix[(size_t) j * sc.w + i] != (t_pixel) (pulses[p] % 256);
+    }
+  }
+  return bad;
+};
+
+// Count pixels of zoomed converter z, with x0 = y0 = 0, which differ
+// by more than one palette index from those of a converter built with
+// its scale, or which have data in only one of them (edge), ignoring
+// pixels within radius near of the centre.  A zoomed pixel shows what
+// the source pixel containing it did, so is up to half a source pixel
+// from where it would be sampled; near the centre, that is several
+// pulses.
+static int
+zoom_errors (const scan_converter & sc, scan_converter & z, int (*fn) (int t, int r), double near, int & edge) {
+  scan_converter fresh(sc.nr, sc.nc, sc.w, sc.h, sc.x0, sc.y0, sc.xc, sc.yc, sc.always_smooth_angular,
+                       z.scale, sc.first_range, sc.azi_begin, sc.azi_end);
+  std::vector < t_pixel > a = render_fn(z, fn), b = render_fn(fresh, fn);
+  int bad = 0;
+  for (int j = 0; j < z.h; ++j) {
+    for (int i = 0; i < z.w; ++i) {
+      if (hypot(i - z.xc + 0.5, j - z.yc + 0.5) < near)
+        continue;
+      t_pixel p = a[(size_t) j * z.w + i], q = b[(size_t) j * z.w + i];
+      if ((p == 0xffffffff) != (q == 0xffffffff))
+        ++edge;
+      else
+        bad += abs((int) p - (int) q) > 1;
+    }
+  }
+  return bad;
+};
+
+// the paths of the files in directory dir
+static std::vector < std::string >
+list_dir (const std::string & dir) {
+  std::vector < std::string > files;
+  DIR * d = opendir(dir.c_str());
+  while (struct dirent * e = d ? readdir(d) : 0)
+    if (e->d_name[0] != '.')
+      files.push_back(dir + "/" + e->d_name);
+  if (d)
+    closedir(d);
+  return files;
+};
+
+static bool
+report (const char * name, int bad, const char * what = "pixels") {
+  std::cout << name << ": mismatched " << what << ": " << bad << std::endl;
+  if (bad)
+    std::cout << "  ^^^ FAILED" << std::endl;
+  return ! bad;
+};
+
+int
+main (int argc, char *argv[]) {
+  // one spare sample at the start, so the buffer can be misaligned
+  std::vector < t_sample > buf(1 + NR * NC);
+  unsigned int seed = 1;
+  for (size_t i = 0; i < buf.size(); ++i)
+    buf[i] = ORIGIN + rand_r(& seed) % (256 * SCALE);
+  std::vector < t_palette > pal(256);
+  for (int i = 0; i < 256; ++i)
+    pal[i] = 0xff000000 | (i * 0x010203);
+
+  if (! scan_converter(NR, NC, 8, 8, 0, 0, 4, 4, true, 1, 0, 0, 1).use_simd)
+    std::cout << "note: no vectorised kernel on this CPU; comparing scalar with itself" << std::endl;
+
+  bool ok = true;
+  // a sub-image offset in the buffer, with the centre outside it
+  scan_converter sc(NR, NC, 437, 301, 5, 7, 420, 350, false, 0.6, -3, 0.1, 0.1 + (NR - 1.0) / NR);
+  ok = report("even azimuths", compare(sc, & buf[0], pal)) && ok;
+  ok = report("even azimuths, unaligned samples", compare(sc, & buf[1], pal)) && ok;
+
+  scan_converter smooth(NR, NC, 203, 199, 0, 0, 100, 100, true, 2.5, 0, 0, (NR - 1.0) / NR);
+  ok = report("magnified, always smoothed", compare(smooth, & buf[1], pal)) && ok;
+
+  // the original construction: a sub-image with the centre outside
+  // it, magnified and always smoothed, the production image (with
+  // samples enough for its pulses), a partial sector, and a reversed
+  // sector, which has no data
+  std::vector < t_sample > big(3600 * 1024);
+  for (size_t i = 0; i < big.size(); ++i)
+    big[i] = ORIGIN + rand_r(& seed) % (256 * SCALE);
+  ok = report("original, sub-image", compare_original(NR, NC, 437, 301, 5, 7, 420, 350, false, 0.6, -3,
+                                                          0.1, 0.1 + (NR - 1.0) / NR, & buf[0], pal)) && ok;
+  ok = report("original, magnified", compare_original(NR, NC, 203, 199, 0, 0, 100, 100, true, 2.5, 0,
+                                                          0, (NR - 1.0) / NR, & buf[0], pal)) && ok;
+  ok = report("original, production geometry", compare_original(3600, 1024, 1875, 1866, 0, 0, 1875, 663, true, 0.7494811,
+                                                                    0, 46.8 / 360, 46.8 / 360 + 3599.0 / 3600, & big[0], pal)) && ok;
+  ok = report("original, sector", compare_original(NR, NC, 640, 480, 0, 0, 20, 460, false, 0.9, 2,
+                                                       0.7, 0.95, & buf[0], pal)) && ok;
+  ok = report("original, reversed sector", compare_original(NR, NC, 300, 200, 0, 0, 150, 100, true, 0.5, 0,
+                                                                0.9, 0.2, & buf[0], pal)) && ok;
+
+  // jittered azimuths, with a gap
+  std::vector < float > azi(NR);
+  for (int i = 0; i < NR; ++i)
+    azi[i] = (i + 0.4 * rand_r(& seed) / RAND_MAX) / NR;
+  for (int i = 100; i < 150; ++i)
+    azi[i] = NAN;
+  sc.set_azimuths(& azi[0], NR, 0.25);
+  ok = report("actual azimuths", compare(sc, & buf[0], pal)) && ok;
+
+  // a pulse is drawn along the ray at its azimuth
+  int rays[] = {0, 37, 99, 150, 333, 612, 899};
+  ok = report("pulses at their azimuths", ray_errors(azi, std::vector < int > (rays, rays + 7))) && ok;
+
+  // azimuths quantized to fewer steps than there are pulses, as from
+  // a 10-bit encoder or a coarse heading; evenly spaced pulses leave
+  // a sliver just short of the full circle blank
+  int edge = 0, npix = 0;
+  int bad = quantized_errors(3857, 1024, edge, npix) + quantized_errors(3857, 450, edge, npix);
+  std::cout << "quantized azimuths: pixels with data in only one image: " << edge << " of " << npix << std::endl;
+  ok = report("quantized azimuths", bad + (edge > npix / 1000)) && ok;
+
+  // the same geometries, built and applied by several threads
+  scan_converter threaded(NR, NC, 437, 301, 5, 7, 420, 350, false, 0.6, -3, 0.1, 0.1 + (NR - 1.0) / NR, 3);
+  scan_converter serial(NR, NC, 437, 301, 5, 7, 420, 350, false, 0.6, -3, 0.1, 0.1 + (NR - 1.0) / NR);
+  ok = report("3 threads", count_differences(render(serial, & buf[0], pal), render(threaded, & buf[0], pal))) && ok;
+  threaded.set_threads(5);
+  threaded.set_azimuths(& azi[0], NR, 0.25);
+  ok = report("5 threads, actual azimuths", count_differences(render(sc, & buf[0], pal), render(threaded, & buf[0], pal))) && ok;
+
+  // fast and exact geometry: the production image, a magnified
+  // sub-image, a partial sector, and one with no data
+  ok = report("production geometry", compare_geometry(3600, 1024, 1875, 1866, 0, 0, 1875, 663, true, 0.7494811,
+                                                             0, 46.8 / 360, 46.8 / 360 + 3599.0 / 3600, azi), "tables") && ok;
+  ok = report("magnified sub-image", compare_geometry(NR, NC, 437, 301, 5, 7, 420, 350, false, 3.7, -3.25,
+                                                             0.1, 0.1 + (NR - 1.0) / NR, azi), "tables") && ok;
+  ok = report("sector", compare_geometry(NR, NC, 640, 480, 0, 0, 20, 460, false, 0.9, 2,
+                                                0.7, 0.95, azi), "tables") && ok;
+  ok = report("reversed sector", compare_geometry(NR, NC, 300, 200, 0, 0, 150, 100, true, 0.5, 0,
+                                                         0.9, 0.2, azi), "tables") && ok;
+
+  // wedge by wedge: evenly spaced pulses, starting part way round;
+  // actual azimuths; and again after new azimuths
+  ok = report("wedges", count_differences(render(serial, & buf[0], pal), render_wedges(serial, & buf[0], pal, 500, 7))) && ok;
+  ok = report("wedges, actual azimuths", count_differences(render(threaded, & buf[0], pal), render_wedges(threaded, & buf[0], pal, 0, 64))) && ok;
+  threaded.set_azimuths(& azi[0], NR - 1, 0.4);
+  ok = report("wedges, new azimuths", count_differences(render(threaded, & buf[1], pal), render_wedges(threaded, & buf[1], pal, 3, 1))) && ok;
+  // with no pulses, a wedge draws nothing
+  threaded.set_azimuths(& azi[0], 0, 0);
+  {
+    int span = threaded.x0 + threaded.w + 3;
+    std::vector < t_pixel > pix((size_t) span * (threaded.y0 + threaded.h), 1), untouched(pix);
+    threaded.apply_pulses(& buf[0], & pix[0], span, const_cast < t_palette * > (& pal[0]), ORIGIN, SCALE, 5, 10);
+    ok = report("wedges, no pulses", count_differences(untouched, pix)) && ok;
+  }
+  threaded.set_azimuths(& azi[0], NR, 0.25);
+
+  // panned: the same tables as built from scratch, including views
+  // that leave the original image entirely
+  int pans[][2] = {{0, 0}, {17, -5}, {-40, 33}, {500, 0}, {-3, -400}};
+  bad = 0;
+  for (int p = 0; p < 5; ++p) {
+    int dx = pans[p][0], dy = pans[p][1];
+    scan_converter * pan = serial.panned(dx, dy);
+    scan_converter fresh(NR, NC, 437, 301, 5, 7, 420 - dx, 350 - dy, false, 0.6, -3, 0.1, 0.1 + (NR - 1.0) / NR);
+    bad += ! pan->same_tables(fresh);
+    delete pan;
+  }
+  ok = report("panned", bad, "tables") && ok;
+  scan_converter * pan = threaded.panned(-25, 12);
+  pan->set_azimuths(& azi[0], NR, 0.25);
+  scan_converter moved(NR, NC, 437, 301, 5, 7, 445, 338, false, 0.6, -3, 0.1, 0.1 + (NR - 1.0) / NR);
+  moved.set_azimuths(& azi[0], NR, 0.25);
+  ok = report("panned, actual azimuths", ! pan->same_tables(moved), "tables") && ok;
+  delete pan;
+
+  // rotated by k pulses: the image of the data with each pulse moved
+  // k pulses on, for the whole circle
+  scan_converter circle(NR, NC, 301, 277, 0, 0, 150, 140, true, 0.4, 0, 0.03, 0.03 + (NR - 1.0) / NR);
+  int k = 123;
+  scan_converter * rot = circle.rotated(k / (double) NR);
+  std::vector < t_sample > turned(NR * NC);
+  for (int t = 0; t < NR; ++t)
+    std::copy(& buf[((t + NR - k) % NR) * NC], & buf[((t + NR - k) % NR + 1) * NC], & turned[t * NC]);
+  ok = report("rotated", count_differences(render(* rot, & buf[0], pal), render(circle, & turned[0], pal))) && ok;
+  scan_converter * back = rot->rotated(- k / (double) NR);
+  ok = report("rotated and back", ! back->same_tables(circle), "tables") && ok;
+  delete back;
+  delete rot;
+  rot = threaded.rotated(0.1);
+  back = rot->rotated(-0.1);
+  ok = report("rotated and back, actual azimuths", rot->same_tables(threaded) + ! back->same_tables(threaded), "tables") && ok;
+  delete back;
+  delete rot;
+  // a sector is rebuilt
+  scan_converter sector(NR, NC, 640, 480, 0, 0, 20, 460, false, 0.9, 2, 0.7, 0.95);
+  rot = sector.rotated(0.05);
+  scan_converter sector2(NR, NC, 640, 480, 0, 0, 20, 460, false, 0.9, 2, 0.75, 1.0);
+  ok = report("rotated sector", ! rot->same_tables(sector2), "tables") && ok;
+  delete rot;
+
+  // zoomed: by 1, or in and back out, the same tables; otherwise,
+  // nearly the same image as built with the zoomed scale
+  scan_converter * zoom = serial.zoomed(1);
+  ok = report("zoomed by 1", ! zoom->same_tables(serial), "tables") && ok;
+  delete zoom;
+  zoom = serial.zoomed(2);
+  back = zoom->zoomed(0.5);
+  ok = report("zoomed in and out", ! back->same_tables(serial), "tables") && ok;
+  delete back;
+  delete zoom;
+  double factors[] = {2, 3.3, 0.5, 0.8};
+  bad = 0;
+  edge = npix = 0;
+  for (int f = 0; f < 4; ++f) {
+    zoom = circle.zoomed(factors[f]);
+    bad += zoom_errors(circle, * zoom, by_range, 0, edge)
+      + zoom_errors(circle, * zoom, by_pulse, NR * std::max(factors[f], 1.0) / (2 * M_PI), edge);
+    npix += 2 * zoom->w * zoom->h;
+    delete zoom;
+  }
+  std::cout << "zoomed: pixels with data in only one image: " << edge << " of " << npix << std::endl;
+  ok = report("zoomed", bad + (edge > npix / 100)) && ok;
+
+  // cached tables: written by the first converter, mapped by the
+  // second, and rebuilt by the third once the file is damaged
+  char dir[] = "/tmp/test_scan_converter_XXXXXX";
+  if (mkdtemp(dir)) {
+    scan_converter::cache_dir = dir;
+    scan_converter first(NR, NC, 437, 301, 5, 7, 420, 350, false, 0.6, -3, 0.1, 0.1 + (NR - 1.0) / NR);
+    scan_converter warm(NR, NC, 437, 301, 5, 7, 420, 350, false, 0.6, -3, 0.1, 0.1 + (NR - 1.0) / NR, 3);
+    std::vector < std::string > files = list_dir(dir);
+    ok = report("cache written", (files.size() != 1) + ! first.tables_mapped(), "files") && ok;
+    ok = report("cache mapped", ! warm.tables_mapped() + ! warm.same_tables(serial), "tables") && ok;
+    ok = report("cache mapped, rendered", count_differences(render(serial, & buf[0], pal), render(warm, & buf[0], pal))) && ok;
+    if (files.size() == 1) {
+      int fd = open(files[0].c_str(), O_WRONLY);
+      char junk = 0x5a;
+      if (fd >= 0) {
+        if (pwrite(fd, & junk, 1, 4096) != 1)
+          std::cout << "note: unable to damage the cache file" << std::endl;
+        close(fd);
+      }
+      scan_converter damaged(NR, NC, 437, 301, 5, 7, 420, 350, false, 0.6, -3, 0.1, 0.1 + (NR - 1.0) / NR);
+      ok = report("damaged cache rebuilt", ! damaged.same_tables(serial), "tables") && ok;
+    }
+    // a converter given actual azimuths no longer uses the file
+    warm.set_azimuths(& azi[0], NR, 0.25);
+    ok = report("cache, actual azimuths", warm.tables_mapped() + ! warm.same_tables(threaded), "tables") && ok;
+    scan_converter::cache_dir.clear();
+    files = list_dir(dir);
+    for (size_t i = 0; i < files.size(); ++i)
+      unlink(files[i].c_str());
+    rmdir(dir);
+  } else {
+    std::cout << "note: unable to create a cache directory; cache not tested" << std::endl;
+  }
+
+  if (! ok) {
+    std::cout << "FAILED" << std::endl;
+    return 1;
+  }
+  std::cout << "PASSED" << std::endl;
+  return 0;
+}
@@ -0,0 +1,209 @@
+/**
+   @file test_shared_ring_buffer.cc
+   @brief stress test for shared_ring_buffer: a writer thread and a reader
+   thread hammer a small ring; every chunk the reader sees must be intact
+   (no torn chunks) and must have a larger sequence number than the
+   previous one (no reordered or repeated chunks).  The test is run
+   with a polling reader and with readers that sleep (and optionally spin) in
+   wait_for_chunk, and with both sides using single chunks and batches,
+   under each overrun policy.  The buffer's traffic counters must
+   account for every chunk, and under the BLOCK_WRITER policy, no
+   chunk may be missing.
+
+   Returns 0 on success, 1 on failure.
+
+   @author John Brzustowski <jbrzusto is at fastmail dot fm>
+   @license GPL v2 or later
+ */
+
+#include "shared_ring_buffer.h"
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+
+// odd chunk size, so chunks straddle cache lines in different ways
+#define CHUNK_SIZE 1003
+#define NUM_CHUNKS 7
+#ifndef NUM_WRITES
+#define NUM_WRITES 200000
+#endif
+
+struct test_state {
+  shared_ring_buffer * srb;
+  uint64_t num_read;
+  uint64_t num_bad;
+  uint64_t num_out_of_order;
+  uint64_t num_gaps;
+  uint64_t num_written;
+  bool use_wait;
+  bool use_batch;
+};
+
+// fill a chunk with a pattern determined by its sequence number
+static void
+fill_chunk (unsigned char *p, uint64_t seq) {
+  memcpy(p, & seq, sizeof(seq));
+  for (int i = sizeof(seq); i < CHUNK_SIZE; ++i)
+    p[i] = (unsigned char) (seq * 31 + i);
+};
+
+// return true iff chunk is intact; set seq to its sequence number
+static bool
+check_chunk (unsigned char *p, uint64_t & seq) {
+  memcpy(& seq, p, sizeof(seq));
+  for (int i = sizeof(seq); i < CHUNK_SIZE; ++i)
+    if (p[i] != (unsigned char) (seq * 31 + i))
+      return false;
+  return true;
+};
+
+static void *
+writer (void * arg) {
+  test_state * ts = (test_state *) arg;
+  unsigned char tmp[CHUNK_SIZE];
+  unsigned int seed = 1;
+  for (uint64_t seq = 1; seq <= NUM_WRITES; ++seq) {
+    if (ts->use_batch) {
+      // claim a random number of chunks, and publish a random number of those
+      chunk_span span[2];
+      int n = ts->srb->chunks_for_writing(1 + rand_r(& seed) % 10, span);
+      int k = rand_r(& seed) % (n + 1);
+      for (int i = 0; i < k; ++i, ++seq) {
+        chunk_span & sp = span[i < span[0].n ? 0 : 1];
+        fill_chunk(sp.p + (i < span[0].n ? i : i - span[0].n) * CHUNK_SIZE, seq);
+      }
+      --seq;
+      ts->srb->done_writing_chunks(k);
+      ts->num_written += k;
+    } else if (seq & 1) {
+      // alternate between writing in place and copying in
+      fill_chunk(ts->srb->chunk_for_writing(), seq);
+      ts->srb->done_writing_chunk();
+    } else {
+      fill_chunk(tmp, seq);
+      ts->srb->write_chunk(tmp);
+    }
+    if (! ts->use_batch)
+      ++ts->num_written;
+    if (rand_r(& seed) % 64 == 0)
+      sched_yield();
+  }
+  ts->srb->done();
+  return 0;
+};
+
+// check a chunk read from the ring
+static void
+check (test_state * ts, unsigned char * p, uint64_t & last_seq) {
+  uint64_t seq;
+  if (! check_chunk(p, seq))
+    ++ts->num_bad;
+  else if (seq <= last_seq)
+    ++ts->num_out_of_order;
+  else if (seq != last_seq + 1)
+    ++ts->num_gaps;
+  last_seq = seq;
+  ++ts->num_read;
+};
+
+static void *
+reader (void * arg) {
+  test_state * ts = (test_state *) arg;
+  unsigned int seed = 2;
+  uint64_t last_seq = 0;
+  for (;;) {
+    unsigned char * p;
+    if (ts->use_wait) {
+      p = ts->srb->wait_for_chunk(0.01);
+      if (! p) {
+        if (ts->srb->is_done())
+          break;
+        continue;
+      }
+    } else {
+      // read done flag before trying the ring, so we don't miss the last chunks
+      bool done = ts->srb->is_done();
+      p = ts->srb->read_chunk();
+      if (! p) {
+        if (done)
+          break;
+        sched_yield();
+        continue;
+      }
+    }
+    check(ts, p, last_seq);
+    if (ts->use_batch) {
+      // the chunk just checked is also the first of the batch
+      ts->srb->done_reading_chunk();
+      chunk_span span[2];
+      if (ts->srb->read_chunks(1 + rand_r(& seed) % 10, span))
+        for (int s = 0; s < 2; ++s)
+          for (int i = 0; i < span[s].n; ++i)
+            check(ts, span[s].p + i * CHUNK_SIZE, last_seq);
+    }
+    if (rand_r(& seed) % 64 == 0)
+      sched_yield();
+    ts->srb->done_reading_chunk();
+  }
+  return 0;
+};
+
+// run one writer and one reader to completion; return true on success
+static bool
+run_test (shared_ring_buffer::overrun_policy policy, bool use_wait, int max_spin, bool use_batch) {
+  static const char * policy_names[] = {"block", "drop newest", "drop oldest"};
+  shared_ring_buffer srb(CHUNK_SIZE, NUM_CHUNKS, policy);
+  srb.set_max_spin(max_spin);
+  test_state ts = {& srb, 0, 0, 0, 0, 0, use_wait, use_batch};
+  pthread_t wt, rt;
+
+  pthread_create(& rt, NULL, & reader, & ts);
+  pthread_create(& wt, NULL, & writer, & ts);
+  pthread_join(wt, NULL);
+  pthread_join(rt, NULL);
+
+  shared_ring_buffer_stats st = srb.get_stats();
+
+  std::cout << policy_names[policy] << ", " << (use_batch ? "batched " : "single ") << (use_wait ? "waiting" : "polling") << " reader, max_spin " << max_spin
+            << ": wrote " << ts.num_written << " chunks; read " << ts.num_read
+            << "; torn: " << ts.num_bad << "; out of order: " << ts.num_out_of_order
+            << "; gaps: " << ts.num_gaps << "; dropped: " << st.chunks_dropped
+            << "; overwritten: " << st.chunks_overwritten << "; writer waits: " << st.writer_waits
+            << "; high water: " << st.high_water << std::endl;
+
+  bool ok = ts.num_read > 0 && ts.num_bad == 0 && ts.num_out_of_order == 0
+    && st.chunks_written + st.chunks_dropped == ts.num_written
+    && st.chunks_read == ts.num_read
+    && st.chunks_written == st.chunks_read + st.chunks_overwritten
+    && st.high_water <= NUM_CHUNKS;
+  if (policy == shared_ring_buffer::BLOCK_WRITER)
+    ok = ok && ts.num_gaps == 0 && ts.num_read == ts.num_written;
+  if (policy == shared_ring_buffer::DROP_NEWEST)
+    ok = ok && st.chunks_overwritten == 0;
+  if (! ok)
+    std::cout << "  ^^^ FAILED" << std::endl;
+  return ok;
+};
+
+int
+main (int argc, char *argv[]) {
+  bool ok = true;
+  for (int p = shared_ring_buffer::BLOCK_WRITER; p <= shared_ring_buffer::DROP_OLDEST; ++p) {
+    shared_ring_buffer::overrun_policy policy = (shared_ring_buffer::overrun_policy) p;
+    for (int b = 0; b < 2; ++b) {
+      ok = run_test(policy, false, 0, b) && ok;
+      ok = run_test(policy, true, 0, b) && ok;
+      ok = run_test(policy, true, 100, b) && ok;
+    }
+  }
+
+  if (! ok) {
+    std::cout << "FAILED" << std::endl;
+    return 1;
+  }
+  std::cout << "PASSED" << std::endl;
+  return 0;
+}
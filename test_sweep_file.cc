@@ -0,0 +1,284 @@
+/**
+   @file test_sweep_file.cc
+   @brief round-trip test for sweep_file_writer and sweep_file_reader:
+   sweeps of synthetic pulses are written with each write method,
+   compression codec and filter, in both file formats, and with
+   streaming, then read back; every column must match what was
+   recorded.  A gzipped sweep file must read the same as the original.
+   A gzip file that is truncated or misstates its size, a format 2
+   file with a damaged sample, and a compressed file claiming an
+   impossible number of samples must be rejected.
+
+   Returns 0 on success, 1 on failure.
+
+   @author John Brzustowski <jbrzusto is at fastmail dot fm>
+   @license GPL v2 or later
+ */
+
+#include "sweep_file_writer.h"
+#include "sweep_file_reader.h"
+#include <iostream>
+#include <fstream>
+#include <stdexcept>
+#include <boost/filesystem.hpp>
+#include <zlib.h>
+#include <string.h>
+
+#define NS 300
+#define MAX_PULSES 100
+#define NUM_SWEEPS 3
+
+// pulses per sweep; varies, so some sweeps are truncated at MAX_PULSES
+static int
+pulses_in_sweep (int arp) {
+  return 70 + 20 * arp;
+};
+
+// an echo-like sample: smooth in range and from pulse to pulse, plus noise
+static uint16_t
+sample (int arp, int p, int i) {
+  return (uint16_t) (1000 + (i * 7 + p * 3 + arp) % 500 + ((i * 31 + p * 17) & 7));
+};
+
+struct test_case {
+  const char * name;
+  sweep_file_writer::write_method method;
+  sample_codec::codec_type codec;
+  sample_codec::filter_type filter;
+  int block_pulses;
+  int format;
+};
+
+static bool
+run_test (const std::string & folder, const test_case & tc) {
+  boost::filesystem::remove_all(folder);
+  boost::filesystem::create_directories(folder);
+  std::string log = folder + "/log.txt";
+  {
+    sweep_file_writer sfw(folder, "TEST", log, MAX_PULSES, NS, 16, 0, 125, 1, "sum");
+    sfw.set_format(tc.format);
+    sfw.set_write_method(tc.method);
+    sfw.set_compression(tc.codec, tc.filter);
+    if (tc.block_pulses > 0)
+      sfw.set_block_pulses(tc.block_pulses);
+    uint16_t buf[NS];
+    for (int arp = 0; arp < NUM_SWEEPS; ++arp) {
+      for (int p = 0; p < pulses_in_sweep(arp); ++p) {
+        for (int i = 0; i < NS; ++i)
+          buf[i] = sample(arp, p, i);
+        sfw.record_pulse(1.6e9 + arp * 2.5 + p * 1e-3, p, p * 1000, p / 100.0, arp, 0, 0, buf);
+      }
+    }
+  }
+
+  std::ifstream logfs(log.c_str());
+  std::string path;
+  int arp = 0;
+  uint64_t bad = 0;
+  size_t bytes = 0;
+  try {
+    for (; std::getline(logfs, path); ++arp) {
+      sweep_file_reader sfr(path);
+      bytes += boost::filesystem::file_size(path);
+      int np = pulses_in_sweep(arp) < MAX_PULSES ? pulses_in_sweep(arp) : MAX_PULSES;
+      if (sfr.get_np() != np || sfr.get_ns() != NS || atoi(sfr.get_field("arp").c_str()) != arp) {
+        ++bad;
+        continue;
+      }
+      const uint16_t * x = sfr.get_samples();
+      for (int p = 0; p < np; ++p) {
+        if (sfr.get_clocks()[p] != (uint32_t) p * 1000 || sfr.get_trigs()[p] != (uint32_t) p || sfr.get_azi()[p] != (float) (p / 100.0))
+          ++bad;
+        for (int i = 0; i < NS; ++i)
+          if (x[p * NS + i] != sample(arp, p, i))
+            ++bad;
+      }
+    }
+  } catch (std::runtime_error & e) {
+    std::cout << e.what() << std::endl;
+    ++bad;
+  }
+  bool ok = bad == 0 && arp == NUM_SWEEPS;
+  std::cout << tc.name << ": files: " << arp << "; bytes: " << bytes << "; mismatches: " << bad << std::endl;
+  if (! ok)
+    std::cout << "  ^^^ FAILED" << std::endl;
+  return ok;
+};
+
+// damage one sample in a format 2 file; reading it must fail
+static bool
+test_crc (const std::string & folder) {
+  boost::filesystem::remove_all(folder);
+  boost::filesystem::create_directories(folder);
+  std::string log = folder + "/log.txt";
+  {
+    sweep_file_writer sfw(folder, "TEST", log, MAX_PULSES, NS, 16, 0, 125, 1, "sum");
+    sfw.set_format(2);
+    uint16_t buf[NS] = {0};
+    for (int p = 0; p < 10; ++p)
+      sfw.record_pulse(1.6e9 + p * 1e-3, p, p * 1000, p / 100.0, 0, 0, 0, buf);
+  }
+  std::ifstream logfs(log.c_str());
+  std::string path;
+  std::getline(logfs, path);
+  FILE * f = fopen(path.c_str(), "r+b");
+  fseek(f, -1, SEEK_END);
+  fputc(1, f);
+  fclose(f);
+  bool ok = false;
+  try {
+    sweep_file_reader sfr(path);
+  } catch (std::runtime_error & e) {
+    ok = true;
+  }
+  std::cout << "format 2, damaged sample: " << (ok ? "rejected" : "not rejected") << std::endl;
+  if (! ok)
+    std::cout << "  ^^^ FAILED" << std::endl;
+  return ok;
+};
+
+// gzip a sweep file, as the filer does; it must read the same as the original
+static bool
+test_gzip (const std::string & folder) {
+  boost::filesystem::remove_all(folder);
+  boost::filesystem::create_directories(folder);
+  std::string log = folder + "/log.txt";
+  {
+    sweep_file_writer sfw(folder, "TEST", log, MAX_PULSES, NS, 16, 0, 125, 1, "sum");
+    uint16_t buf[NS];
+    for (int p = 0; p < 50; ++p) {
+      for (int i = 0; i < NS; ++i)
+        buf[i] = sample(0, p, i);
+      sfw.record_pulse(1.6e9 + p * 1e-3, p, p * 1000, p / 100.0, 0, 0, 0, buf);
+    }
+  }
+  std::ifstream logfs(log.c_str());
+  std::string path;
+  std::getline(logfs, path);
+  std::ifstream in(path.c_str(), std::ios::binary);
+  std::string contents((std::istreambuf_iterator < char > (in)), std::istreambuf_iterator < char > ());
+  gzFile gz = gzopen((path + ".gz").c_str(), "wb");
+  gzwrite(gz, contents.data(), contents.size());
+  gzclose(gz);
+
+  bool ok = false;
+  try {
+    sweep_file_reader plain(path), gzipped(path + ".gz");
+    ok = plain.get_header() == gzipped.get_header()
+      && ! memcmp(plain.get_clocks(), gzipped.get_clocks(), 50 * sizeof(uint32_t))
+      && ! memcmp(plain.get_azi(), gzipped.get_azi(), 50 * sizeof(float))
+      && ! memcmp(plain.get_trigs(), gzipped.get_trigs(), 50 * sizeof(uint32_t))
+      && ! memcmp(plain.get_samples(), gzipped.get_samples(), 50 * NS * sizeof(uint16_t));
+  } catch (std::runtime_error & e) {
+    std::cout << e.what() << std::endl;
+  }
+  std::cout << "gzipped: " << (ok ? "matches" : "does not match") << std::endl;
+
+  // a file cut off within the gzip header must be rejected, not read
+  // past its end
+  std::ofstream cut((path + ".cut.gz").c_str(), std::ios::binary);
+  cut.write("\x1f\x8b\x08\x00\x00\x00", 6);
+  cut.close();
+  bool rejected = false;
+  try {
+    sweep_file_reader r(path + ".cut.gz");
+  } catch (std::runtime_error & e) {
+    rejected = true;
+  }
+  std::cout << "truncated gzip: " << (rejected ? "rejected" : "not rejected") << std::endl;
+  ok = ok && rejected;
+
+  // a trailer claiming 4 GB is rejected by zlib's check, without 4 GB
+  // having been allocated for it first
+  std::fstream gzf((path + ".gz").c_str(), std::ios::in | std::ios::out | std::ios::binary);
+  gzf.seekp(-4, std::ios::end);
+  gzf.write("\xff\xff\xff\xff", 4);
+  gzf.close();
+  rejected = false;
+  try {
+    sweep_file_reader r(path + ".gz");
+  } catch (std::runtime_error & e) {
+    rejected = true;
+  }
+  std::cout << "gzip with wrong size: " << (rejected ? "rejected" : "not rejected") << std::endl;
+  ok = ok && rejected;
+  if (! ok)
+    std::cout << "  ^^^ FAILED" << std::endl;
+  return ok;
+};
+
+// give a compressed sweep file an impossible number of samples per
+// pulse; reading it must fail before anything is allocated for them
+static bool
+test_shape (const std::string & folder) {
+  boost::filesystem::remove_all(folder);
+  boost::filesystem::create_directories(folder);
+  std::string log = folder + "/log.txt";
+  {
+    sweep_file_writer sfw(folder, "TEST", log, MAX_PULSES, NS, 16, 0, 125, 1, "sum");
+    sfw.set_compression(sample_codec::DEFLATE);
+    uint16_t buf[NS] = {0};
+    for (int p = 0; p < 10; ++p)
+      sfw.record_pulse(1.6e9 + p * 1e-3, p, p * 1000, p / 100.0, 0, 0, 0, buf);
+  }
+  std::ifstream logfs(log.c_str());
+  std::string path;
+  std::getline(logfs, path);
+  std::ifstream in(path.c_str(), std::ios::binary);
+  std::string contents((std::istreambuf_iterator < char > (in)), std::istreambuf_iterator < char > ());
+  in.close();
+
+  static const char * bad_ns[] = {"\"ns\":2000000000", "\"ns\":0"};
+  bool ok = true;
+  for (int k = 0; k < 2; ++k) {
+    std::string c = contents;
+    size_t i = c.find("\"ns\":300");
+    c.replace(i, 9, bad_ns[k]);
+    std::ofstream out(path.c_str(), std::ios::binary);
+    out << c;
+    out.close();
+    bool rejected = false;
+    try {
+      sweep_file_reader sfr(path);
+    } catch (std::runtime_error & e) {
+      rejected = true;
+    }
+    std::cout << "compressed, " << bad_ns[k] << ": " << (rejected ? "rejected" : "not rejected") << std::endl;
+    if (! rejected) {
+      std::cout << "  ^^^ FAILED" << std::endl;
+      ok = false;
+    }
+  }
+  return ok;
+};
+
+int
+main (int argc, char *argv[]) {
+  std::string folder = argc > 1 ? argv[1] : "/tmp/test_sweep_file";
+  test_case cases[] = {
+    {"buffered", sweep_file_writer::BUFFERED_WRITE, sample_codec::NONE, sample_codec::NO_FILTER, 0, 1},
+    {"direct", sweep_file_writer::DIRECT_WRITE, sample_codec::NONE, sample_codec::NO_FILTER, 0, 1},
+    {"streamed", sweep_file_writer::BUFFERED_WRITE, sample_codec::NONE, sample_codec::NO_FILTER, 32, 1},
+    {"deflate", sweep_file_writer::BUFFERED_WRITE, sample_codec::DEFLATE, sample_codec::NO_FILTER, 0, 1},
+    {"deflate, range delta", sweep_file_writer::BUFFERED_WRITE, sample_codec::DEFLATE, sample_codec::RANGE_DELTA, 0, 1},
+    {"deflate, pulse delta, direct", sweep_file_writer::DIRECT_WRITE, sample_codec::DEFLATE, sample_codec::PULSE_DELTA, 0, 1},
+    {"format 2", sweep_file_writer::BUFFERED_WRITE, sample_codec::NONE, sample_codec::NO_FILTER, 0, 2},
+    {"format 2, direct", sweep_file_writer::DIRECT_WRITE, sample_codec::NONE, sample_codec::NO_FILTER, 0, 2},
+    {"format 2, streamed", sweep_file_writer::BUFFERED_WRITE, sample_codec::NONE, sample_codec::NO_FILTER, 32, 2},
+    {"format 2, deflate, range delta", sweep_file_writer::BUFFERED_WRITE, sample_codec::DEFLATE, sample_codec::RANGE_DELTA, 0, 2}
+  };
+  bool ok = true;
+  for (unsigned i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+    ok = run_test(folder, cases[i]) && ok;
+  ok = test_gzip(folder) && ok;
+  ok = test_crc(folder) && ok;
+  ok = test_shape(folder) && ok;
+  boost::filesystem::remove_all(folder);
+
+  if (! ok) {
+    std::cout << "FAILED" << std::endl;
+    return 1;
+  }
+  std::cout << "PASSED" << std::endl;
+  return 0;
+}
@@ -0,0 +1,440 @@
+/**
+   @file test_tcp_reader.cc
+   @brief test of tcp_reader's handling of a damaged stream: a sender
+   connects over loopback, sends chunks beginning with
+   PULSE_METADATA_MAGIC with extra bytes inserted, bytes dropped and a
+   chunk cut off by a disconnect, then reconnects and sends a partial
+   chunk before resuming.  Every chunk published must begin with the
+   marker and be one of those sent, intact and in order, and the
+   resyncs, bytes_skipped and connections counters must account for
+   the damage.  This is done with tcp_reader::go(), and with two
+   readers served by tcp_multi_reader.
+
+   Without markers, a stream sent through a socket pair in pieces of
+   random size, so reads end part-way through chunks and the free
+   chunks of a small ring wrap around its end, must be published as
+   chunks identical to those sent, all of them when the writer blocks
+   and in order when the newest are dropped; dropped chunks must not
+   be counted as published.
+
+   Returns 0 on success, 1 on failure.
+
+   @author John Brzustowski <jbrzusto is at fastmail dot fm>
+   @license GPL v2 or later
+ */
+
+#include "tcp_reader.h"
+#include "tcp_multi_reader.h"
+#include "pulse_metadata.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// chunks are a marker, a sequence number, and a pattern
+#define CHUNK_SIZE 72
+#define NUM_CHUNKS 16
+
+// chunks sent on each connection, and the damage done to them
+#define FIRST_CHUNKS 40      // chunks 0..39, then part of chunk 40
+#define EXTRA_AFTER 10       // junk bytes inserted after this chunk
+#define EXTRA_BYTES 5
+#define DROP_CHUNK 20        // this chunk loses its first bytes
+#define DROP_BYTES 13
+#define CUT_BYTES 30         // bytes of chunk FIRST_CHUNKS sent before disconnecting
+#define RESTART_BYTES 30     // bytes from the middle of a chunk sent after reconnecting
+#define LAST_CHUNK 99        // chunks FIRST_CHUNKS + 1 .. LAST_CHUNK follow
+
+// what the counters should be after both connections
+#define EXPECTED_RESYNCS 3
+#define EXPECTED_SKIPPED (EXTRA_BYTES + CHUNK_SIZE - DROP_BYTES + CUT_BYTES + RESTART_BYTES)
+#define EXPECTED_CHUNKS (LAST_CHUNK - 1)
+
+// chunks of the unmarked stream: an odd size, in a small ring
+#define RAW_CHUNK_SIZE 1003
+#define RAW_NUM_CHUNKS 7
+#define RAW_CHUNKS 3000
+
+// payload bytes are below 0x80, so they never begin a marker
+static void
+make_chunk (unsigned char * p, uint64_t seq) {
+  uint64_t magic = PULSE_METADATA_MAGIC;
+  memcpy(p, & magic, sizeof(magic));
+  memcpy(p + sizeof(magic), & seq, sizeof(seq));
+  for (int i = 2 * sizeof(seq); i < CHUNK_SIZE; ++i)
+    p[i] = (unsigned char) ((seq * 7 + i) & 0x7f);
+};
+
+// is p an intact chunk begun with the marker?  Sets seq.
+static bool
+check_chunk (const unsigned char * p, uint64_t & seq) {
+  unsigned char q[CHUNK_SIZE];
+  memcpy(& seq, p + sizeof(uint64_t), sizeof(seq));
+  make_chunk(q, seq);
+  return ! memcmp(p, q, CHUNK_SIZE);
+};
+
+static void
+append_chunk (std::string & s, uint64_t seq, int from = 0, int to = CHUNK_SIZE) {
+  unsigned char p[CHUNK_SIZE];
+  make_chunk(p, seq);
+  s.append((char *) p + from, to - from);
+};
+
+// the bytes sent on each of the two connections
+static std::string
+first_connection () {
+  std::string s;
+  for (int k = 0; k < FIRST_CHUNKS; ++k) {
+    append_chunk(s, k, k == DROP_CHUNK ? DROP_BYTES : 0);
+    if (k == EXTRA_AFTER)
+      s.append(EXTRA_BYTES, (char) 0x55);
+  }
+  append_chunk(s, FIRST_CHUNKS, 0, CUT_BYTES);
+  return s;
+};
+
+static std::string
+second_connection () {
+  std::string s;
+  append_chunk(s, 1000, CHUNK_SIZE - RESTART_BYTES - 3, CHUNK_SIZE - 3);
+  for (int k = FIRST_CHUNKS + 1; k <= LAST_CHUNK; ++k)
+    append_chunk(s, k);
+  return s;
+};
+
+// is seq one of the chunks which should be published?
+static bool
+expected (uint64_t seq) {
+  return seq <= LAST_CHUNK && seq != DROP_CHUNK && seq != FIRST_CHUNKS;
+};
+
+// a tcp_reader which stops listening once it has accepted n connections
+class test_reader : public tcp_reader {
+ public:
+  test_reader (const std::string & port, shared_ring_buffer * buf, int n) :
+    tcp_reader("127.0.0.1", port, buf),
+    n(n)
+  {};
+
+  int accept_connection() {
+    int fd = tcp_reader::accept_connection();
+    if (get_stats().connections >= (uint64_t) n)
+      set_persistent(false);
+    return fd;
+  };
+
+  // read from s, as if it had been accepted
+  void attach (int s) {fd = s;};
+
+  using tcp_reader::find_marker;
+
+ protected:
+  int n;
+};
+
+// a port on the loopback interface which is free, at least for now
+static std::string
+free_port () {
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in a;
+  memset(& a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(a);
+  bind(s, (struct sockaddr *) & a, len);
+  getsockname(s, (struct sockaddr *) & a, & len);
+  close(s);
+  return std::to_string(ntohs(a.sin_port));
+};
+
+// connect to port on the loopback interface, waiting for the reader
+// to listen; returns the socket, or -1
+static int
+connect_to (const std::string & port) {
+  struct sockaddr_in a;
+  memset(& a, 0, sizeof(a));
+  a.sin_family = AF_INET;
+  a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  a.sin_port = htons(atoi(port.c_str()));
+  for (int tries = 0; tries < 5000; ++tries) {
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (! connect(s, (struct sockaddr *) & a, sizeof(a))) {
+      int one = 1;
+      setsockopt(s, IPPROTO_TCP, TCP_NODELAY, & one, sizeof(one));
+      return s;
+    }
+    close(s);
+    usleep(1000);
+  }
+  return -1;
+};
+
+struct sender_state {
+  std::string port;
+  unsigned int seed;
+};
+
+// send both connections' bytes in pieces of random size, so that
+// reads end at arbitrary points within chunks and markers
+static void *
+sender (void * arg) {
+  sender_state * ss = (sender_state *) arg;
+  std::string conns[2] = {first_connection(), second_connection()};
+  for (int c = 0; c < 2; ++c) {
+    int s = connect_to(ss->port);
+    if (s < 0) {
+      std::cout << "unable to connect to port " << ss->port << std::endl;
+      return 0;
+    }
+    for (size_t i = 0; i < conns[c].size(); ) {
+      size_t n = std::min(conns[c].size() - i, (size_t) (1 + rand_r(& ss->seed) % 200));
+      ssize_t m = write(s, conns[c].data() + i, n);
+      if (m <= 0)
+        break;
+      i += m;
+      if (rand_r(& ss->seed) % 4 == 0)
+        usleep(200);
+    }
+    // let the reader see all of this connection's data before the next
+    usleep(20000);
+    close(s);
+  }
+  return 0;
+};
+
+static void *
+run_reader (void * arg) {
+  ((tcp_reader *) arg)->go();
+  return 0;
+};
+
+// check the chunks in a ring buffer as they are read, until its writer
+// is done; returns the number of bad ones
+static int
+check_ring (shared_ring_buffer & srb, int & nread) {
+  int bad = 0;
+  uint64_t last = 0;
+  nread = 0;
+  for (;;) {
+    unsigned char * p = srb.wait_for_chunk(0.01);
+    if (! p) {
+      if (srb.is_done())
+        break;
+      continue;
+    }
+    uint64_t seq;
+    if (! check_chunk(p, seq) || ! expected(seq) || (nread > 0 && seq <= last))
+      ++bad;
+    last = seq;
+    ++nread;
+    srb.done_reading_chunk();
+  }
+  return bad;
+};
+
+static bool
+report (const char * name, test_reader & r, int bad, int nread) {
+  tcp_reader_stats st = r.get_stats();
+  std::cout << name << ": read " << nread << " chunks; bad: " << bad
+            << "; connections: " << st.connections << "; resyncs: " << st.resyncs
+            << "; bytes skipped: " << st.bytes_skipped << std::endl;
+  bool ok = bad == 0 && nread == EXPECTED_CHUNKS && st.chunks == EXPECTED_CHUNKS
+    && st.connections == 2 && st.resyncs == EXPECTED_RESYNCS
+    && st.bytes_skipped == EXPECTED_SKIPPED
+    && st.bytes == first_connection().size() + second_connection().size();
+  if (! ok)
+    std::cout << "  ^^^ FAILED" << std::endl;
+  return ok;
+};
+
+// tcp_reader::go(), with a ring small enough to wrap many times
+static bool
+test_go () {
+  shared_ring_buffer srb(CHUNK_SIZE, NUM_CHUNKS, shared_ring_buffer::BLOCK_WRITER);
+  sender_state ss = {free_port(), 1};
+  test_reader r(ss.port, & srb, 2);
+  r.set_sync_markers(std::vector < uint64_t > (1, PULSE_METADATA_MAGIC));
+  pthread_t rt, st;
+  pthread_create(& rt, NULL, & run_reader, & r);
+  pthread_create(& st, NULL, & sender, & ss);
+  int nread;
+  int bad = check_ring(srb, nread);
+  pthread_join(st, NULL);
+  pthread_join(rt, NULL);
+  return report("go", r, bad, nread);
+};
+
+// two readers served by tcp_multi_reader, with rings large enough
+// to hold everything, which are checked once all connections close
+static bool
+test_multi () {
+  std::vector < uint64_t > markers;
+  markers.push_back(PULSE_METADATA_MAGIC);
+  markers.push_back(PULSE_METADATA_DONE_MAGIC);
+  shared_ring_buffer srb0(CHUNK_SIZE, 2 * LAST_CHUNK, shared_ring_buffer::BLOCK_WRITER);
+  shared_ring_buffer srb1(CHUNK_SIZE, 2 * LAST_CHUNK, shared_ring_buffer::BLOCK_WRITER);
+  sender_state ss0 = {free_port(), 2};
+  sender_state ss1 = {free_port(), 3};
+  test_reader r0(ss0.port, & srb0, 2);
+  test_reader r1(ss1.port, & srb1, 2);
+  r0.set_sync_markers(markers);
+  r1.set_sync_markers(markers);
+  tcp_multi_reader multi;
+  multi.add(& r0);
+  multi.add(& r1);
+  pthread_t st0, st1;
+  pthread_create(& st0, NULL, & sender, & ss0);
+  pthread_create(& st1, NULL, & sender, & ss1);
+  multi.go();
+  pthread_join(st0, NULL);
+  pthread_join(st1, NULL);
+  int nread0, nread1;
+  int bad0 = check_ring(srb0, nread0);
+  int bad1 = check_ring(srb1, nread1);
+  bool ok = report("multi reader 0", r0, bad0, nread0);
+  return report("multi reader 1", r1, bad1, nread1) && ok;
+};
+
+// fill a chunk of the unmarked stream with a pattern determined by
+// its sequence number
+static void
+fill_raw (unsigned char * p, uint64_t seq) {
+  memcpy(p, & seq, sizeof(seq));
+  for (int i = sizeof(seq); i < RAW_CHUNK_SIZE; ++i)
+    p[i] = (unsigned char) (seq * 31 + i);
+};
+
+struct raw_state {
+  shared_ring_buffer * srb;
+  uint64_t nread;   // chunks read
+  uint64_t next;    // sequence number expected next
+  uint64_t bad;     // chunks not as sent, or out of order
+  uint64_t gaps;    // places where chunks are missing
+};
+
+// read chunks from the ring, in batches, until at most keep are unread
+static void
+consume (raw_state & rs, int keep) {
+  for (;;) {
+    shared_ring_buffer_stats st = rs.srb->get_stats();
+    int unread = st.chunks_written - st.chunks_read;
+    chunk_span span[2];
+    if (unread <= keep || ! rs.srb->read_chunks(unread - keep, span))
+      break;
+    for (int j = 0; j < 2; ++j) {
+      for (int i = 0; i < span[j].n; ++i) {
+        unsigned char * p = span[j].p + i * RAW_CHUNK_SIZE, q[RAW_CHUNK_SIZE];
+        uint64_t seq;
+        memcpy(& seq, p, sizeof(seq));
+        fill_raw(q, seq);
+        if (memcmp(p, q, RAW_CHUNK_SIZE) || seq < rs.next)
+          ++rs.bad;
+        else if (seq != rs.next)
+          ++rs.gaps;
+        rs.next = seq + 1;
+        ++rs.nread;
+      }
+    }
+    rs.srb->done_reading_chunk();
+  }
+};
+
+// send the unmarked stream through a socket pair in pieces of random
+// size, reading after each piece and leaving a random number of
+// chunks unread, so that each read lands at a different place in the
+// ring.  Unless the ring drops chunks, it is never let fill, as the
+// reader would wait for room.
+static bool
+test_split (shared_ring_buffer::overrun_policy policy, const char * name) {
+  shared_ring_buffer srb(RAW_CHUNK_SIZE, RAW_NUM_CHUNKS, policy);
+  test_reader r("0", & srb, 1);
+  raw_state rs = {& srb, 0, 0, 0, 0};
+  int max_keep = policy == shared_ring_buffer::BLOCK_WRITER ? RAW_NUM_CHUNKS - 2 : RAW_NUM_CHUNKS;
+  std::string stream(RAW_CHUNKS * RAW_CHUNK_SIZE + RAW_CHUNK_SIZE / 2, 0);
+  for (int k = 0; k < RAW_CHUNKS; ++k)
+    fill_raw((unsigned char *) & stream[k * RAW_CHUNK_SIZE], k);
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+    std::cout << name << ": unable to create socket pair" << std::endl << "  ^^^ FAILED" << std::endl;
+    return false;
+  }
+  fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+  fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) | O_NONBLOCK);
+  r.attach(sv[1]);
+  unsigned int seed = 4;
+  for (size_t off = 0; off < stream.size(); ) {
+    size_t n = std::min(stream.size() - off, (size_t) (1 + rand_r(& seed) % (3 * RAW_CHUNK_SIZE)));
+    ssize_t m = write(sv[0], stream.data() + off, n);
+    if (m > 0)
+      off += m;
+    do
+      consume(rs, rand_r(& seed) % (max_keep + 1));
+    while (r.read_some() > 0);
+  }
+  close(sv[0]);
+  do
+    consume(rs, 0);
+  while (r.read_some() > 0);
+  consume(rs, 0);
+
+  tcp_reader_stats st = r.get_stats();
+  shared_ring_buffer_stats rst = srb.get_stats();
+  std::cout << name << ": read " << rs.nread << " chunks in " << st.reads << " reads; bad: " << rs.bad
+            << "; gaps: " << rs.gaps << "; published: " << st.chunks << "; dropped: " << rst.chunks_dropped << std::endl;
+  // dropped chunks aren't counted as published
+  bool ok = rs.bad == 0 && st.bytes == stream.size() && st.chunks == rs.nread
+    && rs.nread + rst.chunks_dropped == RAW_CHUNKS && rs.nread > 0;
+  if (policy == shared_ring_buffer::BLOCK_WRITER)
+    ok = ok && rs.gaps == 0 && rs.nread == RAW_CHUNKS;
+  if (! ok)
+    std::cout << "  ^^^ FAILED" << std::endl;
+  return ok;
+};
+
+// find_marker at each end of the data, absent, and cut off
+static bool
+test_find_marker () {
+  uint64_t magic = PULSE_METADATA_MAGIC;
+  unsigned char p[40];
+  memset(p, 0x55, sizeof(p));
+  int bad = test_reader::find_marker(p, sizeof(p), magic) != -1;
+  memcpy(p, & magic, sizeof(magic));
+  bad += test_reader::find_marker(p, sizeof(p), magic) != 0;
+  bad += test_reader::find_marker(p, 7, magic) != -1;
+  memset(p, 0x55, sizeof(p));
+  memcpy(p + 32, & magic, sizeof(magic));
+  bad += test_reader::find_marker(p, 40, magic) != 32;
+  bad += test_reader::find_marker(p, 39, magic) != -1;
+  // the first byte of the marker, then the whole marker
+  p[31] = p[32];
+  bad += test_reader::find_marker(p, 40, magic) != 32;
+  std::cout << "find_marker: wrong offsets: " << bad << std::endl;
+  if (bad)
+    std::cout << "  ^^^ FAILED" << std::endl;
+  return ! bad;
+};
+
+int
+main (int argc, char *argv[]) {
+  bool ok = test_split(shared_ring_buffer::BLOCK_WRITER, "split reads");
+  ok = test_split(shared_ring_buffer::DROP_NEWEST, "split reads, dropping newest") && ok;
+  ok = test_find_marker() && ok;
+  ok = test_go() && ok;
+  ok = test_multi() && ok;
+  if (! ok) {
+    std::cout << "FAILED" << std::endl;
+    return 1;
+  }
+  std::cout << "PASSED" << std::endl;
+  return 0;
+}
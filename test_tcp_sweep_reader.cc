@@ -0,0 +1,235 @@
+/**
+   @file test_tcp_sweep_reader.cc
+   @brief round-trip test for tcp_sweep_reader: a stream of simulated
+   digdar pulses is fed through a socket pair, sometimes many pulses
+   at once and sometimes in pieces that end part-way through a pulse.
+   The stream has sweeps that change within a batch (twice, in one
+   case), a sweep with more pulses than a file holds, pulses whose
+   sync marker is damaged, and digdar's closing pulse.  The sweep
+   files written must read back with exactly the intact pulses sent,
+   and the reader's counters must account for the damaged ones.  This
+   is done with whole sweeps written at once, and with streamed
+   format 2 files.
+
+   Returns 0 on success, 1 on failure.
+
+   @author John Brzustowski <jbrzusto is at fastmail dot fm>
+   @license GPL v2 or later
+ */
+
+#include "tcp_sweep_reader.h"
+#include "sweep_file_reader.h"
+#include <iostream>
+#include <fstream>
+#include <stdexcept>
+#include <boost/filesystem.hpp>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define NS 300
+#define MAX_PULSES 100
+#define PULSE_SIZE (tcp_sweep_reader::HEADER_SIZE + NS * (int) sizeof(uint16_t))
+
+// pulses in each sweep: the first ends within a batch, the third is
+// short enough to begin and end within one, and the last is truncated
+static const int sweep_pulses[] = {70, 90, 5, 110};
+#define NUM_SWEEPS 4
+
+// pulses, counted from the start of the stream, whose marker is damaged
+static const int damaged[] = {40, 120};
+#define NUM_DAMAGED 2
+
+// the stream is sent in pieces of random size, except for these runs
+// of pulses, which are sent at once: {first pulse, number of pulses}
+static const int runs[][2] = {{0, 100}, {150, 30}};
+#define NUM_RUNS 2
+
+// an echo-like sample; never has a byte that begins a marker
+static uint16_t
+sample (int arp, int p, int i) {
+  return (uint16_t) (1000 + (i * 7 + p * 3 + arp) % 500 + ((i * 31 + p * 17) & 7));
+};
+
+static bool
+is_damaged (int k) {
+  for (int i = 0; i < NUM_DAMAGED; ++i)
+    if (damaged[i] == k)
+      return true;
+  return false;
+};
+
+// the stream of pulses, as digdar sends it
+static std::string
+make_stream () {
+  std::string s;
+  int k = 0;
+  for (int arp = 0; arp < NUM_SWEEPS; ++arp) {
+    for (int p = 0; p < sweep_pulses[arp]; ++p, ++k) {
+      pulse_metadata pm;
+      pm.magic_number = PULSE_METADATA_MAGIC;
+      pm.arp_clock_sec = 1600000000 + 3 * arp;
+      pm.arp_clock_nsec = 0;
+      pm.trig_clock = p * 1000;
+      pm.acp_clock = p / 100.0;
+      pm.num_trig = p;
+      pm.num_arp = arp;
+      if (is_damaged(k))
+        pm.magic_number ^= 0x10;
+      s.append((char *) & pm, tcp_sweep_reader::HEADER_SIZE);
+      for (int i = 0; i < NS; ++i) {
+        uint16_t x = sample(arp, p, i);
+        s.append((char *) & x, sizeof(x));
+      }
+    }
+  }
+  // digdar's closing pulse isn't recorded
+  pulse_metadata pm;
+  memset(& pm, 0, sizeof(pm));
+  pm.magic_number = PULSE_METADATA_DONE_MAGIC;
+  pm.num_arp = NUM_SWEEPS;
+  s.append((char *) & pm, tcp_sweep_reader::HEADER_SIZE);
+  s.append(NS * sizeof(uint16_t), 0);
+  return s;
+};
+
+// a tcp_sweep_reader fed from a socket the test made
+class test_sweep_reader : public tcp_sweep_reader {
+ public:
+  test_sweep_reader (sweep_file_writer * cap) :
+    tcp_sweep_reader("127.0.0.1", "0", cap, NS)
+  {};
+
+  // read from s, as if it had been accepted
+  void attach (int s) {fd = s;};
+};
+
+// the bytes of the stream, from off, to send next
+static size_t
+piece (size_t off, size_t len, unsigned int & seed) {
+  for (int r = 0; r < NUM_RUNS; ++r) {
+    size_t begin = (size_t) runs[r][0] * PULSE_SIZE, end = begin + (size_t) runs[r][1] * PULSE_SIZE;
+    if (off == begin)
+      return end - off;
+    if (off < begin && off + len > begin)
+      len = begin - off;
+  }
+  size_t n = 1 + rand_r(& seed) % 3000;
+  return n < len ? n : len;
+};
+
+// feed the stream to r through a socket pair, letting it read all it
+// can after each piece; returns false if the pair can't be made
+static bool
+feed (test_sweep_reader & r, const std::string & stream) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+    return false;
+  int size = 1 << 20;
+  setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, & size, sizeof(size));
+  fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+  fcntl(sv[1], F_SETFL, fcntl(sv[1], F_GETFL) | O_NONBLOCK);
+  r.attach(sv[1]);
+  unsigned int seed = 1;
+  for (size_t off = 0; off < stream.size(); ) {
+    size_t n = piece(off, stream.size() - off, seed);
+    for (size_t sent = 0; sent < n; ) {
+      ssize_t m = write(sv[0], stream.data() + off + sent, n - sent);
+      if (m > 0)
+        sent += m;
+      while (r.read_some() > 0)
+        ;
+    }
+    off += n;
+  }
+  close(sv[0]);
+  while (r.read_some() > 0)
+    ;
+  return true;
+};
+
+static bool
+run_test (const std::string & folder, const char * name, int format, int block_pulses) {
+  boost::filesystem::remove_all(folder);
+  boost::filesystem::create_directories(folder);
+  std::string log = folder + "/log.txt";
+  std::vector < uint64_t > markers;
+  markers.push_back(PULSE_METADATA_MAGIC);
+  markers.push_back(PULSE_METADATA_DONE_MAGIC);
+  std::string stream = make_stream();
+  tcp_reader_stats st;
+  {
+    sweep_file_writer sfw(folder, "TEST", log, MAX_PULSES, NS, 16, 0, 125, 1, "sum");
+    sfw.set_format(format);
+    if (block_pulses > 0)
+      sfw.set_block_pulses(block_pulses);
+    test_sweep_reader r(& sfw);
+    r.set_sync_markers(markers);
+    if (! feed(r, stream)) {
+      std::cout << name << ": unable to create socket pair" << std::endl << "  ^^^ FAILED" << std::endl;
+      return false;
+    }
+    st = r.get_stats();
+  }
+
+  // every intact pulse sent must be in its sweep's file, up to the
+  // sweep's capacity
+  std::ifstream logfs(log.c_str());
+  std::string path;
+  int arp = 0, k = 0;
+  uint64_t bad = 0;
+  try {
+    for (; arp < NUM_SWEEPS && std::getline(logfs, path); ++arp) {
+      sweep_file_reader sfr(path);
+      std::vector < int > sent;
+      for (int p = 0; p < sweep_pulses[arp]; ++p, ++k)
+        if (! is_damaged(k) && sent.size() < MAX_PULSES)
+          sent.push_back(p);
+      int np = sent.size();
+      if (sfr.get_np() != np || sfr.get_ns() != NS || atoi(sfr.get_field("arp").c_str()) != arp) {
+        ++bad;
+        continue;
+      }
+      const uint16_t * x = sfr.get_samples();
+      for (int j = 0; j < np; ++j) {
+        int p = sent[j];
+        if (sfr.get_clocks()[j] != (uint32_t) p * 1000 || sfr.get_trigs()[j] != (uint32_t) p || sfr.get_azi()[j] != (float) (p / 100.0))
+          ++bad;
+        for (int i = 0; i < NS; ++i)
+          if (x[j * NS + i] != sample(arp, p, i))
+            ++bad;
+      }
+    }
+  } catch (std::runtime_error & e) {
+    std::cout << e.what() << std::endl;
+    ++bad;
+  }
+  bool extra = (bool) std::getline(logfs, path);
+  bool ok = bad == 0 && arp == NUM_SWEEPS && ! extra
+    && st.chunks == (uint64_t) (k - NUM_DAMAGED)
+    && st.resyncs == NUM_DAMAGED
+    && st.bytes_skipped == (uint64_t) NUM_DAMAGED * PULSE_SIZE
+    && st.bytes == stream.size();
+  std::cout << name << ": files: " << arp + extra << "; mismatches: " << bad << "; pulses: " << st.chunks
+            << "; resyncs: " << st.resyncs << "; bytes skipped: " << st.bytes_skipped << std::endl;
+  if (! ok)
+    std::cout << "  ^^^ FAILED" << std::endl;
+  return ok;
+};
+
+int
+main (int argc, char *argv[]) {
+  std::string folder = argc > 1 ? argv[1] : "/tmp/test_tcp_sweep_reader";
+  bool ok = run_test(folder, "whole sweeps", 1, 0);
+  ok = run_test(folder, "format 2, streamed", 2, 32) && ok;
+  boost::filesystem::remove_all(folder);
+
+  if (! ok) {
+    std::cout << "FAILED" << std::endl;
+    return 1;
+  }
+  std::cout << "PASSED" << std::endl;
+  return 0;
+}